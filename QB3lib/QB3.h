@@ -16,6 +16,7 @@ Contributors:  Lucian Plesea
 */
 
 #if !defined(QB3_H)
+#define QB3_H
 // For size_t
 #include <stddef.h>
 // For uint64_t
@@ -30,23 +31,34 @@ Contributors:  Lucian Plesea
 #if defined(__cplusplus)
 extern "C" {
 #endif
-// Max number of bands <= 256, changes size of the control structures
-#define QB3_MAXBANDS 16
+// Max number of bands, the per band state is allocated for the actual number of bands
+#define QB3_MAXBANDS 256
+// Max width and height, sizes over 65536 use the "XS" chunk
+#define QB3_MAXSIZE 0x100000000ull
 
 typedef struct encs * encsp; // encoder
 typedef struct decs * decsp; // decoder
 
 // Data types
-enum qb3_dtype { QB3_U8 = 0, QB3_I8, QB3_U16, QB3_I16, QB3_U32, QB3_I32, QB3_U64, QB3_I64 };
+// Floating point values are encoded as order preserving integers, or with a bounded error
+enum qb3_dtype { QB3_U8 = 0, QB3_I8, QB3_U16, QB3_I16, QB3_U32, QB3_I32, QB3_U64, QB3_I64, QB3_F32, QB3_F64 };
 
 // To check if the library has QB3M_FTL
 #define QB3_HAS_FTL 1
 
+// To check if the library has QB3M_MED and QB3M_MED_BEST
+#define QB3_HAS_MED 1
+
+// To check if the library has QB3M_LZ_H and QB3M_CF_LZ_H
+#define QB3_HAS_LZ 1
+
 // Encode mode
 // Default is fastest, and faster decoding
 // Base is barely better than FTL, 20% slower than FTL
 // Best is best compression, 2x slower than base for encoding, 
 //      slightly slower than base for decoding
+// MED modes use a 2D median edge detector predictor instead of the running delta,
+//      better compression for smooth images, but slower
 enum qb3_mode {
     // Aliases, values might change
     QB3M_DEFAULT = 8, // FTL
@@ -67,6 +79,14 @@ enum qb3_mode {
 
     // Faster and only slightly worse than base
     QB3M_FTL = 8, // Fastest, Hilbert base - step
+
+    // 2D prediction from the left, top and top-left neighbours
+    QB3M_MED = 9, // MED + base
+    QB3M_MED_BEST = 10, // MED + CF + index
+
+    // Byte oriented LZ second stage, like RLE but better for repeated patterns
+    QB3M_LZ_H = 11, // Hilbert base + LZ
+    QB3M_CF_LZ_H = 12, // Hilbert + CF + LZ
     QB3M_END, // Marks the end of the settable modes
 
     QB3M_STORED = 255, // Raw bypass, can't be requested
@@ -85,6 +105,7 @@ enum qb3_error {
 // In QB3encode.cpp
 
 // Call before anything else
+// Returns nullptr if a size is not valid or the image size in bytes is too large for a size_t
 LIBQB3_EXPORT encsp qb3_create_encoder(size_t width, size_t height, size_t bands, qb3_dtype dt);
 // Call when done with the encoder
 LIBQB3_EXPORT void qb3_destroy_encoder(encsp p);
@@ -102,10 +123,78 @@ LIBQB3_EXPORT void qb3_reset_encoder(encsp p);
 // The cband array might be modified if core bands are not valid or iterrative
 LIBQB3_EXPORT bool qb3_set_encoder_coreband(encsp p, size_t bands, size_t *cband);
 
+// Use a linear predictor from the core band for the derived bands,
+// instead of plain subtraction. The coefficients are fitted from the input
+// by qb3_encode. Returns false if there is a single band or for floating point types
+LIBQB3_EXPORT bool qb3_set_encoder_bandpredictor(encsp p, bool linear);
+
 // Sets quantization parameters, returns true on success
 // away = true -> round away from zero
+// Floating point types can't be quantized
 LIBQB3_EXPORT bool qb3_set_encoder_quanta(encsp p, uint64_t q, bool away);
 
+// Sets the maximum absolute error for floating point types, 0 is lossless
+// The values are placed on a grid with a step just under twice the error. The encoding is lossless
+// if the error is below the floating point resolution of the values. The encoding fails if
+// the values are not finite or if the range is too large for the error
+// Returns false for integer types or if the error is not valid
+LIBQB3_EXPORT bool qb3_set_encoder_maxerror(encsp p, double maxerr);
+
+// Try a per band palette, used when every band has at most 256 distinct values
+// The values are replaced by their index in the sorted palette, which is stored in the header
+// Only used for lossless encoding, without a reference frame or the linear band predictor
+LIBQB3_EXPORT void qb3_set_encoder_palette(encsp p, bool palette);
+
+// Try coding repeated blocks as a copy of a recent block in the same or the previous block row
+// Helps screen-like content with repeated patterns, only used by the CF modes, off by default
+LIBQB3_EXPORT void qb3_set_encoder_blockcopy(encsp p, bool blockcopy);
+
+// Adapt the rung switch codes to the recent rung changes, per band
+// Usually smaller, most for low rung data, decoding is slightly slower. Not used by QB3M_FTL
+LIBQB3_EXPORT void qb3_set_encoder_adaptive(encsp p, bool adaptive);
+
+// Block size, 4 (default) or 8. The 8x8 blocks have a single rung, which may be smaller for smooth
+// high bit depth data. Only used by the Hilbert base modes (QB3M_BASE_H, QB3M_RLE_H, QB3M_LZ_H)
+// for images at least 8 x 8. Call before qb3_max_encoded_size. Returns false if the size is not valid
+LIBQB3_EXPORT bool qb3_set_encoder_blocksize(encsp p, size_t size);
+
+// Try a few scanning curves on a sample of blocks and use the best one, stored in the "SC" chunk
+// Only for integer types, with the Hilbert curve modes except the MED ones, off by default
+LIBQB3_EXPORT void qb3_set_encoder_curvesearch(encsp p, bool search);
+
+// Skip the blocks where all the values are the NoData value, the decoder fills them
+// The value has to be exact in the data type. The block mask is stored in the "ND" chunk,
+// it is not used by the MED modes or when it doesn't save space. Returns false if the value is not valid
+LIBQB3_EXPORT bool qb3_set_encoder_nodata(encsp p, bool nodata, double value);
+
+// Encode each core band and its derived bands as a separate stream, the stream sizes are stored
+// in the "BG" chunk. Allows decoding the band groups independently. Not used by the RLE and LZ modes
+LIBQB3_EXPORT void qb3_set_encoder_planar(encsp p, bool planar);
+
+// Store the per band minimum, maximum, sum and count of the input values in the "st" chunk
+// The NoData values and NaN are not included. Read with qb3_get_stats, without decoding the data
+LIBQB3_EXPORT void qb3_set_encoder_stats(encsp p, bool stats);
+
+// Store the number of bits of the largest residual per block row and band in the "rs" chunk
+// Zero for rows which are constant along the scanning curve or NoData, higher for busy rows
+// Not stored for the stored mode, images smaller than a block or if it doesn't fit. Read with qb3_get_rungs
+LIBQB3_EXPORT void qb3_set_encoder_summary(encsp p, bool summary);
+
+// Store a CRC32C checksum per block row strip and band group stream in the "ck" chunk
+// The checksums are over the QB3 encoded data, before RLE or LZ, see qb3_set_decoder_verify
+// Not stored for the stored mode, images smaller than a block or if they don't fit
+LIBQB3_EXPORT void qb3_set_encoder_checksum(encsp p, bool checksum);
+
+// Encode the difference from a reference frame, usually the previous frame of a sequence
+// The reference has the same size, type and layout as the input, nullptr turns it off
+// The pointer is kept, the reference has to be valid when qb3_encode is called
+// Only lossless encoding can use a reference frame
+LIBQB3_EXPORT void qb3_set_encoder_reference(encsp p, const void* ref);
+
+// Key frame interval, every interval-th image is encoded without the reference,
+// starting with the first one after creation or reset. 0, the default, disables key frames
+LIBQB3_EXPORT void qb3_set_encoder_keyframes(encsp p, size_t interval);
+
 // Upper bound of encoded size, without taking the header into consideration
 LIBQB3_EXPORT size_t qb3_max_encoded_size(const encsp p);
 
@@ -116,14 +205,34 @@ LIBQB3_EXPORT qb3_mode qb3_set_encoder_mode(encsp p, qb3_mode mode);
 // Set line to line stride, in dtype units, defaults to xsize * nbands
 LIBQB3_EXPORT void qb3_set_encoder_stride(encsp p, size_t stride);
 
+// Set the pixel to pixel, line to line and band to band strides, in dtype units
+// For band sequential input, pixel = 1, line = xsize and band = xsize * ysize
+// Returns false if a stride is zero
+LIBQB3_EXPORT bool qb3_set_encoder_layout(encsp p, size_t pixel, size_t line, size_t band);
+
+// Encode a subset of the input channels, band c of the image is channel bands[c] of the input
+// The input has nchannels per pixel, bands holds one value per band, nullptr to use all channels
+// The default pixel stride is nchannels, for example RGB from RGBA is nchannels = 4, bands = {0, 1, 2}
+// Returns false if a channel is out of range
+LIBQB3_EXPORT bool qb3_set_encoder_bands(encsp p, size_t nchannels, const size_t* bands);
+
 // Encode the source into destination buffer, which should be at least qb3_max_encoded_size
-// Source organization is expected to be y major, then x, then band (interleaved)
+// Source organization is expected to be y major, then x, then band (interleaved), unless a layout is set
 // Returns actual size, the encoder can be reused
 LIBQB3_EXPORT size_t qb3_encode(encsp p, void *source, void *destination);
 
 // Returns !0 if last encode call failed
 LIBQB3_EXPORT int qb3_get_encoder_state(encsp p);
 
+// Image sequences, stored as concatenated QB3 frames followed by an index
+
+// Size of the index for a sequence of nframes
+LIBQB3_EXPORT size_t qb3_seq_index_size(size_t nframes);
+
+// Writes the index, given the size of each frame and the key frame interval
+// Returns the index size, or 0 if it fails
+LIBQB3_EXPORT size_t qb3_seq_write_index(void* destination, size_t nframes, const size_t* sizes, size_t interval);
+
 
 // In QB3decode.cpp
 
@@ -135,9 +244,18 @@ LIBQB3_EXPORT decsp qb3_read_start(void* source, size_t source_size, size_t* ima
 // Call after qb3_read_start, reads all headers until the raster data, returns false if it fails
 LIBQB3_EXPORT bool qb3_read_info(decsp p);
 
-// Call after qb3_read_info, reads all the data, returns bytes read
+// Call after qb3_read_info, reads all the data, returns the output size in bytes, 0 if it fails
+// The output size is xsize * ysize * channels of the output type, see qb3_set_decoder_bands and qb3_set_decoder_output
 LIBQB3_EXPORT size_t qb3_read_data(decsp p, void* destination);
 
+// Call after qb3_read_info instead of qb3_read_data, checks the data without decoding it
+// Parses all the groups and checks that the data ends where expected, without an output buffer
+// Returns true if no error is detected. If not null, offset receives the position of the
+// first error from the start of the input, or the end of the data. The errors in RLE and LZ
+// compressed data are reported at the start of the data. Not all errors are detected, unless the
+// strip checksums are stored, then the errors are reported at the start of the strip which holds them
+LIBQB3_EXPORT bool qb3_validate(decsp p, size_t* offset);
+
 LIBQB3_EXPORT void qb3_destroy_decoder(decsp p);
 
 LIBQB3_EXPORT size_t qb3_decoded_size(const decsp p);
@@ -147,20 +265,97 @@ LIBQB3_EXPORT qb3_dtype qb3_get_type(const decsp p);
 // Set line to line stride, in dtype units, defaults to xsize * nbands
 LIBQB3_EXPORT void qb3_set_decoder_stride(decsp p, size_t stride);
 
+// Set the pixel to pixel, line to line and band to band strides, in dtype units
+// For band sequential output, pixel = 1, line = xsize and band = xsize * ysize
+// Returns false if a stride is zero
+LIBQB3_EXPORT bool qb3_set_decoder_layout(decsp p, size_t pixel, size_t line, size_t band);
+
+// Output channel without a band, for qb3_set_decoder_bands
+#define QB3_FILL (~(size_t)0)
+
+// Decode a subset of the bands, channel i of the output is band bands[i] of the image
+// The output has nchannels per pixel, the other bands are decoded but not stored
+// The channels set to QB3_FILL get the fill value, see qb3_set_decoder_output
+// For example, RGBA from RGB is nchannels = 4, bands = {0, 1, 2, QB3_FILL}
+// The default pixel stride is nchannels, nullptr bands restores the output of all bands
+// The reference frame has the same layout as the output
+// Returns false if a band is out of range or repeated
+LIBQB3_EXPORT bool qb3_set_decoder_bands(decsp p, size_t nchannels, const size_t* bands);
+
+// Convert the values to the output type while decoding, without a second pass over the output
+// The output value is value * scale + offset, rounded and clamped to the range of integer types
+// For example, 8 bit from 16 bit is QB3_U8 with scale 1.0 / 256, the fill value is not scaled
+// The strides are in output type units, the reference frame can't be used with a conversion
+// Returns false if the type is not valid
+LIBQB3_EXPORT bool qb3_set_decoder_output(decsp p, qb3_dtype type, double scale, double offset, double fill);
+
+// Check the strip checksums while decoding, if they are stored, qb3_read_data fails on a mismatch
+// qb3_validate always checks them
+LIBQB3_EXPORT void qb3_set_decoder_verify(decsp p, bool verify);
+
+// Reference frame, required when qb3_get_reference returns true
+// It has the same size, type and layout as the output, it is ignored otherwise
+LIBQB3_EXPORT void qb3_set_decoder_reference(decsp p, const void* ref);
+
+// Per band statistics of the decoded values, computed by qb3_read_data, before the output conversion
+// stats holds 4 values per band, the minimum, maximum, sum and count, the NoData values are not included
+// hist is nullptr or holds 256 or 65536 counts per band for 8 and 16 bit types, indexed by value - type minimum
+// The bands which are not in the output have a zero count, nullptr stats turns them off
+// Returns false if the histogram is not available for the type
+LIBQB3_EXPORT bool qb3_set_decoder_stats(decsp p, double* stats, uint64_t* hist);
+
 // Query settings, valid after qb3_read_info
 
+// Returns true if the image is encoded as the difference from a reference frame
+LIBQB3_EXPORT bool qb3_get_reference(const decsp p);
+
+// Returns true if the image has a NoData block mask, and sets the value if not null
+LIBQB3_EXPORT bool qb3_get_nodata(const decsp p, double* value);
+
+// Per band statistics of the input values stored by the encoder, valid after qb3_read_info
+// 4 values per band, the minimum, maximum, sum and count, as for qb3_set_decoder_stats
+// Returns false if they are not stored
+LIBQB3_EXPORT bool qb3_get_stats(const decsp p, double* stats);
+
+// Rung summary stored by the encoder, returns the number of block rows, 0 if it is not stored
+// The block rows are 4 lines, or 8 for 8x8 blocks. If not null, rungs receives one byte per block row and band
+LIBQB3_EXPORT size_t qb3_get_rungs(const decsp p, uint8_t* rungs);
+
+// Returns true if the strip checksums are stored
+LIBQB3_EXPORT bool qb3_get_checksum(const decsp p);
+
+// Returns the number of band group streams, 0 if the bands are interleaved in a single stream
+LIBQB3_EXPORT size_t qb3_get_planar(const decsp p);
+
 // Encoding mode used, returns QB3M_INVALID if failed
 LIBQB3_EXPORT qb3_mode qb3_get_mode(const decsp p);
 
 // Returns the number of quantization bits used, returns 0 if failed
 LIBQB3_EXPORT uint64_t qb3_get_quanta(const decsp p);
 
+// Maximum absolute error for floating point types, 0 if lossless or failed
+LIBQB3_EXPORT double qb3_get_maxerror(const decsp p);
+
 // Return the scanning curve used, returns 0 if failed
 LIBQB3_EXPORT uint64_t qb3_get_order(const decsp p);
 
 // Sets the cband array and returns true if successful
 LIBQB3_EXPORT bool qb3_get_coreband(const decsp p, size_t *cband);
 
+// Linear band predictor coefficients, three per band, a, b and s
+// A derived band is coded as value - ((a * coreband + b) >> s)
+// Returns false if the linear band predictor is not used
+LIBQB3_EXPORT bool qb3_get_bandpredictor(const decsp p, int64_t *coefs);
+
+// Returns the number of palette entries for a band, 0 if there is no palette
+// If not null, values receives the entries, as the bits of the value type
+LIBQB3_EXPORT size_t qb3_get_palette(const decsp p, size_t band, uint64_t *values);
+
+// Reads the index from a whole sequence, returns the number of frames, 0 if it fails
+// If not null, offsets receives nframes + 1 values, the start of each frame and the start of the index
+// The reference for a frame is the previous frame, except for key frames
+LIBQB3_EXPORT size_t qb3_seq_read_index(const void* source, size_t size, size_t* offsets, size_t* interval);
+
 #if defined(__cplusplus)
 }
 
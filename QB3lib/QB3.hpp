@@ -0,0 +1,199 @@
+/*
+Content: C++ API for QB3 library, the value type and the number of bands are template parameters
+The plain images are encoded and decoded by the library kernels, instantiated for the type and the band count
+
+Copyright 2021-2026 Esri
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+http://www.apache.org/licenses/LICENSE-2.0
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+
+Contributors:  Lucian Plesea
+*/
+
+#if !defined(QB3_HPP)
+#define QB3_HPP
+#include "QB3.h"
+// The internal headers, for the kernels
+#include "QB3encode.h"
+#include "QB3decode.h"
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+// For example, to encode and decode an RGB 16 bit image
+//  auto encoded = qb3::encode<uint16_t, 3>(image, xsize, ysize);
+//  bool ok = qb3::decode<uint16_t, 3>(encoded.data(), encoded.size(), output, xsize, ysize);
+// The images are band interleaved, the C API setters can be called on get() for other options
+// The options which the kernels don't handle by themselves use the C API functions
+namespace qb3 {
+
+// QB3 type of a C++ value type, other types don't compile
+template<typename T> struct dtype;
+template<> struct dtype<uint8_t> : std::integral_constant<qb3_dtype, QB3_U8> {};
+template<> struct dtype<int8_t> : std::integral_constant<qb3_dtype, QB3_I8> {};
+template<> struct dtype<uint16_t> : std::integral_constant<qb3_dtype, QB3_U16> {};
+template<> struct dtype<int16_t> : std::integral_constant<qb3_dtype, QB3_I16> {};
+template<> struct dtype<uint32_t> : std::integral_constant<qb3_dtype, QB3_U32> {};
+template<> struct dtype<int32_t> : std::integral_constant<qb3_dtype, QB3_I32> {};
+template<> struct dtype<uint64_t> : std::integral_constant<qb3_dtype, QB3_U64> {};
+template<> struct dtype<int64_t> : std::integral_constant<qb3_dtype, QB3_I64> {};
+template<> struct dtype<float> : std::integral_constant<qb3_dtype, QB3_F32> {};
+template<> struct dtype<double> : std::integral_constant<qb3_dtype, QB3_F64> {};
+
+// The kernels work on the unsigned integer type of the same size
+template<size_t S> struct utype;
+template<> struct utype<1> { typedef uint8_t type; };
+template<> struct utype<2> { typedef uint16_t type; };
+template<> struct utype<4> { typedef uint32_t type; };
+template<> struct utype<8> { typedef uint64_t type; };
+
+// The fast encoding kernel, NB is the number of bands with the default band mapping, or 0
+template<typename T, bool SKIPSTEP, size_t NB> struct fast {
+    static int encode(const T* image, oBits& s, encs& info) {
+        return QB3::encode_fast<T, SKIPSTEP, B, NB>(image, s, info);
+    }
+};
+
+// The byte values have their own kernel
+template<bool SKIPSTEP, size_t NB> struct fast<uint8_t, SKIPSTEP, NB> {
+    static int encode(const uint8_t* image, oBits& s, encs& info) {
+        return QB3::ef<SKIPSTEP, NB>(image, s, info);
+    }
+};
+
+// Encoder for images with BANDS values of type T per pixel
+template<typename T, size_t BANDS>
+class encoder {
+    static_assert(BANDS > 0 && BANDS <= QB3_MAXBANDS, "Invalid number of bands");
+public:
+    encoder(size_t xsize, size_t ysize, qb3_mode mode = QB3M_DEFAULT)
+        : p(qb3_create_encoder(xsize, ysize, BANDS, dtype<T>::value))
+    {
+        if (p)
+            qb3_set_encoder_mode(p, mode);
+    }
+    ~encoder() {
+        if (p)
+            qb3_destroy_encoder(p);
+    }
+    encoder(const encoder&) = delete;
+    encoder& operator=(const encoder&) = delete;
+
+    // False if the size is not valid
+    explicit operator bool() const { return nullptr != p; }
+    encsp get() const { return p; }
+    size_t max_size() const { return p ? qb3_max_encoded_size(p) : 0; }
+
+    // Returns the encoded size, 0 if it fails. dst has to hold max_size() bytes
+    // The image is not modified
+    size_t encode(const T* image, void* dst) {
+        if (!p)
+            return 0;
+        const size_t hsize(qb3_encode_direct(p, dst));
+        if (!hsize)
+            return qb3_encode(p, const_cast<T*>(image), dst);
+        typedef typename utype<sizeof(T)>::type U;
+        auto src = reinterpret_cast<const U*>(image);
+        oBits s(static_cast<uint8_t*>(dst) + hsize);
+        if (QB3M_FTL == p->mode)
+            p->error = (fixed_bands(*p) == NB) ? fast<U, true, NB>::encode(src, s, *p)
+                : fast<U, true, 0>::encode(src, s, *p);
+        else
+            p->error = (fixed_bands(*p) == NB) ? fast<U, false, NB>::encode(src, s, *p)
+                : fast<U, false, 0>::encode(src, s, *p);
+        if (p->error)
+            return 0;
+        // Stored if it doesn't compress, same as qb3_encode
+        const size_t len(hsize + s.tobyte());
+        return (len < p->xsize * p->ysize * BANDS * sizeof(T)) ? len : qb3_encode(p, const_cast<T*>(image), dst);
+    }
+
+private:
+    // The bands with a compile time kernel, RGB and RGBA with the default band mapping, see fixed_bands
+    static constexpr size_t NB = (1 == BANDS || 3 == BANDS || 4 == BANDS) ? BANDS : 0;
+    encsp p;
+};
+
+// Decoder for images with BANDS values of type T per pixel
+// The number of bands has to match. If the stored type is different, the values are converted
+// to T while decoding, rounded and clamped as with qb3_set_decoder_output
+template<typename T, size_t BANDS>
+class decoder {
+    static_assert(BANDS > 0 && BANDS <= QB3_MAXBANDS, "Invalid number of bands");
+public:
+    decoder(const void* src, size_t len) : xsize(0), ysize(0)
+    {
+        size_t size[3] = {};
+        p = qb3_read_start(const_cast<void*>(src), len, size);
+        if (p && qb3_read_info(p) && size[2] == BANDS
+            && (qb3_get_type(p) == dtype<T>::value || qb3_set_decoder_output(p, dtype<T>::value, 1, 0, 0))) {
+            xsize = size[0];
+            ysize = size[1];
+        }
+    }
+    ~decoder() {
+        if (p)
+            qb3_destroy_decoder(p);
+    }
+    decoder(const decoder&) = delete;
+    decoder& operator=(const decoder&) = delete;
+
+    // False if the headers are not valid or the stream doesn't match T and BANDS
+    explicit operator bool() const { return 0 != xsize; }
+    decsp get() const { return p; }
+    size_t width() const { return xsize; }
+    size_t height() const { return ysize; }
+
+    // Decodes width() * height() * BANDS values, returns false if it fails
+    bool decode(T* image) {
+        if (!*this)
+            return false;
+        if (!qb3_read_direct(p))
+            return 0 != qb3_read_data(p, image);
+        typedef typename utype<sizeof(T)>::type U;
+        auto dst = reinterpret_cast<U*>(image);
+        if (B8 == p->bsize ? QB3::decode<U, B8>(p->s_in, p->s_size, dst, *p)
+            : QB3::decode<U>(p->s_in, p->s_size, dst, *p)) {
+            p->error = QB3E_EINV;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    decsp p;
+    size_t xsize, ysize;
+};
+
+// Encodes a band interleaved image, returns the encoded size, 0 if it fails
+// dst has to hold encoder<T, BANDS>::max_size() bytes
+template<typename T, size_t BANDS>
+size_t encode(const T* image, size_t xsize, size_t ysize, void* dst, qb3_mode mode = QB3M_DEFAULT) {
+    encoder<T, BANDS> enc(xsize, ysize, mode);
+    return enc.encode(image, dst);
+}
+
+// Encodes a band interleaved image, returns the encoded bytes, empty if it fails
+template<typename T, size_t BANDS>
+std::vector<uint8_t> encode(const T* image, size_t xsize, size_t ysize, qb3_mode mode = QB3M_DEFAULT) {
+    encoder<T, BANDS> enc(xsize, ysize, mode);
+    std::vector<uint8_t> dst(enc.max_size());
+    dst.resize(enc.encode(image, dst.data()));
+    return dst;
+}
+
+// Decodes to a band interleaved image, returns false if it fails or the size doesn't match
+template<typename T, size_t BANDS>
+bool decode(const void* src, size_t len, T* image, size_t xsize, size_t ysize) {
+    decoder<T, BANDS> dec(src, len);
+    return dec.width() == xsize && dec.height() == ysize && dec.decode(image);
+}
+
+} // namespace qb3
+#endif
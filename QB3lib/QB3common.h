@@ -15,7 +15,9 @@ limitations under the License.
 Contributors:  Lucian Plesea
 */
 
-// This file is only used during library build
+#if !defined(QB3COMMON_H)
+#define QB3COMMON_H
+// Used by the library build and by QB3.hpp
 // Include the linkage file generated by CMake before QB3.h
 #include "libqb3_export.h"
 #include "QB3.h"
@@ -23,6 +25,8 @@ Contributors:  Lucian Plesea
 #include <cinttypes>
 #include <utility>
 #include <type_traits>
+#include <cstring>
+#include <vector>
 
 #if defined(_WIN32)
 #include <intrin.h>
@@ -34,6 +38,18 @@ constexpr auto TBLMASK = 0xfffull;
 // Block is 4x4 pixels
 constexpr size_t B = 4;
 constexpr size_t B2 = B * B;
+// Optional larger block, 8x8 pixels, coded as four B2 groups which share the rung
+constexpr size_t B8 = 8;
+
+// Maximum number of palette entries per band
+constexpr size_t PALSZ = 256;
+
+// LZ second stage, minimum match length and the size of the decoded size prefix
+constexpr size_t LZ_MINMATCH = 4;
+constexpr size_t LZ_PREFIX = 8;
+
+// Bytes per chunk of pixels when adding the core bands back, fits in the L1 cache
+constexpr size_t UNBAND_CHUNK = 16384;
 
 #if QB3_MAXBANDS > 256
 #error QB3_MAXBANDS too large
@@ -60,10 +76,149 @@ static size_t topbit(uint64_t v) {
 }
 #endif
 
+// CRC32C (Castagnoli) of a byte buffer, continuing from crc
+// Uses the SSE4.2 or ARMv8 CRC instructions when the build enables them
+#if (defined(__x86_64__) || defined(_M_X64)) && (defined(__SSE4_2__) || defined(__AVX2__))
+#include <nmmintrin.h>
+static uint32_t crc32c(const uint8_t* data, size_t len, uint32_t crc = 0) {
+    uint64_t c(~crc);
+    for (; len >= 8; len -= 8, data += 8) {
+        uint64_t v;
+        memcpy(&v, data, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    auto c32(static_cast<uint32_t>(c));
+    while (len--)
+        c32 = _mm_crc32_u8(c32, *data++);
+    return ~c32;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+static uint32_t crc32c(const uint8_t* data, size_t len, uint32_t crc = 0) {
+    crc = ~crc;
+    for (; len >= 8; len -= 8, data += 8) {
+        uint64_t v;
+        memcpy(&v, data, 8);
+        crc = __crc32cd(crc, v);
+    }
+    while (len--)
+        crc = __crc32cb(crc, *data++);
+    return ~crc;
+}
+#else // portable, one byte at a time
+static uint32_t crc32c(const uint8_t* data, size_t len, uint32_t crc = 0) {
+    static const struct table {
+        uint32_t v[256];
+        table() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c(i);
+                for (int k = 0; k < 8; k++)
+                    c = (c >> 1) ^ (0x82f63b78u & (0u - (c & 1)));
+                v[i] = c;
+            }
+        }
+    } t;
+    crc = ~crc;
+    while (len--)
+        crc = (crc >> 8) ^ t.v[(crc ^ *data++) & 0xff];
+    return ~crc;
+}
+#endif
+
 struct band_state {
     size_t prev, runbits, cf;
 };
 
+// Adaptive rung switch, the rung changes are mapped to the switch codes in frequency order
+// The codes are ranked by length, as the rung changes 0, 1, -1, 2, -2 ...
+// Starts as the identity, the context is made of the last two rung changes, as 0, 1, -1 or other
+constexpr size_t RS_CTX = 16;
+struct rswitch {
+    uint8_t sym[RS_CTX][64]; // Rung change by rank
+    uint8_t rank[RS_CTX][64]; // Rank by rung change
+    uint8_t count[RS_CTX][64];
+    size_t ctx;
+};
+
+// Switch code for a rank
+static size_t rs_code(size_t r, size_t ubits) {
+    return (r & 1) ? (r + 1) / 2 : (0 - r / 2) & ((1ull << ubits) - 1);
+}
+
+// Rank of a switch code
+static size_t rs_rank(size_t code, size_t ubits) {
+    return (code <= (1ull << (ubits - 1))) ? (code * 2 - (code != 0)) : ((1ull << ubits) - code) * 2;
+}
+
+static void rs_init(rswitch& a, size_t ubits) {
+    memset(&a, 0, sizeof(a));
+    for (size_t ctx = 0; ctx < RS_CTX; ctx++)
+        for (size_t r = 0; r < (1ull << ubits); r++) {
+            a.sym[ctx][r] = static_cast<uint8_t>(rs_code(r, ubits));
+            a.rank[ctx][rs_code(r, ubits)] = static_cast<uint8_t>(r);
+        }
+}
+
+// Switch code used for a rung change
+static inline size_t rs_encode(const rswitch& a, size_t delta, size_t ubits) {
+    return rs_code(a.rank[a.ctx][delta], ubits);
+}
+
+// Rung change for a switch code
+static inline size_t rs_decode(const rswitch& a, size_t code, size_t ubits) {
+    return a.sym[a.ctx][rs_rank(code, ubits)];
+}
+
+// Count the rung change, move it up in rank if needed and switch the context
+static void rs_update(rswitch& a, size_t delta, size_t ubits) {
+    auto& count = a.count[a.ctx];
+    auto& sym = a.sym[a.ctx];
+    auto& rank = a.rank[a.ctx];
+    if (++count[delta] == 0xff) // Halve the counts, to follow the changes
+        for (size_t i = 0; i < (1ull << ubits); i++)
+            count[i] >>= 1;
+    for (size_t r = rank[delta]; r && count[sym[r - 1]] < count[delta]; r--) {
+        sym[r] = sym[r - 1];
+        rank[sym[r]] = static_cast<uint8_t>(r);
+        sym[r - 1] = static_cast<uint8_t>(delta);
+        rank[delta] = static_cast<uint8_t>(r - 1);
+    }
+    size_t cls = (0 == delta) ? 0 : (1 == delta) ? 1 : (((1ull << ubits) - 1) == delta) ? 2 : 3;
+    a.ctx = ((a.ctx << 2) | cls) & (RS_CTX - 1);
+}
+
+// Linear inter-band predictor, derived band value is c - ((a * cband + b) >> s)
+struct band_lp {
+    int64_t b;
+    int32_t a;
+    uint8_t s;
+};
+
+// Linear prediction from the core band value v
+// sh is the shift used for sign extension of signed types, zero for unsigned
+// Computed in 64 bits with wraparound, so it is identical on encode and decode
+template<typename T>
+static T lpred(T v, const band_lp& lp, size_t sh) {
+    auto x = static_cast<int64_t>(static_cast<uint64_t>(v) << sh) >> sh;
+    return static_cast<T>(static_cast<int64_t>(
+        static_cast<uint64_t>(lp.a) * static_cast<uint64_t>(x) + static_cast<uint64_t>(lp.b)) >> lp.s);
+}
+
+// Signed integer types have odd qb3_dtype values
+static bool is_signed_type(qb3_dtype dt) {
+    return dt <= QB3_I64 && (dt & 1);
+}
+
+static bool is_float(qb3_dtype dt) {
+    return QB3_F32 == dt || QB3_F64 == dt;
+}
+
+// Sign extension shift for lpred
+template<typename T>
+static size_t lpshift(qb3_dtype dt) {
+    return is_signed_type(dt) ? 64 - 8 * sizeof(T) : 0;
+}
+
 // Encoder control structure
 struct encs {
     size_t xsize;
@@ -71,20 +226,73 @@ struct encs {
     size_t nbands;
     // Line to line stride in type units
     size_t stride;
+    // Pixel to pixel and band to band strides in type units, 0 for band interleaved
+    size_t pstride;
+    size_t bstride;
+    // Channels per input pixel and the input channel of each band, 0 and nullptr for all bands
+    size_t nchannels;
+    size_t* bsel;
     // micro block scanning order
     uint64_t order;
     uint64_t quanta;
+    // Floating point maximum error, 0 for lossless
+    double maxerr;
+    // Floating point grid step and origin, set by the encoder, the step is 0 for lossless
+    double fstep;
+    double foffset;
+    // Reference frame, same layout as the input, or nullptr
+    const void* ref;
+    // Key frame interval, 0 if not used, and frame counter
+    size_t keyint;
+    size_t frame;
+    // Palette sort keys, PALSZ per band, only valid during qb3_encode, or nullptr
+    const uint64_t* pal;
+    // The per band arrays are allocated with the encoder, nbands entries
+    size_t* palsize;
 
     // Persistent state by band
-    band_state band[QB3_MAXBANDS];
+    band_state* band;
+    // Adaptive rung switch state by band, only valid during qb3_encode, or nullptr
+    rswitch* rs;
     // band which will be subtracted, by band
-    size_t cband[QB3_MAXBANDS];
+    size_t* cband;
+    // Linear predictor coefficients, by band, used when linear is set
+    band_lp* lp;
 
     int error; // Holds the code for error, 0 if everything is fine
 
     qb3_mode mode;
     qb3_dtype type;
     bool away; // Round up instead of down when quantizing
+    bool linear; // Use the linear inter-band predictor
+    bool palette; // Try the palette
+    bool blockcopy; // Try block copy
+    bool adaptive; // Adaptive rung switch codes
+    size_t bsize; // Requested block size, B or B8, 0 is B
+    bool search; // Search for the best scanning curve
+    bool nodata; // Skip the blocks which only contain the NoData value
+    uint64_t ndv; // NoData value, as the bits of the value type
+    // NoData block mask, only valid during qb3_encode, or nullptr
+    // mseq is the next block, in raster order, it persists from one strip to the next
+    const uint64_t* mask;
+    size_t mseq;
+    // The first block row is the previous strip, only used as a block copy source by encode_best
+    bool above;
+    bool planar; // Encode each band group as a separate stream
+    // Planar band group stream sizes, only valid during qb3_encode, or nullptr
+    size_t ngroups;
+    size_t* gsize;
+    bool stats; // Store the band statistics
+    // Per band minimum, maximum, sum and count, only valid during qb3_encode, or nullptr
+    // The minimum and maximum are the bits of the value type, the sum is a double
+    const uint64_t* bstats;
+    bool summary; // Store the rung summary
+    // Bits of the largest residual per block row and band, only valid during qb3_encode, or nullptr
+    uint8_t* rungs;
+    bool checksum; // Store the strip checksums
+    // End bit position and CRC32C of each block row strip, by stream, only valid during qb3_encode, or nullptr
+    size_t* strips;
+    uint32_t* crcs;
 };
 
 // Decoder control structure
@@ -94,28 +302,86 @@ struct decs {
     size_t nbands;
     // Line to line stride in type units
     size_t stride;
+    // Pixel to pixel and band to band strides in type units, 0 for band interleaved
+    size_t pstride;
+    size_t bstride;
+    // Channels per output pixel and the output channel of each band, 0 and nullptr for all bands
+    // The bands which are not in the output have the NOBAND channel
+    size_t nchannels;
+    size_t* bsel;
     // micro block scanning order
     uint64_t order;
     uint64_t quanta;
+    // Floating point maximum error, grid step and origin, the step is 0 for lossless
+    double maxerr;
+    double fstep;
+    double foffset;
+    // Reference frame, same layout as the output, or nullptr
+    const void* ref;
+    // Palette values, PALSZ per band, or nullptr
+    uint64_t* pal;
+    // The per band arrays are allocated with the decoder, nbands entries
+    size_t* palsize;
     int error;
     int stage;
 
     // band which will be added, by band
-    uint8_t cband[QB3_MAXBANDS];
+    uint8_t* cband;
+    // Linear predictor coefficients, by band, used when linear is set
+    band_lp* lp;
     qb3_mode mode;
     qb3_dtype type;
+    bool linear;
+    bool temporal; // Encoded as the difference from a reference frame
+    bool blockcopy; // Might contain block copies
+    bool adaptive; // Adaptive rung switch codes
+    size_t bsize; // Block size, B or B8, 0 is B
+    bool nodata; // Has a NoData block mask
+    uint64_t ndv; // NoData value, as the bits of the value type
+    // NoData block mask, one bit per block in raster order, or nullptr
+    uint64_t* mask;
+    // Planar band group stream sizes, or nullptr
+    size_t ngroups;
+    size_t* gsize;
+    // Output conversion, value * oscale + ooffset stored as otype, used when convert is set
+    // The output channels without a band are set to ofill
+    bool convert;
+    qb3_dtype otype;
+    double oscale;
+    double ooffset;
+    double ofill;
+    // Per band statistics of the decoded values, 4 per band, and histograms, or nullptr
+    double* stats;
+    uint64_t* hist;
+    // Per band statistics from the "st" chunk, 4 per band, or nullptr
+    double* bstats;
+    // Rung summary from the "rs" chunk, one byte per block row and band, in the input buffer, or nullptr
+    const uint8_t* rungs;
+    // Strip checksums from the "ck" chunk, 4 bytes per block row and stream, in the input buffer, or nullptr
+    // They are checked while decoding when verify is set
+    const uint8_t* crcs;
+    bool verify;
 
     // Input buffer
     uint8_t* s_in;
     size_t s_size;
+    // Start of the input, the qb3_validate offsets are from here
+    uint8_t* s_start;
 };
 
 // in decode.cpp
-extern const int typesizes[8];
+extern const int typesizes[10];
 
 // Could be a macro
 static size_t szof(qb3_dtype dt) {
-    return (dt > QB3_I64) ? 0 : typesizes[int(dt)];
+    return (dt > QB3_F64) ? 0 : typesizes[int(dt)];
+}
+
+// Checks that the image size in bytes, padded to 8x8 blocks, fits in a size_t with a factor of 4 to spare
+// The encoded size is under twice the raw size, plus the headers
+static bool size_fits(size_t xsize, size_t ysize, size_t nbands, qb3_dtype dt) {
+    const size_t x(xsize + B8 - 1), y(ysize + B8 - 1), lim(~size_t(0) / 4);
+    return 0 != szof(dt) && x <= lim / y && x * y <= lim / (nbands * szof(dt));
 }
 
 // Encode integers as magnitude and sign, with bit 0 for sign.
@@ -135,6 +401,53 @@ static T smag(T v) {
     return (v >> 1) ^ (~T(0) * (v & 1));
 }
 
+// Absolute from mag-sign
+template<typename T> static T magsabs(T v) { return (v >> 1) + (v & 1); }
+
+// Order preserving mapping of IEEE floating point bits to unsigned integers
+// Negative values have all the bits flipped, positive ones only the sign bit
+template<typename T>
+static T fmap(T v) {
+    constexpr size_t SB(8 * sizeof(T) - 1);
+    return v ^ ((T(0) - (v >> SB)) | (T(1) << SB));
+}
+
+// Inverse of fmap
+template<typename T>
+static T funmap(T v) {
+    constexpr size_t SB(8 * sizeof(T) - 1);
+    return v ^ (((v >> SB) - T(1)) | (T(1) << SB));
+}
+
+// Floating point value from the bits held in T, T is uint32_t or uint64_t
+template<typename T>
+static double fvalue(T v) {
+    if (sizeof(T) == sizeof(float)) {
+        float f(0);
+        memcpy(&f, &v, sizeof(v));
+        return f;
+    }
+    double d(0);
+    if (sizeof(T) == sizeof(double))
+        memcpy(&d, &v, sizeof(v));
+    return d;
+}
+
+// Floating point bits of the grid value q, rounded to the type of the same size as T
+// The encoder checks the error using the same calculation as the decoder
+template<typename T>
+static T fgrid(T q, double step, double offset) {
+    double d = offset + step * static_cast<double>(q);
+    T v(0);
+    if (sizeof(T) == sizeof(float)) {
+        float f = static_cast<float>(d);
+        memcpy(&v, &f, sizeof(v));
+    }
+    else if (sizeof(T) == sizeof(double))
+        memcpy(&v, &d, sizeof(v));
+    return v;
+}
+
 // If the rung bits of the input values match 1*0*, returns the index of first 0 + 1
 // So we can discern between 0 and 1
 // Return > B2 if no match
@@ -191,3 +504,238 @@ constexpr uint64_t ZCURVE(0x0145236789cdabef);
  5 6 9 a
 */
 constexpr uint64_t HILBERT(0x01548cd9aefb7623);
+
+/* Hilbert space filling curve third degree, used by the 8x8 blocks, values are y * 8 + x
+ Each quarter is a B x B block
+  0  3  4  5 3a 3b 3c 3f
+  1  2  7  6 39 38 3d 3e
+  e  d  8  9 36 37 32 31
+  f  c  b  a 35 34 33 30
+ 10 11 1e 1f 20 21 2e 2f
+ 13 12 1d 1c 23 22 2d 2c
+ 14 17 18 1b 24 27 28 2b
+ 15 16 19 1a 25 26 29 2a
+*/
+static const uint8_t HILBERT8[B8 * B8] = {
+     0,  8,  9,  1,  2,  3, 11, 10, 18, 19, 27, 26, 25, 17, 16, 24,
+    32, 33, 41, 40, 48, 56, 57, 49, 50, 58, 59, 51, 43, 42, 34, 35,
+    36, 37, 45, 44, 52, 60, 61, 53, 54, 62, 63, 55, 47, 46, 38, 39,
+    31, 23, 22, 30, 29, 28, 20, 21, 13, 12,  4,  5,  6, 14, 15,  7 };
+
+// Pixel offsets within a BS x BS block, in scanning order
+// B x B blocks use the order curve, 8x8 blocks always use the HILBERT8 curve
+template<size_t BS>
+static void block_offsets(size_t* offset, uint64_t order, size_t stride, size_t pstride) {
+    for (size_t i = 0; i < BS * BS; i++) {
+        size_t n = (BS == B) ? (order >> ((B2 - 1 - i) << 2)) & 0xf : HILBERT8[i];
+        offset[i] = (n / BS) * stride + (n % BS) * pstride;
+    }
+}
+
+// 2D prediction modes
+static bool is_med(qb3_mode mode) {
+    return QB3M_MED == mode || QB3M_MED_BEST == mode;
+}
+
+// Modes which use the extended group encodings, CF, index and block copy
+static bool is_cf(qb3_mode mode) {
+    return QB3M_CF == mode || QB3M_CF_RLE == mode || QB3M_CF_H == mode || QB3M_CF_RLE_H == mode
+        || QB3M_CF_LZ_H == mode;
+}
+
+// Top-left pixel offset of block k, in raster order of B x B blocks
+// The last row and column are rolled up and left, bx is the number of blocks per row
+// pstride is the pixel to pixel stride, the number of bands for interleaved data
+static size_t block_loc(size_t k, size_t bx, size_t xsize, size_t ysize, size_t stride, size_t pstride) {
+    size_t x = (k % bx) * B, y = (k / bx) * B;
+    return ((y + B > ysize) ? ysize - B : y) * stride + ((x + B > xsize) ? xsize - B : x) * pstride;
+}
+
+// Channel of a band which is not in the decoder output
+constexpr size_t NOBAND = ~size_t(0);
+
+// Memory layout, in type units, the default is band interleaved with contiguous lines
+template<typename I> static size_t pixel_channels(const I& info) {
+    return info.nchannels ? info.nchannels : info.nbands;
+}
+
+template<typename I> static size_t line_stride(const I& info) {
+    return info.stride ? info.stride : info.xsize * pixel_channels(info);
+}
+
+template<typename I> static size_t pixel_stride(const I& info) {
+    return info.pstride ? info.pstride : pixel_channels(info);
+}
+
+template<typename I> static size_t band_stride(const I& info) {
+    return info.bstride ? info.bstride : 1;
+}
+
+// Band c is in the user buffer, always true for the encoder
+template<typename I> static bool is_stored(const I& info, size_t c) {
+    return !info.bsel || NOBAND != info.bsel[c];
+}
+
+// Offset of band c within a pixel, only valid if the band is stored
+template<typename I> static size_t band_offset(const I& info, size_t c) {
+    return (info.bsel ? info.bsel[c] : c) * band_stride(info);
+}
+
+// Offsets of all bands within a pixel, zero for the bands which are not stored
+template<typename I> static std::vector<size_t> band_offsets(const I& info) {
+    std::vector<size_t> boff(info.nbands);
+    for (size_t c = 0; c < info.nbands; c++)
+        boff[c] = is_stored(info, c) ? band_offset(info, c) : 0;
+    return boff;
+}
+
+// The bands of a pixel are adjacent and in order, the lines might not be
+template<typename I> static bool is_interleaved(const I& info) {
+    return !info.bsel && pixel_stride(info) == info.nbands && band_stride(info) == 1;
+}
+
+// Core band of band c with the default band mapping, the second band for RGB and RGBA
+static constexpr size_t dcband(size_t nbands, size_t c) {
+    return (3 == nbands || 4 == nbands) && (0 == c || 2 == c) ? 1 : c;
+}
+
+// Number of bands when the kernels instantiated for it can be used, otherwise 0
+// One band, RGB and RGBA, band interleaved and with the default band mapping
+template<typename I> static size_t fixed_bands(const I& info) {
+    const size_t n(info.nbands);
+    if ((1 != n && 3 != n && 4 != n) || !is_interleaved(info))
+        return 0;
+    for (size_t c = 0; c < n; c++)
+        if (info.cband[c] != dcband(n, c))
+            return 0;
+    return n;
+}
+
+// Use the default layout, for the internal buffers
+template<typename I> static void set_compact(I& info) {
+    info.stride = info.pstride = info.bstride = info.nchannels = 0;
+    info.bsel = nullptr;
+}
+
+// Layout of the n bands gb of the info image, for a planar band group, the image is not copied
+// gsel receives the channel of each group band, NOBAND if it is not stored
+template<typename I> static void set_group(I& sub, const I& info, const size_t* gb, size_t n, size_t* gsel) {
+    for (size_t i = 0; i < n; i++)
+        gsel[i] = info.bsel ? info.bsel[gb[i]] : gb[i];
+    sub.nbands = n;
+    sub.stride = line_stride(info);
+    sub.pstride = pixel_stride(info);
+    sub.bstride = band_stride(info);
+    sub.nchannels = pixel_channels(info);
+    sub.bsel = gsel;
+}
+
+// Copy lines of an image with the info layout to a compact, band interleaved buffer
+// The bands which are not stored are set to zero
+template<typename T, typename I> static
+void to_compact(T* dst, const T* src, const I& info, size_t lines) {
+    const size_t stride(line_stride(info)), pstride(pixel_stride(info));
+    const size_t line(info.xsize * info.nbands);
+    for (size_t y = 0; y < lines; y++, src += stride) {
+        if (is_interleaved(info)) {
+            memcpy(dst, src, line * sizeof(T));
+            dst += line;
+            continue;
+        }
+        for (size_t x = 0; x < info.xsize; x++)
+            for (size_t c = 0; c < info.nbands; c++)
+                *dst++ = is_stored(info, c) ? src[x * pstride + band_offset(info, c)] : T(0);
+    }
+}
+
+// Copy lines of a compact, band interleaved buffer to an image with the info layout
+// Only the stored bands are copied
+template<typename T, typename I> static
+void from_compact(T* dst, const T* src, const I& info, size_t lines) {
+    const size_t stride(line_stride(info)), pstride(pixel_stride(info));
+    const size_t line(info.xsize * info.nbands);
+    for (size_t y = 0; y < lines; y++, dst += stride) {
+        if (is_interleaved(info)) {
+            memcpy(dst, src, line * sizeof(T));
+            src += line;
+            continue;
+        }
+        for (size_t x = 0; x < info.xsize; x++)
+            for (size_t c = 0; c < info.nbands; c++, src++)
+                if (is_stored(info, c))
+                    dst[x * pstride + band_offset(info, c)] = *src;
+    }
+}
+
+// NoData mask bit of block k, in raster order
+static bool is_masked(const uint64_t* mask, size_t k) {
+    return 0 != ((mask[k >> 6] >> (k & 63)) & 1);
+}
+
+// Planar band groups, each core band with its derived bands, in core band order
+// The bands of group g are gband[gstart[g]] to gband[gstart[g + 1] - 1], in band order
+// Returns the number of groups, 0 if a band is not in a group
+template<typename C>
+static size_t band_groups(const C* cband, size_t bands, size_t* gband, size_t* gstart) {
+    size_t n(0), k(0);
+    for (size_t c = 0; c < bands; c++) {
+        if (cband[c] != c)
+            continue;
+        gstart[n++] = k;
+        for (size_t i = 0; i < bands; i++)
+            if (cband[i] == c)
+                gband[k++] = i;
+    }
+    gstart[n] = k;
+    return (k == bands) ? n : 0;
+}
+
+// Median edge detector (LOCO-I) prediction, from left, top and top-left neighbours
+template<typename T>
+static T med(T a, T b, T c) {
+    T mx = (a > b) ? a : b, mn = (a > b) ? b : a;
+    return (c >= mx) ? mn : (c <= mn) ? mx : static_cast<T>(a + b - c);
+}
+
+// Maps the values of a band to the 2D prediction domain and back
+// Derived bands are predicted as the difference from the core band
+// The top bit is flipped for signed types and derived bands, so the MED comparisons are signed
+// When fp is set, the image holds floating point values which are mapped on access
+template<typename T>
+struct medmap {
+    size_t c, cb;
+    size_t oc, ocb; // Offsets of the band and the core band within a pixel
+    const band_lp* lp; // Linear band predictor, or nullptr
+    size_t sh;
+    T flip;
+    bool fp;
+
+    template<typename I>
+    medmap(const I& info, size_t band, bool fpmap = false) : c(band), cb(info.cband[band]),
+        oc(band_offset(info, band)), ocb(band_offset(info, cb)),
+        lp((info.linear && band != cb) ? &info.lp[band] : nullptr),
+        sh(lpshift<T>(info.type)),
+        flip((is_signed_type(info.type) || band != cb) ? static_cast<T>(T(1) << (8 * sizeof(T) - 1)) : T(0)),
+        fp(fpmap) {}
+
+    T get(const T* pix, size_t b) const {
+        return fp ? fmap(pix[b]) : pix[b];
+    }
+
+    // Prediction domain value of the band, pix points to the first band of the pixel
+    T to(const T* pix) const {
+        T v = get(pix, oc);
+        if (c != cb)
+            v -= lp ? lpred(get(pix, ocb), *lp, sh) : get(pix, ocb);
+        return v ^ flip;
+    }
+
+    // Band value from the prediction domain value, the core band has to be valid
+    T from(T v, const T* pix) const {
+        v ^= flip;
+        if (c != cb)
+            v += lp ? lpred(get(pix, ocb), *lp, sh) : get(pix, ocb);
+        return fp ? funmap(v) : v;
+    }
+};
+#endif
@@ -20,9 +20,12 @@ Contributors:  Lucian Plesea
 // For memset, memcpy
 #include <cstring>
 #include <vector>
+#include <cmath>
+// For fill
+#include <algorithm>
 
 // bytes per value by qb3_dtype, keep them in sync with qb3_dtype
-const int typesizes[8] = { 1, 1, 2, 2, 4, 4, 8, 8 };
+const int typesizes[10] = { 1, 1, 2, 2, 4, 4, 8, 8, 4, 8 };
 
 // Main QB3 file header
 // 4 signature
@@ -34,6 +37,14 @@ const int typesizes[8] = { 1, 1, 2, 2, 4, 4, 8, 8 };
 constexpr size_t QB3_HDRSZ = 4 + 2 + 2 + 1 + 1 + 1;
 
 void qb3_destroy_decoder(decsp p) {
+    delete[] p->palsize;
+    delete[] p->cband;
+    delete[] p->lp;
+    delete[] p->pal;
+    delete[] p->mask;
+    delete[] p->gsize;
+    delete[] p->bsel;
+    delete[] p->bstats;
     delete p;
 }
 
@@ -41,6 +52,11 @@ size_t qb3_decoded_size(const decsp p) {
     return p->xsize * p->ysize * p->nbands * szof(p->type);
 }
 
+// Output size in bytes, all the output channels of the output type
+static size_t output_size(const decs& p) {
+    return p.xsize * p.ysize * pixel_channels(p) * szof(p.convert ? p.otype : p.type);
+}
+
 qb3_dtype qb3_get_type(const decsp p) {
     return p->type;
 }
@@ -53,6 +69,10 @@ uint64_t qb3_get_quanta(const decsp p) {
     return (2 == p->stage) ? p->quanta: 0;
 }
 
+double qb3_get_maxerror(const decsp p) {
+    return (2 == p->stage) ? p->maxerr : 0;
+}
+
 uint64_t qb3_get_order(const decsp p) {
     if (p->stage != 2)
         return 0; // Error
@@ -68,11 +88,154 @@ bool qb3_get_coreband(const decsp p, size_t *coreband) {
     return true;
 }
 
+// Get the linear band predictor coefficients, a, b and s for each band
+bool qb3_get_bandpredictor(const decsp p, int64_t *coefs) {
+    if (p->stage != 2 || !p->linear)
+        return false;
+    for (int c = 0; c < p->nbands; c++) {
+        coefs[3 * c] = p->lp[c].a;
+        coefs[3 * c + 1] = p->lp[c].b;
+        coefs[3 * c + 2] = p->lp[c].s;
+    }
+    return true;
+}
+
 // Change the line to line stride, defaults to line size
 void qb3_set_decoder_stride(decsp p, size_t stride) {
     p->stride = stride;
 }
 
+// The value at pixel x of line y and band c goes to y * line + x * pixel + c * band
+bool qb3_set_decoder_layout(decsp p, size_t pixel, size_t line, size_t band) {
+    if (!pixel || !line || (!band && p->nbands > 1))
+        return false;
+    p->pstride = pixel;
+    p->stride = line;
+    p->bstride = band;
+    return true;
+}
+
+// Channel i of the output is band bands[i], the other bands are not stored
+// The QB3_FILL channels are not bands
+bool qb3_set_decoder_bands(decsp p, size_t nchannels, const size_t* bands) {
+    if (!bands) { // All bands, in order
+        delete[] p->bsel;
+        p->bsel = nullptr;
+        p->nchannels = 0;
+        return true;
+    }
+    if (0 == nchannels || nchannels > QB3_MAXBANDS)
+        return false;
+    std::vector<size_t> bsel(p->nbands, NOBAND);
+    for (size_t i = 0; i < nchannels; i++) {
+        if (QB3_FILL == bands[i])
+            continue;
+        if (bands[i] >= p->nbands || NOBAND != bsel[bands[i]])
+            return false;
+        bsel[bands[i]] = i;
+    }
+    if (!p->bsel)
+        p->bsel = new size_t[p->nbands];
+    std::copy(bsel.begin(), bsel.end(), p->bsel);
+    p->nchannels = nchannels;
+    return true;
+}
+
+// Output type, scale and offset, no conversion if they don't change the values
+bool qb3_set_decoder_output(decsp p, qb3_dtype type, double scale, double offset, double fill) {
+    if (type > QB3_F64 || !std::isfinite(scale) || !std::isfinite(offset) || std::isnan(fill))
+        return false;
+    p->otype = type;
+    p->oscale = scale;
+    p->ooffset = offset;
+    p->ofill = fill;
+    p->convert = (type != p->type || 1 != scale || 0 != offset);
+    return true;
+}
+
+// Check the strip checksums while decoding
+void qb3_set_decoder_verify(decsp p, bool verify) {
+    p->verify = verify;
+}
+
+// Reference frame for decoding streams which were encoded with one
+void qb3_set_decoder_reference(decsp p, const void* ref) {
+    p->ref = ref;
+}
+
+// Statistics of the decoded values, the histogram only for 8 and 16 bit types
+bool qb3_set_decoder_stats(decsp p, double* stats, uint64_t* hist) {
+    if (hist && (!stats || szof(p->type) > 2))
+        return false;
+    p->stats = stats;
+    p->hist = hist;
+    return true;
+}
+
+size_t qb3_get_palette(const decsp p, size_t band, uint64_t* values) {
+    if (2 != p->stage || !p->pal || band >= p->nbands)
+        return 0;
+    if (values)
+        memcpy(values, p->pal + band * PALSZ, p->palsize[band] * sizeof(uint64_t));
+    return p->palsize[band];
+}
+
+bool qb3_get_reference(const decsp p) {
+    return (2 == p->stage) && p->temporal;
+}
+
+// Value from the bits of the value type
+static double dvalue(uint64_t v, qb3_dtype dt) {
+    const size_t tsz(szof(dt));
+    double value;
+    if (QB3_F32 == dt) {
+        float f;
+        uint32_t u = static_cast<uint32_t>(v);
+        memcpy(&f, &u, sizeof(f));
+        value = f;
+    }
+    else if (QB3_F64 == dt)
+        memcpy(&value, &v, sizeof(value));
+    else if (is_signed_type(dt)) // Sign extend
+        value = static_cast<double>(static_cast<int64_t>(v << (64 - 8 * tsz)) >> (64 - 8 * tsz));
+    else
+        value = static_cast<double>(v);
+    return value;
+}
+
+bool qb3_get_nodata(const decsp p, double* value) {
+    if (2 != p->stage || !p->nodata)
+        return false;
+    if (value)
+        *value = dvalue(p->ndv, p->type);
+    return true;
+}
+
+size_t qb3_get_rungs(const decsp p, uint8_t* rungs) {
+    if (2 != p->stage || !p->rungs)
+        return 0;
+    const size_t bs(p->bsize ? p->bsize : B), rows((p->ysize + bs - 1) / bs);
+    if (rungs)
+        memcpy(rungs, p->rungs, rows * p->nbands);
+    return rows;
+}
+
+bool qb3_get_checksum(const decsp p) {
+    return 2 == p->stage && p->crcs;
+}
+
+bool qb3_get_stats(const decsp p, double* stats) {
+    if (2 != p->stage || !p->bstats)
+        return false;
+    if (stats)
+        memcpy(stats, p->bstats, p->nbands * 4 * sizeof(double));
+    return true;
+}
+
+size_t qb3_get_planar(const decsp p) {
+    return (2 == p->stage && p->gsize) ? p->ngroups : 0;
+}
+
 // Integer multiply but don't overflow, at least on the positive side
 template<typename T>
 static void dequantize(T* d, const decsp p) {
@@ -80,9 +243,11 @@ static void dequantize(T* d, const decsp p) {
     const T q = static_cast<T>(p->quanta);
     const T mai = std::numeric_limits<T>::max() / q; // Top valid value
     const T mii = std::numeric_limits<T>::min() / q; // Bottom valid value
-    auto stride = p->stride ? p->stride : (p->xsize * p->nbands * sizeof(T));
+    // In T units
+    const size_t stride(line_stride(*p)), pstride(pixel_stride(*p));
+    const std::vector<size_t> boff(band_offsets(*p));
     // Slightly faster without a double loop
-    if (stride == p->xsize * p->nbands * sizeof(T)) {
+    if (stride == p->xsize * p->nbands && is_interleaved(*p)) {
         for (size_t i = 0; i < sz; i++) {
             auto data = d[i];
             d[i] = (data <= mai) * (data * q)
@@ -92,18 +257,287 @@ static void dequantize(T* d, const decsp p) {
         }
         return;
     }
-    // With line stride
+    // With strides
     for (size_t y = 0; y < p->ysize; y++) {
-        auto dst = reinterpret_cast<T*>(
-                reinterpret_cast<uint8_t*>(d) + y * stride);
-        for (size_t i = 0; i < p->nbands * p->xsize; i++) {
-            auto data = dst[i];
-            dst[i] = (data <= mai) * (data * q)
-                + (!(data <= mai)) * std::numeric_limits<T>::max();
-            if (std::is_signed<T>() && (q > 2) && (data < mii))
-                dst[i] = std::numeric_limits<T>::min();
+        for (size_t x = 0; x < p->xsize; x++) {
+            auto dst = d + y * stride + x * pstride;
+            for (size_t c = 0; c < p->nbands; c++) {
+                if (!is_stored(*p, c))
+                    continue;
+                auto data = dst[boff[c]];
+                dst[boff[c]] = (data <= mai) * (data * q)
+                    + (!(data <= mai)) * std::numeric_limits<T>::max();
+                if (std::is_signed<T>() && (q > 2) && (data < mii))
+                    dst[boff[c]] = std::numeric_limits<T>::min();
+            }
+        }
+    }
+}
+
+// Unpacks the NoData block mask, nwords 64 bit values
+// Returns false if the packed mask is not valid
+static bool unpack_mask(const uint8_t* src, size_t len, uint64_t* mask, size_t nwords) {
+    iBits s(src, len);
+    for (size_t i = 0; i < nwords; i++) {
+        if (s.avail() < 2)
+            return false;
+        auto code = s.pull(2);
+        if (0 == code || 3 == code) {
+            mask[i] = code ? ~0ull : 0;
+            continue;
+        }
+        if (1 == code) {
+            if (s.avail() < 64)
+                return false;
+            mask[i] = s.pull(64);
+            continue;
+        }
+        // 16 block quads
+        uint64_t w(0);
+        for (size_t q = 0; q < 64; q += 16) {
+            if (s.avail() < 2)
+                return false;
+            code = s.pull(2);
+            if (2 == code || (1 == code && s.avail() < 16))
+                return false;
+            if (1 == code)
+                w |= s.pull(16) << q;
+            else if (3 == code)
+                w |= 0xffffull << q;
+        }
+        mask[i] = w;
+    }
+    // Only the padding is left
+    return s.avail() < 8;
+}
+
+// Fill the NoData blocks of a strip, k is the first block of the strip
+template<typename T>
+static void fill_strip(T* strip, const decs& info, size_t k) {
+    const size_t xsize(info.xsize), bands(info.nbands);
+    const size_t bs(info.bsize ? info.bsize : B), line(bs * bands);
+    const size_t stride(line_stride(info)), pstride(pixel_stride(info));
+    const T ndv(static_cast<T>(info.ndv));
+    for (size_t x = 0; x < xsize; x += bs, k++) {
+        if (x + bs > xsize)
+            x = xsize - bs;
+        if (is_masked(info.mask, k))
+            for (size_t j = 0; j < bs; j++) {
+                auto v = strip + j * stride + x * pstride;
+                if (is_interleaved(info))
+                    std::fill(v, v + line, ndv);
+                else
+                    for (size_t c = 0; c < bands; c++)
+                        for (size_t i = 0; i < bs && is_stored(info, c); i++)
+                            v[i * pstride + band_offset(info, c)] = ndv;
+            }
+    }
+}
+
+// Fill the NoData blocks, after all the other transforms
+template<typename T>
+static void fill_nodata(T* image, const decsp p) {
+    const size_t ysize(p->ysize), bs(p->bsize ? p->bsize : B), bx((p->xsize + bs - 1) / bs);
+    for (size_t y = 0, k = 0; y < ysize; y += bs, k += bx)
+        fill_strip(image + ((y + bs > ysize) ? ysize - bs : y) * line_stride(*p), *p, k);
+}
+
+// Output value, rounded and clamped to the range of integer types, NaN is the maximum
+// Without branches, rounds the offset from the minimum, which is not negative
+template<typename O>
+static O ovalue(double v) {
+    if (!std::is_integral<O>())
+        return static_cast<O>(v);
+    const double lo(static_cast<double>(std::numeric_limits<O>::min()));
+    const double hi(static_cast<double>(std::numeric_limits<O>::max()));
+    v = std::max(lo, std::min(hi, v)) - lo + 0.5;
+    if (sizeof(O) < 4)
+        return static_cast<O>(static_cast<int32_t>(v) + static_cast<int32_t>(lo));
+    if (sizeof(O) == 4)
+        return static_cast<O>(static_cast<int64_t>(v) + static_cast<int64_t>(lo));
+    // Above the largest 64 bit value, the conversion is not defined
+    v = std::min(v, 18446744073709549568.0);
+    return static_cast<O>(static_cast<uint64_t>(v) + static_cast<uint64_t>(static_cast<int64_t>(lo)));
+}
+
+// Set the output channels which are not bands to the fill value
+template<typename O>
+static void fill_channels(O* image, const decs& info, size_t lines) {
+    if (!info.bsel)
+        return;
+    std::vector<bool> used(info.nchannels);
+    for (size_t c = 0; c < info.nbands; c++)
+        if (is_stored(info, c))
+            used[info.bsel[c]] = true;
+    const size_t stride(line_stride(info)), pstride(pixel_stride(info));
+    const O fill(ovalue<O>(info.ofill));
+    for (size_t ch = 0; ch < info.nchannels; ch++) {
+        if (used[ch])
+            continue;
+        for (size_t y = 0; y < lines; y++) {
+            auto v = image + y * stride + ch * band_stride(info);
+            for (size_t x = 0; x < info.xsize; x++)
+                v[x * pstride] = fill;
+        }
+    }
+}
+
+// Convert lines of a compact, band interleaved buffer to the output type and layout
+template<typename V, typename O>
+static void convert_lines(const V* src, O* dst, const decs& info, size_t lines) {
+    const size_t stride(line_stride(info)), pstride(pixel_stride(info));
+    const size_t xsize(info.xsize), bands(info.nbands);
+    const double scale(info.oscale), offset(info.ooffset);
+    const std::vector<size_t> boff(band_offsets(info));
+    for (size_t y = 0; y < lines; y++) {
+        auto line = dst + y * stride;
+        if (is_interleaved(info)) {
+            for (size_t i = 0; i < xsize * bands; i++)
+                line[i] = ovalue<O>(src[i] * scale + offset);
+            src += xsize * bands;
+            continue;
+        }
+        for (size_t c = 0; c < bands; c++)
+            if (is_stored(info, c))
+                for (size_t x = 0; x < xsize; x++)
+                    line[x * pstride + boff[c]] = ovalue<O>(src[x * bands + c] * scale + offset);
+        src += xsize * bands;
+    }
+    fill_channels(dst, info, lines);
+}
+
+// Convert lines to the output type, dst is the first output line
+template<typename V>
+static void convert_image(const V* src, void* dst, const decs& info, size_t lines) {
+    switch (info.otype) {
+    case qb3_dtype::QB3_U8:  convert_lines(src, reinterpret_cast<uint8_t*>(dst), info, lines);  break;
+    case qb3_dtype::QB3_I8:  convert_lines(src, reinterpret_cast<int8_t*>(dst), info, lines);   break;
+    case qb3_dtype::QB3_U16: convert_lines(src, reinterpret_cast<uint16_t*>(dst), info, lines); break;
+    case qb3_dtype::QB3_I16: convert_lines(src, reinterpret_cast<int16_t*>(dst), info, lines);  break;
+    case qb3_dtype::QB3_U32: convert_lines(src, reinterpret_cast<uint32_t*>(dst), info, lines); break;
+    case qb3_dtype::QB3_I32: convert_lines(src, reinterpret_cast<int32_t*>(dst), info, lines);  break;
+    case qb3_dtype::QB3_U64: convert_lines(src, reinterpret_cast<uint64_t*>(dst), info, lines); break;
+    case qb3_dtype::QB3_I64: convert_lines(src, reinterpret_cast<int64_t*>(dst), info, lines);  break;
+    case qb3_dtype::QB3_F32: convert_lines(src, reinterpret_cast<float*>(dst), info, lines);    break;
+    case qb3_dtype::QB3_F64: convert_lines(src, reinterpret_cast<double*>(dst), info, lines);   break;
+    }
+}
+
+// Start the statistics, the minimum and maximum are set to zero at the end if there are no values
+static void stats_start(const decs& info) {
+    for (size_t c = 0; c < info.nbands; c++) {
+        info.stats[4 * c] = std::numeric_limits<double>::max();
+        info.stats[4 * c + 1] = -std::numeric_limits<double>::max();
+        info.stats[4 * c + 2] = info.stats[4 * c + 3] = 0;
+    }
+    if (info.hist)
+        std::fill(info.hist, info.hist + info.nbands * (szof(info.type) == 1 ? 0x100 : 0x10000), uint64_t(0));
+}
+
+static void stats_end(const decs& info) {
+    for (size_t c = 0; c < info.nbands; c++)
+        if (0 == info.stats[4 * c + 3])
+            info.stats[4 * c] = info.stats[4 * c + 1] = 0;
+}
+
+// Add lines of an image to the statistics, only the bands which are stored in the output
+// T is the unsigned integer type, V is the value type, layout is the image layout
+// ND skips the NoData values, HIST updates the histogram, the floating point NaN are skipped
+template<typename T, typename V, bool ND, bool HIST>
+static void band_stats(const T* image, const decs& info, const decs& layout, size_t lines) {
+    const size_t xsize(info.xsize), stride(line_stride(layout)), pstride(pixel_stride(layout));
+    const size_t hsize(sizeof(T) == 1 ? 0x100 : 0x10000);
+    // Histogram index of the value, 0 for the type minimum
+    const T hbias(std::is_signed<V>() ? T(T(1) << (8 * sizeof(T) - 1)) : T(0));
+    const T ndv(static_cast<T>(info.ndv));
+    for (size_t c = 0; c < info.nbands; c++) {
+        if (!is_stored(info, c))
+            continue;
+        V vmin(std::numeric_limits<V>::max()), vmax(std::numeric_limits<V>::lowest());
+        // Exact and faster for the small integer types
+        typename std::conditional<(sizeof(V) < 4 && std::is_integral<V>::value), int64_t, double>::type sum(0);
+        size_t count(0);
+        uint64_t* hist(info.hist + c * hsize);
+        for (size_t y = 0; y < lines; y++) {
+            auto line = image + y * stride + band_offset(layout, c);
+            for (size_t x = 0; x < xsize; x++) {
+                T u(line[x * pstride]);
+                if (ND && u == ndv)
+                    continue;
+                V v;
+                memcpy(&v, &u, sizeof(V));
+                if (std::is_floating_point<V>::value && v != v)
+                    continue;
+                vmin = (v < vmin) ? v : vmin;
+                vmax = (v > vmax) ? v : vmax;
+                sum += v;
+                count++;
+                if (HIST)
+                    hist[static_cast<T>(u ^ hbias) & (hsize - 1)]++;
+            }
         }
+        if (!count)
+            continue;
+        double* st(info.stats + 4 * c);
+        st[0] = std::min(st[0], static_cast<double>(vmin));
+        st[1] = std::max(st[1], static_cast<double>(vmax));
+        st[2] += static_cast<double>(sum);
+        st[3] += static_cast<double>(count);
+    }
+}
+
+template<typename T, typename V>
+static void band_stats(const T* image, const decs& info, const decs& layout, size_t lines) {
+    if (info.nodata && info.hist)
+        band_stats<T, V, true, true>(image, info, layout, lines);
+    else if (info.nodata)
+        band_stats<T, V, true, false>(image, info, layout, lines);
+    else if (info.hist)
+        band_stats<T, V, false, true>(image, info, layout, lines);
+    else
+        band_stats<T, V, false, false>(image, info, layout, lines);
+}
+
+// Statistics by value type
+static void image_stats(const void* image, const decs& info, const decs& layout, size_t lines) {
+#define STATS(T, V) band_stats<T, V>(static_cast<const T*>(image), info, layout, lines)
+    switch (info.type) {
+    case qb3_dtype::QB3_U8:  STATS(uint8_t, uint8_t);   break;
+    case qb3_dtype::QB3_I8:  STATS(uint8_t, int8_t);    break;
+    case qb3_dtype::QB3_U16: STATS(uint16_t, uint16_t); break;
+    case qb3_dtype::QB3_I16: STATS(uint16_t, int16_t);  break;
+    case qb3_dtype::QB3_U32: STATS(uint32_t, uint32_t); break;
+    case qb3_dtype::QB3_I32: STATS(uint32_t, int32_t);  break;
+    case qb3_dtype::QB3_U64: STATS(uint64_t, uint64_t); break;
+    case qb3_dtype::QB3_I64: STATS(uint64_t, int64_t);  break;
+    case qb3_dtype::QB3_F32: STATS(uint32_t, float);    break;
+    case qb3_dtype::QB3_F64: STATS(uint64_t, double);   break;
     }
+#undef STATS
+}
+
+// Finish a decoded strip, then convert or copy it to the output
+// T is the unsigned integer type used by the decoder, V is the value type
+template<typename T, typename V>
+static void flush_strip(const QB3::ostrip& os, void* strip, size_t y, size_t lines, size_t k) {
+    const decs& info(*os.info);
+    decs st(info); // The strip is compact and band interleaved
+    set_compact(st);
+    st.ysize = lines;
+    T* const data(reinterpret_cast<T*>(strip));
+    if (info.quanta > 1)
+        dequantize(reinterpret_cast<V*>(data), &st);
+    if (info.mask)
+        fill_strip(data, st, k);
+    if (info.stats) { // The last strip is rolled up, skip the lines which are already done
+        const size_t skip((lines - y % lines) % lines);
+        band_stats<T, V>(data + skip * info.xsize * info.nbands, info, st, lines - skip);
+    }
+    auto dst = static_cast<uint8_t*>(os.dst) + y * line_stride(info) * szof(info.convert ? info.otype : info.type);
+    if (info.convert)
+        convert_image(reinterpret_cast<const V*>(data), dst, info, lines);
+    else // The channels which are not bands are filled later
+        from_compact(reinterpret_cast<T*>(dst), data, info, lines);
 }
 
 // Check a 2 byte signature
@@ -128,7 +562,8 @@ static bool check_curve(uint64_t val) {
 // returns nullptr if it fails, usually because the source is corrupt
 // If successful, size containts 3 values, x size, y size and number of bands
 decsp qb3_read_start(void* source, size_t source_size, size_t *image_size) {
-    if (source_size < QB3_HDRSZ + 4 || nullptr == image_size)
+    // The header, the data signature and at least one byte of data
+    if (source_size < QB3_HDRSZ + 3 || nullptr == image_size)
         return nullptr; // Too short to be a QB3 format stream
     iBits s(reinterpret_cast<uint8_t*>(source), source_size);
     auto val = s.pull(64);
@@ -152,12 +587,37 @@ decsp qb3_read_start(void* source, size_t source_size, size_t *image_size) {
     if (p->nbands > QB3_MAXBANDS 
         || (p->mode >= qb3_mode::QB3M_END && p->mode != qb3_mode::QB3M_STORED)
         || 0 != (val & 0x8080) 
-        || p->type > qb3_dtype::QB3_I64) {
+        || p->type > qb3_dtype::QB3_F64) {
         delete p;
         return nullptr;
     }
-    p->s_in = static_cast<uint8_t*>(source) + QB3_HDRSZ;
+    p->s_start = static_cast<uint8_t*>(source);
+    p->s_in = p->s_start + QB3_HDRSZ;
     p->s_size = source_size - QB3_HDRSZ;
+    // Extended size, the high 16 bits of the sizes, only as the first chunk
+    if (check_sig(val, "XS")) {
+        s.advance(24); // Skip bands, type and mode
+        val = s.pull(64);
+        if ((val >> 16 & 0xffff) != 4 || p->s_size < 8 + 3) {
+            delete p;
+            return nullptr;
+        }
+        p->xsize += (val >> 32 & 0xffff) << 16;
+        p->ysize += (val >> 48) << 16;
+        p->s_in += 8;
+        p->s_size -= 8;
+    }
+    // The decoded size has to fit
+    if (!size_fits(p->xsize, p->ysize, p->nbands, p->type)) {
+        delete p;
+        return nullptr;
+    }
+    p->palsize = new size_t[p->nbands]();
+    p->cband = new uint8_t[p->nbands]();
+    p->lp = new band_lp[p->nbands]();
+    // No band differential, unless a CB chunk is present
+    for (size_t c = 0; c < p->nbands; c++)
+        p->cband[c] = static_cast<uint8_t>(c);
 
     // Pass back the image size
     image_size[0] = p->xsize;
@@ -175,13 +635,20 @@ decsp qb3_read_start(void* source, size_t source_size, size_t *image_size) {
 // Returns true if no failure is detected and DT is found
 bool qb3_read_info(decsp p) {
     // Check that the input structure is in the correct stage
-    if (p->stage != 1 || p->error || !p->s_in || p->s_size < 4) {
+    if (p->stage != 1 || p->error || !p->s_in || p->s_size < 3) {
         if (QB3E_OK == p->error)
             p->error = QB3E_EINV;
         return false; // Didn't work
     }
 
     iBits s(p->s_in, p->s_size);
+    // Packed NoData mask, it is unpacked after all the chunks are read
+    const uint8_t* ndmask(nullptr);
+    size_t ndlen(0);
+    // Rung summary size, checked after all the chunks are read
+    size_t rslen(0);
+    // Strip checksums size, checked after all the chunks are read
+    size_t cklen(0);
     // Need to parse the headers
     do {
         auto val = s.peek();
@@ -198,8 +665,158 @@ bool qb3_read_info(decsp p) {
             s.advance(32); // Skip the bytes we read
             p->quanta = s.pull(size_t(len) * 8);
             // Could check that the quanta is consistent with the data type
-            if (p->quanta < 2)
+            if (p->quanta < 2 || is_float(p->type))
+                p->error = QB3E_EINV;
+        }
+        else if (check_sig(chunk, "QF")) { // Floating point grid
+            if (len != 24 || !is_float(p->type)) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            s.advance(32); // CHUNK + LEN
+            p->maxerr = fvalue(s.pull(64));
+            p->fstep = fvalue(s.pull(64));
+            p->foffset = fvalue(s.pull(64));
+            if (!(p->fstep > 0) || !std::isfinite(p->fstep) || !std::isfinite(p->foffset)
+                || !(p->maxerr > 0) || !std::isfinite(p->maxerr))
+                p->error = QB3E_EINV;
+        }
+        else if (check_sig(chunk, "PL")) { // Palette
+            if (p->pal) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            s.advance(32); // CHUNK + LEN
+            const size_t tsz(szof(p->type));
+            p->pal = new uint64_t[p->nbands * PALSZ];
+            size_t used(0);
+            for (size_t c = 0; c < p->nbands && used < len; c++) {
+                auto pal = p->pal + c * PALSZ;
+                p->palsize[c] = 1 + s.pull(8);
+                used += 1 + p->palsize[c] * tsz;
+                if (used > len)
+                    break;
+                for (size_t i = 0; i < p->palsize[c]; i++)
+                    pal[i] = s.pull(tsz * 8);
+                // Out of range indices decode as the last entry
+                for (size_t i = p->palsize[c]; i < PALSZ; i++)
+                    pal[i] = pal[p->palsize[c] - 1];
+            }
+            if (used != len || 0 == p->palsize[p->nbands - 1])
+                p->error = QB3E_EINV;
+        }
+        else if (check_sig(chunk, "RF")) { // Reference frame
+            if (len != 0) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            s.advance(32); // CHUNK + LEN
+            p->temporal = true;
+        }
+        else if (check_sig(chunk, "AS")) { // Adaptive rung switch
+            if (len != 0 || QB3M_FTL == p->mode) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            s.advance(32); // CHUNK + LEN
+            p->adaptive = true;
+        }
+        else if (check_sig(chunk, "BS")) { // Block size, only for the Hilbert base modes
+            if (len != 1 || !(QB3M_BASE_H == p->mode || QB3M_RLE_H == p->mode || QB3M_LZ_H == p->mode)) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            s.advance(32); // CHUNK + LEN
+            p->bsize = static_cast<size_t>(s.pull(8));
+            if (B8 != p->bsize || p->xsize < B8 || p->ysize < B8)
+                p->error = QB3E_EINV;
+        }
+        else if (check_sig(chunk, "ND")) { // NoData value and block mask
+            const size_t tsz(szof(p->type));
+            if (p->nodata || len <= tsz || is_med(p->mode) || QB3M_STORED == p->mode) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            s.advance(32); // CHUNK + LEN
+            p->nodata = true;
+            p->ndv = s.pull(tsz * 8);
+            ndmask = p->s_in + s.position() / 8;
+            ndlen = len - tsz;
+            if (s.avail() < ndlen * 8) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            s.advance(ndlen * 8);
+        }
+        else if (check_sig(chunk, "BG")) { // Planar band group stream sizes
+            if (p->gsize || len < 16 || len % 8 || QB3M_STORED == p->mode) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            s.advance(32); // CHUNK + LEN
+            if (s.avail() < len * 8) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            p->ngroups = len / 8;
+            p->gsize = new size_t[p->ngroups];
+            for (size_t g = 0; g < p->ngroups; g++)
+                p->gsize[g] = static_cast<size_t>(s.pull(64));
+        }
+        else if (check_sig(chunk, "st")) { // Band statistics
+            const size_t tsz(szof(p->type));
+            if (p->bstats || len != p->nbands * (2 * tsz + 16)) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            s.advance(32); // CHUNK + LEN
+            if (s.avail() < size_t(len) * 8) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            p->bstats = new double[p->nbands * 4];
+            for (size_t c = 0; c < p->nbands; c++) {
+                p->bstats[4 * c] = dvalue(s.pull(tsz * 8), p->type);
+                p->bstats[4 * c + 1] = dvalue(s.pull(tsz * 8), p->type);
+                p->bstats[4 * c + 2] = dvalue(s.pull(64), QB3_F64);
+                p->bstats[4 * c + 3] = static_cast<double>(s.pull(64));
+            }
+        }
+        else if (check_sig(chunk, "rs")) { // Rung summary
+            if (p->rungs || QB3M_STORED == p->mode) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            s.advance(32); // CHUNK + LEN
+            p->rungs = p->s_in + s.position() / 8;
+            rslen = len;
+            if (s.avail() < rslen * 8) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            s.advance(rslen * 8);
+        }
+        else if (check_sig(chunk, "ck")) { // Strip checksums
+            if (p->crcs || QB3M_STORED == p->mode) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            s.advance(32); // CHUNK + LEN
+            p->crcs = p->s_in + s.position() / 8;
+            cklen = len;
+            if (s.avail() < cklen * 8) {
                 p->error = QB3E_EINV;
+                break;
+            }
+            s.advance(cklen * 8);
+        }
+        else if (check_sig(chunk, "BC")) { // Block copy
+            if (len != 0 || !is_cf(p->mode)) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            s.advance(32); // CHUNK + LEN
+            p->blockcopy = true;
         }
         else if (check_sig(chunk, "CB")) { // Core bands
             // check that is matches the band count
@@ -215,6 +832,25 @@ bool qb3_read_info(decsp p) {
             }
             // Should we check the mapping?
         }
+        else if (check_sig(chunk, "LP")) { // Linear band predictor
+            if (len != p->nbands * 13) {
+                p->error = QB3E_EINV;
+                break;
+            }
+            s.advance(32); // CHUNK + LEN
+            for (size_t i = 0; i < p->nbands; i++) {
+                p->lp[i].a = static_cast<int32_t>(s.pull(32));
+                p->lp[i].s = static_cast<uint8_t>(s.pull(8));
+                p->lp[i].b = static_cast<int64_t>(s.pull(64));
+                if (p->lp[i].s > 62) {
+                    p->error = QB3E_EINV;
+                    break;
+                }
+            }
+            if (p->error)
+                break;
+            p->linear = true;
+        }
         else if (check_sig(chunk, "DT")) {
             s.advance(16);
             // Update the position
@@ -252,7 +888,7 @@ bool qb3_read_info(decsp p) {
             // Unknown chunk
             // Ignore it if the first letter is lower case
             if (chunk & 0x20)
-                s.advance(size_t(len) * 8);
+                s.advance(32 + size_t(len) * 8); // CHUNK + LEN + payload
             // Otherwise, it's an error
             else
                 p->error = QB3E_UNKN;
@@ -260,6 +896,35 @@ bool qb3_read_info(decsp p) {
     } while (p->stage != 2 && QB3E_OK == p->error && !s.empty());
     if (QB3E_OK == p->error && 2 != p->stage) // Should be s.empty()
         p->error = QB3E_EINV; // not expected
+    // The band groups are defined by the band mapping
+    if (QB3E_OK == p->error && p->gsize) {
+        std::vector<size_t> gband(p->nbands), gstart(p->nbands + 1);
+        if (band_groups(p->cband, p->nbands, gband.data(), gstart.data()) != p->ngroups)
+            p->error = QB3E_EINV;
+    }
+    // The block size is known now
+    if (QB3E_OK == p->error && p->rungs) {
+        const size_t bs(p->bsize ? p->bsize : B);
+        if (rslen != p->nbands * ((p->ysize + bs - 1) / bs))
+            p->error = QB3E_EINV;
+    }
+    if (QB3E_OK == p->error && p->crcs) {
+        const size_t bs(p->bsize ? p->bsize : B);
+        if (p->xsize < bs || p->ysize < bs
+            || cklen != 4 * (p->gsize ? p->ngroups : 1) * ((p->ysize + bs - 1) / bs))
+            p->error = QB3E_EINV;
+    }
+    if (QB3E_OK == p->error && p->nodata) {
+        const size_t bs(p->bsize ? p->bsize : B);
+        const size_t nwords(((p->xsize + bs - 1) / bs * ((p->ysize + bs - 1) / bs) + 63) / 64);
+        if (p->xsize < bs || p->ysize < bs)
+            p->error = QB3E_EINV;
+        else {
+            p->mask = new uint64_t[nwords];
+            if (!unpack_mask(ndmask, ndlen, p->mask, nwords))
+                p->error = QB3E_EINV;
+        }
+    }
     return QB3E_OK == p->error;
 }
 
@@ -306,15 +971,139 @@ static size_t deRLE0Size(const uint8_t* src, size_t len) {
     return count + end - src;
 }
 
+// The size of the LZ decoded data, from the prefix
+static size_t deLZSize(const uint8_t* src, size_t len) {
+    if (len < LZ_PREFIX)
+        return ~size_t(0);
+    uint64_t sz(0);
+    for (size_t i = 0; i < LZ_PREFIX; i++)
+        sz |= uint64_t(src[i]) << (8 * i);
+    return static_cast<size_t>(sz);
+}
+
+// Decode LZ data, returns false if the input is corrupt or the output size doesn't match
+static bool deLZ(const uint8_t* src, size_t slen, uint8_t* d, size_t dlen)
+{
+    const uint8_t* const end(src + slen);
+    uint8_t* const first(d);
+    uint8_t* const last(d + dlen);
+    src += LZ_PREFIX;
+    // Reads a length nibble continuation, returns false if the input ends
+    auto extra = [&](size_t& n) {
+        uint8_t c;
+        do {
+            if (src >= end)
+                return false;
+            n += c = *src++;
+        } while (255 == c);
+        return true;
+    };
+    while (src < end) {
+        uint8_t token = *src++;
+        size_t lit(token >> 4);
+        if (15 == lit && !extra(lit))
+            return false;
+        if (lit > size_t(end - src) || lit > size_t(last - d))
+            return false;
+        memcpy(d, src, lit);
+        d += lit;
+        src += lit;
+        if (src == end) // Last sequence, only literals
+            break;
+        if (end - src < 2)
+            return false;
+        size_t off = src[0] | (size_t(src[1]) << 8);
+        src += 2;
+        size_t mlen(token & 0xf);
+        if (15 == mlen && !extra(mlen))
+            return false;
+        mlen += LZ_MINMATCH;
+        if (0 == off || off > size_t(d - first) || mlen > size_t(last - d))
+            return false;
+        const uint8_t* m(d - off);
+        if (off >= 8) { // Non overlapping 8 byte chunks
+            for (; mlen >= 8; mlen -= 8, d += 8, m += 8)
+                memcpy(d, m, 8);
+        }
+        while (mlen--)
+            *d++ = *m++;
+    }
+    return d == last;
+}
+
+static bool needs_lz(qb3_mode mode) {
+    return QB3M_LZ_H == mode || QB3M_CF_LZ_H == mode;
+}
+
 static bool needs_rle(qb3_mode mode) {
     return (QB3M_RLE == mode || QB3M_RLE_H == mode 
         || QB3M_CF_RLE == mode || QB3M_CF_RLE_H == mode);
 }
 
+// Copies a small image to or from the padded layout used for encoding
+template<typename T>
+static void smallcopy(T* padded, T* image, const decs& info, bool topadded)
+{
+    // Strides in T units
+    const size_t stride(line_stride(info)), pstride(pixel_stride(info));
+    auto data = padded;
+    if (info.xsize < B) { // narrow and tall, copy line by line
+        if (topadded)
+            to_compact(data, image, info, info.ysize);
+        else
+            from_compact(image, data, info, info.ysize);
+    }
+    else { // wide and short, copy pixel by pixel
+        for (size_t x = 0; x < info.xsize; x++) {
+            for (size_t y = 0; y < info.ysize; y++) {
+                auto dst = image + y * stride + x * pstride;
+                for (size_t c = 0; c < info.nbands; c++, data++)
+                    if (!is_stored(info, c)) // The padded buffer starts as zero
+                        continue;
+                    else if (topadded)
+                        *data = dst[band_offset(info, c)];
+                    else
+                        dst[band_offset(info, c)] = *data;
+            }
+        }
+    }
+}
+
+// A band which is not stored is still needed by a stored derived band, or by block copy
+static bool needs_all_bands(const decs& info) {
+    if (!info.bsel)
+        return false;
+    for (size_t c = 0; c < info.nbands; c++) {
+        if (!is_stored(info, c) && info.blockcopy)
+            return true;
+        if (is_stored(info, c) && !is_stored(info, info.cband[c]))
+            return true;
+    }
+    return false;
+}
+
 // Main decode template, deals with small images
 template<typename T>
 bool dec(uint8_t* source, size_t len, T* image, const decs& info)
 {
+    // Decode all bands to a temporary image, then store the selected ones
+    // The reference frame values of the bands which are not stored are not used
+    if (needs_all_bands(info)) {
+        decs full(info);
+        set_compact(full);
+        std::vector<T> buffer(info.xsize * info.ysize * info.nbands), refbuf;
+        if (info.temporal) {
+            refbuf.resize(buffer.size());
+            to_compact(refbuf.data(), static_cast<const T*>(info.ref), info, info.ysize);
+            full.ref = refbuf.data();
+        }
+        if (dec(source, len, buffer.data(), full))
+            return true; // failure
+        from_compact(image, buffer.data(), info, info.ysize);
+        return false;
+    }
+    if (B8 == info.bsize)
+        return QB3::decode<T, B8>(source, len, image, info);
     if (info.xsize >= B && info.ysize >= B)
         return QB3::decode(source, len, image, info);
 
@@ -322,37 +1111,131 @@ bool dec(uint8_t* source, size_t len, T* image, const decs& info)
     decs actual(info);
     size_t ngroups = (info.xsize * info.ysize + B2 - 1) / B2;
     size_t bufsz = ngroups * B2 * info.nbands;
-    std::vector<T> tempbuf(bufsz);
-    actual.stride = 0; // contiguous
+    std::vector<T> tempbuf(bufsz), tempref;
+    set_compact(actual); // contiguous, band interleaved
     actual.xsize = info.xsize < B ? B : ngroups * B;
     actual.ysize = info.xsize < B ? ngroups * B : B;
+    // The reference frame is padded the same way
+    if (info.temporal) {
+        tempref.resize(bufsz);
+        smallcopy(tempref.data(), static_cast<T*>(const_cast<void*>(info.ref)), info, true);
+        actual.ref = tempref.data();
+    }
     if (QB3::decode(source, len, tempbuf.data(), actual))
         return true; // failure
     // It worked, now copy the data into the destination
-    // Copy line by line, until we run out of lines
-    size_t linesize = info.xsize * info.nbands;
-    // Stride in T units
-    size_t stride = info.stride ? info.stride : linesize;
-    auto data = tempbuf.data();
-    if (info.xsize < B) { // narrow and tall, copy line by line
-        for (size_t y = 0; y < info.ysize; y++) {
-            auto dst = image + y * stride;
-            memcpy(dst, data, linesize * sizeof(T));
-            data += linesize;
+    smallcopy(tempbuf.data(), image, info, false);
+    return false; // success
+}
+
+// Decode each band group from its own stream, directly to the output
+// The group bands are decoded with the per band state of the group
+template<typename T>
+bool dec_planar(uint8_t* source, size_t len, T* image, const decs& info)
+{
+    const size_t bands(info.nbands);
+    std::vector<size_t> gband(bands), gstart(bands + 1);
+    band_groups(info.cband, bands, gband.data(), gstart.data());
+    // Block rows, the strip checksums are by group
+    const size_t bs(info.bsize ? info.bsize : B), rows((info.ysize + bs - 1) / bs);
+    for (size_t g = 0; g < info.ngroups; g++) {
+        if (info.gsize[g] > len || 0 == info.gsize[g])
+            return true; // failure
+        const size_t* gb(gband.data() + gstart[g]);
+        const size_t n(gstart[g + 1] - gstart[g]);
+        std::vector<size_t> palsize(n), gsel(n);
+        std::vector<uint8_t> cband(n);
+        std::vector<band_lp> lp(n);
+        std::vector<uint64_t> pal(info.pal ? n * PALSZ : 0);
+        for (size_t i = 0; i < n; i++) {
+            const size_t c(gb[i]);
+            for (size_t j = 0; j < n; j++)
+                if (gb[j] == info.cband[c])
+                    cband[i] = static_cast<uint8_t>(j);
+            palsize[i] = info.palsize[c];
+            lp[i] = info.lp[c];
+            if (info.pal)
+                std::copy(info.pal + c * PALSZ, info.pal + (c + 1) * PALSZ, pal.begin() + i * PALSZ);
         }
-    }
-    else { // wide and short, copy pixel by pixel
-        for (size_t x = 0; x < info.xsize; x++) {
-            for (size_t y = 0; y < info.ysize; y++) {
-                auto dst = image + y * stride + x * info.nbands;
-                memcpy(dst, data, info.nbands * sizeof(T));
-                data += info.nbands;
-            }
+        decs sub(info);
+        set_group(sub, info, gb, n, gsel.data());
+        // The groups without stored bands are skipped
+        if (std::count(gsel.begin(), gsel.end(), NOBAND) == static_cast<std::ptrdiff_t>(n)) {
+            source += info.gsize[g];
+            len -= info.gsize[g];
+            continue;
         }
+        sub.palsize = palsize.data();
+        sub.cband = cband.data();
+        sub.lp = lp.data();
+        sub.pal = info.pal ? pal.data() : nullptr;
+        sub.crcs = info.crcs ? info.crcs + 4 * g * rows : nullptr;
+        if (dec(source, info.gsize[g], image, sub))
+            return true;
+        source += info.gsize[g];
+        len -= info.gsize[g];
     }
     return false; // success
 }
 
+// Decode one strip at a time to a buffer, then finish each strip and store it in the output
+// T is the unsigned integer type used by the decoder, V is the value type
+template<typename T, typename V>
+static bool dec_strips(uint8_t* source, size_t len, void* dst, const decs& info)
+{
+    decs work(info);
+    set_compact(work);
+    std::vector<T> strip((info.bsize ? info.bsize : B) * info.xsize * info.nbands);
+    const QB3::ostrip os = { flush_strip<T, V>, &info, dst };
+    if (B8 == info.bsize)
+        return QB3::decode<T, B8>(source, len, strip.data(), work, &os);
+    return QB3::decode(source, len, strip.data(), work, &os);
+}
+
+// Can be decoded one strip at a time
+static bool strip_mode(const decs& info) {
+    return info.mode != QB3M_STORED && !is_med(info.mode) && !info.gsize
+        && info.xsize >= B && info.ysize >= B;
+}
+
+// Decoded one strip at a time, for the conversion or the statistics
+// The statistics without a conversion can use the reference frame, which has the output layout
+static bool by_strips(const decs& info) {
+    return strip_mode(info) && (info.convert || (info.stats && !info.temporal));
+}
+
+static size_t qb3_decode(decsp p, void* source, size_t src_sz, void* dst);
+
+// Decode to a temporary image, then convert it to the output
+static size_t convert_decode(decsp p, void* source, size_t src_sz, void* dst)
+{
+    decs work(*p);
+    set_compact(work);
+    work.convert = false;
+    work.stats = nullptr;
+    std::vector<uint8_t> image(qb3_decoded_size(p));
+    auto sz = qb3_decode(&work, source, src_sz, image.data());
+    if (!sz) {
+        p->error = work.error ? work.error : QB3E_EINV;
+        return 0;
+    }
+    if (p->stats)
+        image_stats(image.data(), *p, work, p->ysize);
+    switch (p->type) {
+    case qb3_dtype::QB3_U8:  convert_image(image.data(), dst, *p, p->ysize); break;
+    case qb3_dtype::QB3_I8:  convert_image(reinterpret_cast<int8_t*>(image.data()), dst, *p, p->ysize);   break;
+    case qb3_dtype::QB3_U16: convert_image(reinterpret_cast<uint16_t*>(image.data()), dst, *p, p->ysize); break;
+    case qb3_dtype::QB3_I16: convert_image(reinterpret_cast<int16_t*>(image.data()), dst, *p, p->ysize);  break;
+    case qb3_dtype::QB3_U32: convert_image(reinterpret_cast<uint32_t*>(image.data()), dst, *p, p->ysize); break;
+    case qb3_dtype::QB3_I32: convert_image(reinterpret_cast<int32_t*>(image.data()), dst, *p, p->ysize);  break;
+    case qb3_dtype::QB3_U64: convert_image(reinterpret_cast<uint64_t*>(image.data()), dst, *p, p->ysize); break;
+    case qb3_dtype::QB3_I64: convert_image(reinterpret_cast<int64_t*>(image.data()), dst, *p, p->ysize);  break;
+    case qb3_dtype::QB3_F32: convert_image(reinterpret_cast<float*>(image.data()), dst, *p, p->ysize);    break;
+    case qb3_dtype::QB3_F64: convert_image(reinterpret_cast<double*>(image.data()), dst, *p, p->ysize);   break;
+    }
+    return sz;
+}
+
 static size_t stored_decode(decsp p, void* source, size_t src_sz, void* dst)
 {
     auto src = reinterpret_cast<uint8_t *>(source);
@@ -361,15 +1244,16 @@ static size_t stored_decode(decsp p, void* source, size_t src_sz, void* dst)
         p->error = QB3E_EINV;
         return 0;
     }
-    if (p->stride == 0) { // contiguous data
+    if (line_stride(*p) == p->xsize * p->nbands && is_interleaved(*p)) { // contiguous data
         memcpy(dst, source, src_sz);
         return src_sz;
     }
-    // With stride, need to copy line by line
-    size_t linesize = p->xsize * p->nbands * typesizes[p->type];
-    auto d = reinterpret_cast<uint8_t*>(dst);
-    for (size_t y = 0; y < p->ysize; y++) {
-        memcpy(d + y * p->stride, src + y * linesize, linesize);
+    // With strides, need to copy line by line, the stored data is band interleaved
+    switch (typesizes[p->type]) {
+    case 1: from_compact(reinterpret_cast<uint8_t*>(dst), src, *p, p->ysize); break;
+    case 2: from_compact(reinterpret_cast<uint16_t*>(dst), reinterpret_cast<uint16_t*>(src), *p, p->ysize); break;
+    case 4: from_compact(reinterpret_cast<uint32_t*>(dst), reinterpret_cast<uint32_t*>(src), *p, p->ysize); break;
+    case 8: from_compact(reinterpret_cast<uint64_t*>(dst), reinterpret_cast<uint64_t*>(src), *p, p->ysize); break;
     }
     return src_sz;
 }
@@ -381,6 +1265,16 @@ static size_t qb3_decode(decsp p, void* source, size_t src_sz, void* dst)
 {
     int error_code = 0;
     auto src = reinterpret_cast<uint8_t *>(source);
+    // The reference frame has the output type, it can't be converted
+    if (p->convert && p->temporal) {
+        p->error = QB3E_EINV;
+        return 0;
+    }
+
+    // Convert while decoding when possible, otherwise decode to a temporary image
+    if (p->convert && !strip_mode(*p))
+        return convert_decode(p, source, src_sz, dst);
+
     // If the data is stored and size is right, just copy it
     if (p->mode == qb3_mode::QB3M_STORED)
         return stored_decode(p, source, src_sz, dst);
@@ -391,6 +1285,24 @@ static size_t qb3_decode(decsp p, void* source, size_t src_sz, void* dst)
         return 0;
     }
 
+    // The reference frame is required, it can't be combined with lossy encodings
+    if (p->temporal && (nullptr == p->ref || p->quanta > 1 || p->fstep > 0)) {
+        p->error = QB3E_EINV;
+        return 0;
+    }
+
+    // The palette is only used for lossless encoding, without other transforms
+    if (p->pal && (p->temporal || p->quanta > 1 || p->fstep > 0 || p->linear)) {
+        p->error = QB3E_EINV;
+        return 0;
+    }
+
+    // The planar band groups are not used with RLE or LZ
+    if (p->gsize && (needs_rle(p->mode) || needs_lz(p->mode))) {
+        p->error = QB3E_EINV;
+        return 0;
+    }
+
     std::vector<uint8_t> buffer;
     // If RLE is needed, it is expensive, allocates a whole new buffer
     if (needs_rle(p->mode)) {
@@ -412,7 +1324,45 @@ static size_t qb3_decode(decsp p, void* source, size_t src_sz, void* dst)
         src_sz = sz;
     }
 
-#define DEC(T) dec(src, src_sz, reinterpret_cast<T*>(dst), *p)
+    if (needs_lz(p->mode)) {
+        // Same sanity check as RLE
+        auto sz = deLZSize(src, src_sz);
+        if (sz > qb3_decoded_size(p)) {
+            p->error = QB3E_ERR;
+            return 0;
+        }
+        buffer.resize(sz);
+        if (!deLZ(src, src_sz, buffer.data(), sz)) {
+            p->error = QB3E_EINV;
+            return 0;
+        }
+        src = buffer.data();
+        src_sz = sz;
+    }
+
+#define CDEC(T, V) dec_strips<T, V>(src, src_sz, dst, *p)
+    // Dequantize and NoData fill are done for each strip
+    if (by_strips(*p)) {
+        switch (p->type) {
+        case qb3_dtype::QB3_U8:  error_code = CDEC(uint8_t, uint8_t);   break;
+        case qb3_dtype::QB3_I8:  error_code = CDEC(uint8_t, int8_t);    break;
+        case qb3_dtype::QB3_U16: error_code = CDEC(uint16_t, uint16_t); break;
+        case qb3_dtype::QB3_I16: error_code = CDEC(uint16_t, int16_t);  break;
+        case qb3_dtype::QB3_U32: error_code = CDEC(uint32_t, uint32_t); break;
+        case qb3_dtype::QB3_I32: error_code = CDEC(uint32_t, int32_t);  break;
+        case qb3_dtype::QB3_U64: error_code = CDEC(uint64_t, uint64_t); break;
+        case qb3_dtype::QB3_I64: error_code = CDEC(uint64_t, int64_t);  break;
+        case qb3_dtype::QB3_F32: error_code = CDEC(uint32_t, float);    break;
+        case qb3_dtype::QB3_F64: error_code = CDEC(uint64_t, double);   break;
+        default:
+            error_code = 3; // Invalid type
+        }
+        return error_code ? 0 : qb3_decoded_size(p);
+    }
+#undef CDEC
+
+#define DEC(T) (p->gsize ? dec_planar(src, src_sz, reinterpret_cast<T*>(dst), *p)\
+    : dec(src, src_sz, reinterpret_cast<T*>(dst), *p))
     switch (p->type) {
     case qb3_dtype::QB3_U8:
     case qb3_dtype::QB3_I8:
@@ -422,9 +1372,11 @@ static size_t qb3_decode(decsp p, void* source, size_t src_sz, void* dst)
         error_code = DEC(uint16_t); break;
     case qb3_dtype::QB3_U32:
     case qb3_dtype::QB3_I32:
+    case qb3_dtype::QB3_F32:
         error_code = DEC(uint32_t); break;
     case qb3_dtype::QB3_U64:
     case qb3_dtype::QB3_I64:
+    case qb3_dtype::QB3_F64:
         error_code = DEC(uint64_t); break;
     default:
         error_code = 3; // Invalid type
@@ -448,6 +1400,17 @@ static size_t qb3_decode(decsp p, void* source, size_t src_sz, void* dst)
         } // data type
     }
 #undef MUL
+
+#define FILL(T) fill_nodata(reinterpret_cast<T *>(dst), p)
+    if (!error_code && p->mask) {
+        switch (szof(p->type)) {
+        case 1: FILL(uint8_t);  break;
+        case 2: FILL(uint16_t); break;
+        case 4: FILL(uint32_t); break;
+        case 8: FILL(uint64_t); break;
+        }
+    }
+#undef FILL
     return error_code ? 0 : qb3_decoded_size(p);
 }
 
@@ -460,5 +1423,171 @@ size_t qb3_read_data(decsp p, void* dst) {
             p->error = QB3E_EINV;
         return 0; // Error signal
     }
-    return qb3_decode(p, p->s_in, p->s_size, dst);
+    if (p->stats)
+        stats_start(*p);
+    auto sz = qb3_decode(p, p->s_in, p->s_size, dst);
+    // Statistics from the output, when they were not done while decoding
+    if (sz && p->stats && !p->convert && !by_strips(*p))
+        image_stats(dst, *p, *p, p->ysize);
+    if (p->stats)
+        stats_end(*p);
+    // The channels which are not bands, when the values are not converted
+#define FILLC(T) fill_channels(reinterpret_cast<T *>(dst), *p, p->ysize)
+    if (sz && !p->convert && p->bsel) {
+        switch (p->type) {
+        case qb3_dtype::QB3_U8:  FILLC(uint8_t);  break;
+        case qb3_dtype::QB3_I8:  FILLC(int8_t);   break;
+        case qb3_dtype::QB3_U16: FILLC(uint16_t); break;
+        case qb3_dtype::QB3_I16: FILLC(int16_t);  break;
+        case qb3_dtype::QB3_U32: FILLC(uint32_t); break;
+        case qb3_dtype::QB3_I32: FILLC(int32_t);  break;
+        case qb3_dtype::QB3_U64: FILLC(uint64_t); break;
+        case qb3_dtype::QB3_I64: FILLC(int64_t);  break;
+        case qb3_dtype::QB3_F32: FILLC(float);    break;
+        case qb3_dtype::QB3_F64: FILLC(double);   break;
+        }
+    }
+#undef FILLC
+    return sz ? output_size(*p) : 0;
+}
+
+// Same as qb3_read_data when it only calls QB3::decode, on the input and to the output
+bool qb3_read_direct(decsp p) {
+    return p->stage == 2 && p->error == QB3E_OK && p->s_in && p->s_size
+        && p->mode != qb3_mode::QB3M_STORED && !needs_rle(p->mode) && !needs_lz(p->mode)
+        && !p->convert && !p->temporal && !p->pal && !p->gsize && !p->mask && !p->bsel && !p->stats
+        && p->quanta < 2 && p->xsize >= B && p->ysize >= B;
+}
+
+// Walks a stream with the decoder geometry, the small images are padded the same way as by dec
+template<typename T>
+static bool val(uint8_t* source, size_t len, const decs& info, size_t& pos)
+{
+    if (B8 == info.bsize)
+        return QB3::walk<T, B8>(source, len, info, pos);
+    if (info.xsize >= B && info.ysize >= B)
+        return QB3::walk<T>(source, len, info, pos);
+    decs actual(info);
+    size_t ngroups = (info.xsize * info.ysize + B2 - 1) / B2;
+    actual.xsize = info.xsize < B ? B : ngroups * B;
+    actual.ysize = info.xsize < B ? ngroups * B : B;
+    return QB3::walk<T>(source, len, actual, pos);
+}
+
+// Walks each band group stream, which have to add up to the whole input
+template<typename T>
+static bool val_planar(uint8_t* source, size_t len, const decs& info, size_t& pos)
+{
+    std::vector<size_t> gband(info.nbands), gstart(info.nbands + 1);
+    band_groups(info.cband, info.nbands, gband.data(), gstart.data());
+    const size_t bs(info.bsize ? info.bsize : B), rows((info.ysize + bs - 1) / bs);
+    size_t start(0);
+    for (size_t g = 0; g < info.ngroups; g++) {
+        pos = start;
+        if (info.gsize[g] > len - start || 0 == info.gsize[g])
+            return true;
+        decs sub(info);
+        sub.nbands = gstart[g + 1] - gstart[g];
+        sub.crcs = info.crcs ? info.crcs + 4 * g * rows : nullptr;
+        if (val<T>(source + start, info.gsize[g], sub, pos)) {
+            pos += start;
+            return true;
+        }
+        start += info.gsize[g];
+    }
+    pos = start;
+    return start != len;
+}
+
+// Call after qb3_read_info, parses the data without decoding it
+bool qb3_validate(decsp p, size_t* offset) {
+    if (p->stage != 2 || p->error != QB3E_OK
+        || p->s_in == nullptr || p->s_size == 0) {
+        if (p->error == QB3E_OK)
+            p->error = QB3E_EINV;
+        return false;
+    }
+    uint8_t* src(p->s_in);
+    size_t len(p->s_size), pos(0);
+    bool failed(false);
+    if (p->mode == qb3_mode::QB3M_STORED) {
+        pos = std::min(len, qb3_decoded_size(p));
+        failed = len != qb3_decoded_size(p);
+    }
+    else if (p->xsize * p->ysize < B2 || (p->gsize && (needs_rle(p->mode) || needs_lz(p->mode)))) {
+        failed = true;
+    }
+    else {
+        // The RLE and LZ errors are reported at the start of the data
+        std::vector<uint8_t> buffer;
+        if (needs_rle(p->mode)) {
+            auto sz = deRLE0Size(src, len);
+            failed = sz > qb3_decoded_size(p);
+            if (!failed) {
+                buffer.resize(sz);
+                failed = deRLE0(src, len, buffer.data(), sz);
+            }
+            src = buffer.data();
+            len = sz;
+        }
+        if (!failed && needs_lz(p->mode)) {
+            auto sz = deLZSize(src, len);
+            failed = sz > qb3_decoded_size(p);
+            if (!failed) {
+                std::vector<uint8_t> lzbuf(sz);
+                failed = !deLZ(src, len, lzbuf.data(), sz);
+                buffer.swap(lzbuf);
+            }
+            src = buffer.data();
+            len = sz;
+        }
+        if (!failed) {
+#define VAL(T) (p->gsize ? val_planar<T>(src, len, *p, pos) : val<T>(src, len, *p, pos))
+            switch (szof(p->type)) {
+            case 1: failed = VAL(uint8_t);  break;
+            case 2: failed = VAL(uint16_t); break;
+            case 4: failed = VAL(uint32_t); break;
+            case 8: failed = VAL(uint64_t); break;
+            default: failed = true;
+            }
+#undef VAL
+            if (src != p->s_in)
+                pos = 0;
+        }
+    }
+    if (offset)
+        *offset = (p->s_in - p->s_start) + (failed ? pos : p->s_size);
+    return !failed;
+}
+
+// Sequence index, at the end of the source
+size_t qb3_seq_read_index(const void* source, size_t size, size_t* offsets, size_t* interval) {
+    if (size < 12)
+        return 0;
+    auto src = reinterpret_cast<const uint8_t*>(source);
+    iBits s(src + size - 12, 12);
+    size_t nframes = static_cast<size_t>(s.pull(32));
+    size_t keyint = static_cast<size_t>(s.pull(32));
+    auto val = s.pull(32);
+    if (0 == nframes || !check_sig(val, "QB") || !check_sig(val >> 16, "3I")
+        || (size - 12) / 8 < nframes)
+        return 0;
+    size_t start = size - 12 - nframes * 8;
+    iBits idx(src + start, nframes * 8);
+    // Frames start at 0, in order, each one at least a main header long
+    for (size_t i = 0, last = 0; i < nframes; i++) {
+        auto offset = idx.pull(64);
+        if ((i == 0) ? (offset != 0) : (offset < last + QB3_HDRSZ))
+            return 0;
+        if (offset + QB3_HDRSZ > start)
+            return 0;
+        last = static_cast<size_t>(offset);
+        if (offsets)
+            offsets[i] = last;
+    }
+    if (offsets)
+        offsets[nframes] = start;
+    if (interval)
+        *interval = keyint;
+    return nframes;
 }
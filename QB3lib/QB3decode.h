@@ -15,7 +15,18 @@ limitations under the License.
 Contributors:  Lucian Plesea
 */
 
+#if !defined(QB3DECODE_H)
+#define QB3DECODE_H
 #include "QB3common.h"
+#include <vector>
+#include <memory>
+// For min and max
+#include <algorithm>
+
+// For the C++ API in QB3.hpp, which calls decode directly
+// Call after qb3_read_info, true if the data is decoded by QB3::decode, straight to the output
+// Otherwise use qb3_read_data
+LIBQB3_EXPORT bool qb3_read_direct(decsp p);
 
 namespace QB3 {
 // Decoding tables, twice as large as the encoding ones, 2k for 0-7
@@ -289,40 +300,204 @@ static void gdecode(iBits& s, size_t rung, T* group, uint64_t acc, size_t abits)
     }
 }
 
+// Restore the floating point values of a line, from the order preserving
+// integers or from the grid index when the encoding is error bounded
+template<typename T>
+static void unfloat(T* line, size_t n, const decs& info) {
+    if (info.fstep > 0)
+        for (size_t i = 0; i < n; i++)
+            line[i] = fgrid(line[i], info.fstep, info.foffset);
+    else
+        for (size_t i = 0; i < n; i++)
+            line[i] = funmap(line[i]);
+}
+
+// Replace the palette indices of a line with the values
+template<typename T>
+static void unpalette(T* line, size_t n, const decs& info) {
+    const size_t bands(info.nbands);
+    for (size_t c = 0; c < bands; c++) {
+        auto pal = info.pal + c * PALSZ;
+        for (size_t i = c; i < n; i += bands)
+            line[i] = static_cast<T>(pal[(line[i] < PALSZ) ? line[i] : (PALSZ - 1)]);
+    }
+}
+
+// Add the reference frame, then restore the floating point values of a line
+// The reference frame values are mapped the same way as the image values
+// Expands the palette instead, if there is one
+template<typename T>
+static void unref(T* line, const T* ref, size_t n, const decs& info) {
+    if (info.pal)
+        return unpalette(line, n, info);
+    if (ref && is_float(info.type))
+        for (size_t i = 0; i < n; i++)
+            line[i] += fmap(ref[i]);
+    else if (ref)
+        for (size_t i = 0; i < n; i++)
+            line[i] += ref[i];
+    if (is_float(info.type))
+        unfloat(line, n, info);
+}
+
+// Same as unref, for a whole line with the info layout, only the stored bands
+template<typename T>
+static void unref(T* line, const T* ref, const decs& info) {
+    const size_t xsize(info.xsize), bands(info.nbands);
+    if (is_interleaved(info))
+        return unref(line, ref, xsize * bands, info);
+    const size_t pstride(pixel_stride(info));
+    for (size_t c = 0; c < bands; c++) {
+        if (!is_stored(info, c))
+            continue;
+        const size_t oc(band_offset(info, c));
+        for (size_t x = 0; x < xsize; x++) {
+            T& v(line[x * pstride + oc]);
+            if (info.pal) {
+                v = static_cast<T>(info.pal[c * PALSZ + ((v < PALSZ) ? v : (PALSZ - 1))]);
+                continue;
+            }
+            if (ref) {
+                T r(ref[x * pstride + oc]);
+                v += is_float(info.type) ? fmap(r) : r;
+            }
+            if (is_float(info.type))
+                v = (info.fstep > 0) ? fgrid(v, info.fstep, info.foffset) : funmap(v);
+        }
+    }
+}
+
+// Add the core bands back to the derived ones, for a strip of lines
+// Then add the reference frame and restore the floating point values, if needed
+// ref is the matching strip of the reference frame, or nullptr
+// With many bands, the lines are done in chunks of pixels which stay in the L1 cache
+// The derived bands which are not stored are skipped, their core bands are always stored
+// NB is the number of bands for RGB and RGBA with the default layout and band mapping, see fixed_bands
+template<typename T, size_t NB = 0>
+static void unband(T* image, const T* ref, size_t stride, const decs& info, size_t lines = B) {
+    if (0 == NB) {
+        switch (fixed_bands(info)) {
+        case 3: return unband<T, 3>(image, ref, stride, info, lines);
+        case 4: return unband<T, 4>(image, ref, stride, info, lines);
+        }
+    }
+    const size_t xsize(info.xsize), bands(info.nbands), sh(lpshift<T>(info.type));
+    const size_t pstride(pixel_stride(info));
+    const size_t xstep(std::max(size_t(1), UNBAND_CHUNK / sizeof(T) / bands));
+    // All bands are stored and interleaved, the derived bands are done together, per pixel
+    for (size_t j = 0; NB > 1 && j < lines; j++) {
+        auto pix = image + stride * j;
+        if (!info.linear) {
+            for (size_t x = 0; x < xsize; x++, pix += NB)
+                for (size_t c = 0; c < NB; c++)
+                    if (c != dcband(NB, c))
+                        pix[c] += pix[dcband(NB, c)];
+        }
+        else {
+            for (size_t x = 0; x < xsize; x++, pix += NB)
+                for (size_t c = 0; c < NB; c++)
+                    if (c != dcband(NB, c))
+                        pix[c] += lpred(pix[dcband(NB, c)], info.lp[c], sh);
+        }
+    }
+    for (size_t j = 0; 0 == NB && j < lines; j++) {
+        for (size_t x = 0; x < xsize; x += xstep) {
+            const size_t n(std::min(xstep, xsize - x));
+            for (size_t c = 0; c < bands; c++) if (c != info.cband[c] && is_stored(info, c)) {
+                auto dimg = image + stride * j + x * pstride + band_offset(info, c);
+                auto simg = image + stride * j + x * pstride + band_offset(info, info.cband[c]);
+                if (!info.linear) {
+                    for (size_t i = 0; i < n; i++, dimg += pstride, simg += pstride)
+                        *dimg += *simg;
+                }
+                else { // Linear prediction from the core band
+                    auto const& lp = info.lp[c];
+                    for (size_t i = 0; i < n; i++, dimg += pstride, simg += pstride)
+                        *dimg += lpred(*simg, lp, sh);
+                }
+            }
+        }
+    }
+    if (ref || is_float(info.type) || info.pal)
+        for (size_t j = 0; j < lines; j++)
+            unref(image + stride * j, ref ? ref + stride * j : nullptr, info);
+}
+
+// Receives the decoded strips, when the image is a buffer for a single strip
+// The strip has the decoder layout, y is the first line and k the first block of the strip
+struct ostrip {
+    void (*flush)(const ostrip& os, void* strip, size_t y, size_t lines, size_t k);
+    const decs* info; // Output settings
+    void* dst; // Output buffer
+};
+
+// Checks the CRC32C of a block row strip, from start to the byte which holds the bit at pos,
+// or to the end of the stream for the last strip. Returns true if it doesn't match
+// start is set to the end of the strip and crc to the next checksum
+static bool bad_strip(const uint8_t* src, size_t len, size_t pos, bool last, const uint8_t*& crc, size_t& start)
+{
+    const size_t end(last ? len : std::max(start, std::min(len, pos / 8)));
+    const uint32_t v(crc32c(src + start, end - start));
+    start = end;
+    crc += 4;
+    return v != (crc[-4] | uint32_t(crc[-3]) << 8 | uint32_t(crc[-2]) << 16 | uint32_t(crc[-1]) << 24);
+}
+
 // Streamlined decoding for FTL mode
+// With os, image holds one strip and each strip is passed to os once decoded
 template<typename T>
-static bool decodeFTL(uint8_t* src, size_t len, T* image, const decs& info)
+static bool decodeFTL(uint8_t* src, size_t len, T* image, const decs& info, const ostrip* os = nullptr)
 {
     static_assert(std::is_integral<T>() && std::is_unsigned<T>(), "Only unsigned integer types allowed");
     constexpr size_t UBITS(sizeof(T) == 1 ? 3 : sizeof(T) == 2 ? 4 : sizeof(T) == 4 ? 5 : 6);
     constexpr auto NORM_MASK((1ull << UBITS) - 1); // UBITS set
     constexpr auto LONG_MASK(NORM_MASK * 2 + 1); // UBITS + 1 set
     constexpr auto dsw = sizeof(T) == 1 ? dsw3 : sizeof(T) == 2 ? dsw4 : sizeof(T) == 4 ? dsw5 : dsw6;
-    auto xsize(info.xsize), ysize(info.ysize), bands(info.nbands), stride(info.stride);
-    auto cband = info.cband;
-    T prev[QB3_MAXBANDS] = {}, group[B2] = {};
-    size_t runbits[QB3_MAXBANDS] = {};
-    stride = stride ? stride : xsize * bands;
+    const size_t xsize(info.xsize), ysize(info.ysize), bands(info.nbands);
+    const size_t stride(line_stride(info)), pstride(pixel_stride(info));
+    T group[B2] = {};
+    std::vector<T> prev(bands);
+    std::vector<size_t> runbits(bands);
+    // Reference frame, same layout as the image
+    const T* ref(static_cast<const T*>(info.temporal ? info.ref : nullptr));
     // Set up block offsets based on traversal order, defaults to HILBERT
     uint64_t order(info.order);
     order = order ? order : HILBERT;
     size_t offset[B2] = {};
     for (size_t i = 0; i < B2; i++) {
         size_t n = (order >> ((B2 - 1 - i) << 2));
-        offset[i] = ((n >> 2) & 0b11) * stride + (n & 0b11) * bands;
+        offset[i] = ((n >> 2) & 0b11) * stride + (n & 0b11) * pstride;
     }
+    // The bands which are not stored are decoded to a scratch block
+    size_t soffset[B2];
+    const std::vector<size_t> boff(band_offsets(info));
+    T sink[B2];
+    for (size_t i = 0; i < B2; i++)
+        soffset[i] = i;
+    // NoData blocks are skipped, they are filled later
+    const uint64_t* mask(info.mask);
+    size_t seq(0);
+    // Strip checksums, each strip starts where the previous one ends
+    const uint8_t* crcs(info.verify ? info.crcs : nullptr);
+    size_t cstart(0);
     iBits s(src, len);
     for (size_t y = 0; y < ysize; y += B) {
         // If the last row is partial, roll it up
         if (y + B > ysize)
             y = ysize - B;
-        for (size_t x = 0; x < xsize; x += B) {
+        T* const line = os ? image : image + y * stride;
+        const size_t k0(seq);
+        for (size_t x = 0; x < xsize; x += B, seq++) {
             // If the last column is partial, move it left
             if (x + B > xsize)
                 x = xsize - B;
+            if (mask && is_masked(mask, seq))
+                continue;
             for (int c = 0; c < bands; c++) {
                 auto prv = prev[c];
-                T* const blockp = image + y * stride + x * bands + c;
+                const bool stored(is_stored(info, c));
+                T* const blockp = stored ? line + x * pstride + boff[c] : sink;
+                const size_t* const off(stored ? offset : soffset);
                 uint64_t acc(s.peek());
                 uint32_t cs(0), abits(1);
                 if (acc & 1) { // Rung change
@@ -340,13 +515,13 @@ static bool decodeFTL(uint8_t* src, size_t len, T* image, const decs& info)
                             abits += B2;
                             for (int i = 0; i < B2; i++) {
                                 acc >>= 1;
-                                blockp[offset[i]] = prv -= (1 & acc);
+                                blockp[off[i]] = prv -= (1 & acc);
                             }
                             prev[c] = prv;
                         }
                         else {
                             for (int i = 0; i < B2; i++)
-                                blockp[offset[i]] = prv;
+                                blockp[off[i]] = prv;
                         }
                         s.advance(abits);
                         continue;
@@ -358,7 +533,7 @@ static bool decodeFTL(uint8_t* src, size_t len, T* image, const decs& info)
                         acc <<= 2;
                         for (size_t i = 0; i < B2; i++) {
                             auto size = (0x3121u >> (acc & 0b1100)) & 0xf;
-                            blockp[offset[i]] = prv += smag(T((0x30201020u >> (acc & 0b11100)) & 0xf));
+                            blockp[off[i]] = prv += smag(T((0x30201020u >> (acc & 0b11100)) & 0xf));
                             abits += size;
                             acc >>= size;
                         }
@@ -371,7 +546,7 @@ static bool decodeFTL(uint8_t* src, size_t len, T* image, const decs& info)
                     uint8_t size;
                     for (int i = 0; i < 14; i++) {
                         size = (0x4232u >> (acc & 0b1100)) & 0xf;
-                        blockp[offset[i]] = prv += (T)smag((0x7140612051403120ull >> (acc & 0b111100)) & 0xf);
+                        blockp[off[i]] = prv += (T)smag((0x7140612051403120ull >> (acc & 0b111100)) & 0xf);
                         abits += size;
                         acc >>= size;
                     }
@@ -382,9 +557,9 @@ static bool decodeFTL(uint8_t* src, size_t len, T* image, const decs& info)
                     }
                     // Unroll the last two values
                     size = (0x4232 >> (acc & 0b1100)) & 0xf;
-                    blockp[offset[14]] = prv += (T)smag((0x7140612051403120ull >> (acc & 0b111100)) & 0xf);
+                    blockp[off[14]] = prv += (T)smag((0x7140612051403120ull >> (acc & 0b111100)) & 0xf);
                     acc >>= size;
-                    blockp[offset[15]] = prv += (T)smag((0x7140612051403120ull >> (acc & 0b111100)) & 0xf);
+                    blockp[off[15]] = prv += (T)smag((0x7140612051403120ull >> (acc & 0b111100)) & 0xf);
                     s.advance(abits + size + ((0x4232u >> (acc & 0b1100)) & 0xf));
                     prev[c] = prv;
                     continue;
@@ -393,55 +568,71 @@ static bool decodeFTL(uint8_t* src, size_t len, T* image, const decs& info)
                 gdecode<false>(s, rung, group, acc, abits);
                 // Undo delta encoding for this block
                 for (int i = 0; i < B2; i++)
-                    blockp[offset[i]] = prv += smag(group[i]);
+                    blockp[off[i]] = prv += smag(group[i]);
                 prev[c] = prv;
             } // Per band per block
         } // per block
+        if (crcs && bad_strip(src, len, s.position(), y + B >= ysize, crcs, cstart))
+            return true;
         // For performance apply band delta per block strip, in linear order
-        for (size_t j = 0; j < B; j++) {
-            for (int c = 0; c < bands; c++) if (c != cband[c]) {
-                auto dimg = image + stride * (y + j) + c;
-                auto simg = image + stride * (y + j) + cband[c];
-                for (int i = 0; i < xsize; i++, dimg += bands, simg += bands)
-                    *dimg += *simg;
-            }
-        }
+        unband(line, ref ? ref + y * stride : nullptr, stride, info);
+        if (os)
+            os->flush(*os, line, y, B, k0);
     } // per strip
     // Only fails when extra input was provided
     return s.avail() > 7;
 }
 
 template<>
-bool decodeFTL<uint8_t>(uint8_t* src, size_t len, uint8_t* image, const decs& info)
+bool decodeFTL<uint8_t>(uint8_t* src, size_t len, uint8_t* image, const decs& info, const ostrip* os)
 {
     constexpr auto NORM_MASK(7); // UBITS set
     constexpr auto LONG_MASK(NORM_MASK * 2 + 1); // UBITS + 1 set
     constexpr auto dsw = dsw3;
-    auto xsize(info.xsize), ysize(info.ysize), bands(info.nbands), stride(info.stride);
-    auto cband = info.cband;
-    uint8_t prev[QB3_MAXBANDS] = {};
-    size_t runbits[QB3_MAXBANDS] = {};
-    stride = stride ? stride : xsize * bands;
+    const size_t xsize(info.xsize), ysize(info.ysize), bands(info.nbands);
+    const size_t stride(line_stride(info)), pstride(pixel_stride(info));
+    std::vector<uint8_t> prev(bands);
+    std::vector<size_t> runbits(bands);
+    // Reference frame, same layout as the image
+    const uint8_t* ref(static_cast<const uint8_t*>(info.temporal ? info.ref : nullptr));
     // Set up block offsets based on traversal order, defaults to HILBERT
     uint64_t order(info.order);
     order = order ? order : HILBERT;
     size_t offset[B2] = {};
     for (size_t i = 0; i < B2; i++) {
         size_t n = (order >> ((B2 - 1 - i) << 2));
-        offset[i] = ((n >> 2) & 0b11) * stride + (n & 0b11) * bands;
+        offset[i] = ((n >> 2) & 0b11) * stride + (n & 0b11) * pstride;
     }
+    // The bands which are not stored are decoded to a scratch block
+    size_t soffset[B2];
+    const std::vector<size_t> boff(band_offsets(info));
+    uint8_t sink[B2];
+    for (size_t i = 0; i < B2; i++)
+        soffset[i] = i;
+    // NoData blocks are skipped, they are filled later
+    const uint64_t* mask(info.mask);
+    size_t seq(0);
+    // Strip checksums, each strip starts where the previous one ends
+    const uint8_t* crcs(info.verify ? info.crcs : nullptr);
+    size_t cstart(0);
     iBits s(src, len);
     for (size_t y = 0; y < ysize; y += B) {
         // If the last row is partial, roll it up
         if (y + B > ysize)
             y = ysize - B;
-        for (size_t x = 0; x < xsize; x += B) {
+        uint8_t* const line = os ? image : image + y * stride;
+        const size_t k0(seq);
+        for (size_t x = 0; x < xsize; x += B, seq++) {
             // If the last column is partial, move it left
             if (x + B > xsize)
                 x = xsize - B;
+            if (mask && is_masked(mask, seq))
+                continue;
             for (int c = 0; c < bands; c++) {
                 auto prv = prev[c];
-                auto const blockp = image + y * stride + x * bands + c;
+                const bool stored(is_stored(info, c));
+                auto const blockp = stored ? line + x * pstride + boff[c] : sink;
+                const size_t* const off(stored ? offset : soffset);
                 uint64_t acc(s.peek());
                 uint32_t cs(0), abits(1);
                 if (acc & 1) { // Rung change
@@ -457,13 +648,13 @@ bool decodeFTL<uint8_t>(uint8_t* src, size_t len, uint8_t* image, const decs& in
                     if (0 != (acc & 1)) {
                         for (int i = 0; i < B2; i++) {
                             acc >>= 1;
-                            blockp[offset[i]] = prv -= (1 & acc);
+                            blockp[off[i]] = prv -= (1 & acc);
                         }
                         abits += B2;
                     }
                     else {
                         for (int i = 0; i < B2; i++)
-                            blockp[offset[i]] = prv;
+                            blockp[off[i]] = prv;
                     }
                 }
                 else if (rung == 1) { // rung == 1
@@ -473,7 +664,7 @@ bool decodeFTL<uint8_t>(uint8_t* src, size_t len, uint8_t* image, const decs& in
                     acc <<= 2;
                     for (int i = 0; i < B2; i++) {
                         auto size = (0x3121u >> (acc & 0b1100)) & 0xf;
-                        blockp[offset[i]] = prv += smag(uint8_t((0x30201020 >> (acc & 0b11100)) & 0xf));
+                        blockp[off[i]] = prv += smag(uint8_t((0x30201020 >> (acc & 0b11100)) & 0xf));
                         abits += size;
                         acc >>= size;
                     }
@@ -483,7 +674,7 @@ bool decodeFTL<uint8_t>(uint8_t* src, size_t len, uint8_t* image, const decs& in
                     uint8_t size;
                     for (int i = 0; i < 14; i++) {
                         size = (0x4232u >> (acc & 0b1100)) & 0xf;
-                        blockp[offset[i]] = prv += (uint8_t)smag((0x7140612051403120ull >> (acc & 0b111100)) & 0xf);
+                        blockp[off[i]] = prv += (uint8_t)smag((0x7140612051403120ull >> (acc & 0b111100)) & 0xf);
                         abits += size;
                         acc >>= size;
                     }
@@ -494,9 +685,9 @@ bool decodeFTL<uint8_t>(uint8_t* src, size_t len, uint8_t* image, const decs& in
                     }
                     // Unroll the last two values
                     size = (0x4232 >> (acc & 0b1100)) & 0xf;
-                    blockp[offset[14]] = prv += (uint8_t)smag((0x7140612051403120ull >> (acc & 0b111100)) & 0xf);
+                    blockp[off[14]] = prv += (uint8_t)smag((0x7140612051403120ull >> (acc & 0b111100)) & 0xf);
                     acc >>= size;
-                    blockp[offset[15]] = prv += (uint8_t)smag((0x7140612051403120ull >> (acc & 0b111100)) & 0xf);
+                    blockp[off[15]] = prv += (uint8_t)smag((0x7140612051403120ull >> (acc & 0b111100)) & 0xf);
                     s.advance(abits + size + ((0x4232u >> (acc & 0b1100)) & 0xf));
                     prev[c] = prv;
                     continue;
@@ -507,7 +698,7 @@ bool decodeFTL<uint8_t>(uint8_t* src, size_t len, uint8_t* image, const decs& in
                     if (6 > rung) { // Table decode at 3,4 and 5, two reads
                         for (int i = 0; i < B2 / 2; ++i) {
                             auto v = drg[acc & m];
-                            blockp[offset[i]] = prv += smag(uint8_t(v));
+                            blockp[off[i]] = prv += smag(uint8_t(v));
                             abits += v >> 12;
                             acc >>= v >> 12;
                         }
@@ -516,7 +707,7 @@ bool decodeFTL<uint8_t>(uint8_t* src, size_t len, uint8_t* image, const decs& in
                         abits = 0;
                         for (int i = B2 / 2; i < B2; ++i) {
                             auto v = drg[acc & m];
-                            blockp[offset[i]] = prv += smag(uint8_t(v));
+                            blockp[off[i]] = prv += smag(uint8_t(v));
                             abits += v >> 12;
                             acc >>= v >> 12;
                         }
@@ -529,7 +720,7 @@ bool decodeFTL<uint8_t>(uint8_t* src, size_t len, uint8_t* image, const decs& in
                     int i = 0;
                     do {
                         auto v = drg[acc & m];
-                        blockp[offset[i]] = prv += smag(uint8_t(v));
+                        blockp[off[i]] = prv += smag(uint8_t(v));
                         abits += v >> 12;
                         acc >>= v >> 12;
                     } while (++i < 6);
@@ -538,7 +729,7 @@ bool decodeFTL<uint8_t>(uint8_t* src, size_t len, uint8_t* image, const decs& in
                     abits = 0;
                     do {
                         auto v = drg[acc & m];
-                        blockp[offset[i]] = prv += smag(uint8_t(v));
+                        blockp[off[i]] = prv += smag(uint8_t(v));
                         abits += v >> 12;
                         acc >>= v >> 12;
                     } while (++i < 10);
@@ -547,7 +738,7 @@ bool decodeFTL<uint8_t>(uint8_t* src, size_t len, uint8_t* image, const decs& in
                     abits = 0;
                     do {
                         auto v = drg[acc & m];
-                        blockp[offset[i]] = prv += smag(uint8_t(v));
+                        blockp[off[i]] = prv += smag(uint8_t(v));
                         abits += v >> 12;
                         acc >>= v >> 12;
                     } while (++i < B2);
@@ -556,59 +747,255 @@ bool decodeFTL<uint8_t>(uint8_t* src, size_t len, uint8_t* image, const decs& in
                 s.advance(abits);
             } // Per band per block
         } // per block
+        if (crcs && bad_strip(src, len, s.position(), y + B >= ysize, crcs, cstart))
+            return true;
         // For performance apply band delta per block strip, in linear order
-        for (size_t j = 0; j < B; j++) {
-            for (int c = 0; c < bands; c++) if (c != cband[c]) {
-                auto dimg = image + stride * (y + j) + c;
-                auto simg = image + stride * (y + j) + cband[c];
-                for (int i = 0; i < xsize; i++, dimg += bands, simg += bands)
-                    *dimg += *simg;
-            }
-        }
+        unband(line, ref ? ref + y * stride : nullptr, stride, info);
+        if (os)
+            os->flush(*os, line, y, B, k0);
     } // per strip
     return s.avail() > 7; // Only fails when input was too short
 }
 
-// Absolute from mag-sign
-template<typename T> static T magsabs(T v) { return (v >> 1) + (v & 1); }
 // Multiply v(in magsign) by m(normal, positive)
 template<typename T> static T magsmul(T v, T m) { return magsabs(v) * (m << 1) - (v & 1); }
 
-// reports most but not all errors, for example if the input stream is too short for the last block
+// Decodes a group with extended encoding, CF, index or block copy, which starts with the signal
+// acc and abits are the input accumulator and the bits used from it, past the signal
+// For a block copy, dist is set to the distance in blocks, above is the distance to the block above
+// Returns true if the input is detected as corrupt
+template<typename T>
+static bool gxdecode(iBits& s, size_t& runbits, T& pcf, T* group, uint64_t acc, uint32_t abits,
+    size_t above, size_t& dist)
+{
+    constexpr size_t UBITS(sizeof(T) == 1 ? 3 : sizeof(T) == 2 ? 4 : sizeof(T) == 4 ? 5 : 6);
+    constexpr auto NORM_MASK((1ull << UBITS) - 1); // UBITS set
+    constexpr auto LONG_MASK(NORM_MASK * 2 + 1); // UBITS + 1 set
+    constexpr auto dsw = sizeof(T) == 1 ? dsw3 : sizeof(T) == 2 ? dsw4 : sizeof(T) == 4 ? dsw5 : dsw6;
+    bool failed(false);
+    uint32_t cs = dsw[acc & LONG_MASK]; // rung, no flag
+    auto rung = (runbits + cs) & NORM_MASK;
+    acc >>= (cs >> 12) - 1; // No flag
+    abits += (cs >> 12) - 1;
+    if (rung != NORM_MASK) { // CF decoding
+        auto cfrung(rung);
+        T cf = pcf;
+        auto read_cfr = acc & 1;
+        abits++;
+        acc >>= 1;
+        if (read_cfr) { // different cf, need to read it
+            read_cfr = acc & 1;
+            abits++;
+            acc >>= 1;
+            if (read_cfr) { // has own rung
+                cs = dsw[acc & LONG_MASK];
+                cfrung = (rung + cs) & NORM_MASK;
+                if (cfrung == rung || 0 == cfrung) // Never encoded, corrupt input
+                    return true;
+                acc >>= (cs >> 12) - 1;
+                abits += (cs >> 12) - 1;
+            }
+            if (sizeof(T) == 8 && (cfrung + abits) > 62) { // Rare
+                s.advance(abits);
+                acc = s.peek();
+                abits = 0;
+            }
+            auto p = qb3dsztbl(acc, cfrung - read_cfr);
+            pcf = cf = static_cast<T>(p.second + (read_cfr << cfrung));
+            abits += p.first;
+            acc >>= p.first;
+        }
+        cf += 2; // Use it unbiased
+        if (rung) {
+            s.advance(abits);
+            gdecode(s, rung, group, s.peek(), 0);
+            // Multiply group by CF and get the max for the actual rung
+            T usedbits = 0;
+            for (int i = 0; i < B2; i++)
+                usedbits |= group[i] = magsmul(group[i], cf);
+            runbits = topbit(usedbits | 1);
+            failed |= cf > usedbits;
+        }
+        else { // Single bit for data, decode here
+            if (abits + B2 > 64) {
+                s.advance(abits);
+                acc = s.peek();
+                abits = 0;
+            }
+            s.advance(B2 + abits);
+            T v = T(((cf - 1) << 1) | 1); // mags(-cf)
+            for (int i = 0; i < B2; i++)
+                group[i] = ((acc >> i) & 1) ? v : 0;
+            runbits = topbit(v);
+        }
+    }
+    else { // index decoding
+        cs = dsw[acc & LONG_MASK]; // rung, no flag
+        rung = (runbits + cs) & NORM_MASK;
+        if (0 == rung) { // Block copy, the rung doesn't change
+            s.advance(abits + (cs >> 12) - 1);
+            acc = s.peek();
+            if (0 == (acc & 1)) {
+                dist = above;
+                s.advance(1);
+                return failed;
+            }
+            auto nb = (acc >> 1) & 0x1f;
+            failed |= nb > 30;
+            dist = (1ull << nb) | ((acc >> 6) & ((1ull << nb) - 1));
+            s.advance(6 + nb);
+            return failed;
+        }
+        runbits = rung;
+        failed |= rung == 63; // TODO: Deal with 64bit overflow
+        // Max valid group size is 52 bits, when every index between 0 and 7 occurs twice
+        // We might overflow the accumulator, even for byte data
+        // abits at this point is between 9-13, 12-16, 15-19 and 18-22 depending on data type
+        // Anything above 12 could generate an overflow, so it's safer to read a new accumulator
+        // A maximum of 52 bits are needed, so we can read 62 bits preshifted to the right by 2
+        s.advance(abits + (cs >> 12) - 3); // Preshift the next accumulator
+        acc = s.peek();
+        abits = 2;
+        // 16 index values in group, max group value is 7, always rung 2
+        T maxidx(0);
+        for (int i = 0; i < B2; i++) {
+            uint32_t size = (0x4232 >> (acc & 0b1100)) & 0xf;
+            // Straight drg2 decoding, no middle swap
+            group[i] = T((0x7130612051304120ll >> (acc & 0b111100)) & 0xf);
+            acc >>= size;
+            abits += size;
+            if (maxidx < group[i])
+                maxidx = group[i];
+        }
+        failed |= abits > 54; // Corrupt input, max should be 52+2
+        s.advance(abits);
+        T idxarray[B2 / 2] = {};
+        for (size_t i = 0; i <= maxidx; i++) {
+            acc = s.peek();
+            auto v = qb3dsztbl(acc, rung);
+            s.advance(v.first);
+            idxarray[i] = T(v.second);
+        }
+        // Apply idxarray to group
+        for (int i = 0; i < B2; i++)
+            group[i] = idxarray[group[i]];
+    }
+    return failed;
+}
+
+// Reconstructs a block from the 2D MED residuals of all bands
+// Core bands are done first, the derived bands need their values
 template<typename T>
-static bool decode(uint8_t *src, size_t len, T* image, const decs &info)
+static void unmed(T* image, size_t x, size_t y, size_t stride, const size_t scan[B2],
+    const T* groups, const decs& info)
+{
+    const size_t bands(info.nbands), pstride(pixel_stride(info));
+    T w[B + 1][B + 1] = {}, rsd[B2] = {}; // Prediction window and residuals in raster order
+    for (int core = 1; core >= 0; core--) {
+        for (size_t c = 0; c < bands; c++) {
+            if ((c == info.cband[c]) != (core == 1) || !is_stored(info, c))
+                continue;
+            const medmap<T> m(info, c, is_float(info.type) && !(info.fstep > 0) && !info.temporal && !info.pal);
+            for (size_t i = 0; i < B2; i++)
+                rsd[scan[i]] = smag(groups[c * B2 + i]);
+            // Load the neighbours
+            if (y)
+                for (size_t i = (x ? 0 : 1); i <= B; i++)
+                    w[0][i] = m.to(image + (y - 1) * stride + (x + i - 1) * pstride);
+            else
+                w[0][1] = 0; // Top-left corner, predict from zero
+            if (x)
+                for (size_t j = 1; j <= B; j++)
+                    w[j][0] = m.to(image + (y + j - 1) * stride + (x - 1) * pstride);
+            for (size_t j = 1; j <= B; j++) {
+                auto r = rsd + (j - 1) * B;
+                if (0 == x) // No left neighbour, use the top one
+                    w[j][0] = w[j - 1][1];
+                if (1 == j && 0 == y) // No top neighbour, use the left one
+                    for (size_t i = 1; i <= B; i++)
+                        w[j][i] = r[i - 1] + w[j][i - 1];
+                else
+                    for (size_t i = 1; i <= B; i++)
+                        w[j][i] = r[i - 1] + med(w[j][i - 1], w[j - 1][i], w[j - 1][i - 1]);
+                T* pix = image + (y + j - 1) * stride + x * pstride;
+                for (size_t i = 1; i <= B; i++, pix += pstride)
+                    pix[m.oc] = m.from(w[j][i], pix);
+            }
+        }
+    }
+}
+
+// reports most but not all errors, for example if the input stream is too short for the last block
+// BS is the block size, the 8x8 blocks are decoded as four B2 groups at the same rung, without the step
+// With os, image holds one strip and each strip is passed to os once decoded, not for the 2D prediction
+template<typename T, size_t BS = B>
+static bool decode(uint8_t *src, size_t len, T* image, const decs &info, const ostrip* os = nullptr)
 {
+    constexpr size_t BB(BS * BS); // Values per block
     if (info.mode == QB3M_FTL)
-        return decodeFTL(src, len, image, info);
-    auto xsize(info.xsize), ysize(info.ysize), bands(info.nbands), stride(info.stride);
-    auto cband = info.cband;
+        return decodeFTL(src, len, image, info, os);
+    const size_t xsize(info.xsize), ysize(info.ysize), bands(info.nbands);
+    const size_t stride(line_stride(info)), pstride(pixel_stride(info));
     static_assert(std::is_integral<T>() && std::is_unsigned<T>(), "Only unsigned integer types allowed");
     constexpr size_t UBITS(sizeof(T) == 1 ? 3 : sizeof(T) == 2 ? 4 : sizeof(T) == 4 ? 5 : 6);
     constexpr auto NORM_MASK((1ull << UBITS) - 1); // UBITS set
     constexpr auto LONG_MASK(NORM_MASK * 2 + 1); // UBITS + 1 set
-    T prev[QB3_MAXBANDS] = {}, pcf[QB3_MAXBANDS] = {}, group[B2] = {};
-    size_t runbits[QB3_MAXBANDS] = {};
+    std::vector<T> prev(bands), pcf(bands);
+    // The 2D prediction needs the residuals of all bands
+    const bool med2d(is_med(info.mode));
+    // One group per band, only for the 2D prediction
+    std::vector<T> groups(med2d ? bands * B2 : 0);
+    T block[BB] = {};
+    std::vector<size_t> runbits(bands);
     constexpr auto dsw = sizeof(T) == 1 ? dsw3 : sizeof(T) == 2 ? dsw4 : sizeof(T) == 4 ? dsw5 : dsw6;
-    stride = stride ? stride : xsize * bands;
+    // Reference frame, same layout as the image
+    const T* ref(static_cast<const T*>(info.temporal ? info.ref : nullptr));
     // Set up block offsets based on traversal order, defaults to HILBERT
     uint64_t order(info.order);
     order = order ? order : HILBERT;
-    size_t offset[B2] = {};
-    for (size_t i = 0; i < B2; i++) {
-        size_t n = (order >> ((B2 - 1 - i) << 2));
-        offset[i] = ((n >> 2) & 0b11) * stride + (n & 0b11) * bands;
-    }
+    size_t offset[BB] = {}, scan[B2] = {};
+    block_offsets<BS>(offset, order, stride, pstride);
+    // The bands which are not stored are decoded to a scratch block
+    size_t soffset[BB];
+    const std::vector<size_t> boff(band_offsets(info));
+    T sink[BB];
+    for (size_t i = 0; i < BB; i++)
+        soffset[i] = i;
+    for (size_t i = 0; i < B2; i++)
+        scan[i] = (order >> ((B2 - 1 - i) << 2)) & 0xf;
+    // Adaptive rung switch state, by band
+    const bool adaptive(info.adaptive);
+    std::vector<rswitch> rs(adaptive ? bands : 0);
+    for (auto& a : rs)
+        rs_init(a, UBITS);
+    // Block copy sources, from the current strip or from the previous one, saved before unband
+    // The previous strip is kept compact and band interleaved
+    const size_t bx((xsize + B - 1) / B);
+    std::vector<T> pstrip(info.blockcopy ? B * xsize * bands : 0);
+    size_t poffset[B2] = {};
+    block_offsets<B>(poffset, order, xsize * bands, bands);
+    size_t seq(0);
+    // NoData blocks are skipped, they are filled later
+    const uint64_t* mask(info.mask);
+    // Strip checksums, each strip starts where the previous one ends
+    const uint8_t* crcs(info.verify ? info.crcs : nullptr);
+    size_t cstart(0);
     iBits s(src, len);
     bool failed(false);
-    for (size_t y = 0; y < ysize; y += B) {
+    for (size_t y = 0; y < ysize; y += BS) {
         // If the last row is partial, roll it up
-        if (y + B > ysize)
-            y = ysize - B;
-        for (size_t x = 0; x < xsize; x += B) {
+        if (y + BS > ysize)
+            y = ysize - BS;
+        T* const line = os ? image : image + y * stride;
+        const size_t k0(seq);
+        for (size_t x = 0; x < xsize; x += BS, seq++) {
             // If the last column is partial, move it left
-            if (x + B > xsize)
-                x = xsize - B;
+            if (x + BS > xsize)
+                x = xsize - BS;
+            if (mask && is_masked(mask, seq))
+                continue;
             for (int c = 0; c < bands; c++) {
+                T* const group = med2d ? groups.data() + c * B2 : block;
                 uint64_t acc(s.peek());
                 uint32_t cs(0), abits(1);
                 if (acc & 1) { // Rung change
@@ -616,127 +1003,237 @@ static bool decode(uint8_t *src, size_t len, T* image, const decs &info)
                     abits = cs >> 12;
                 }
                 acc >>= abits;
+                auto oldrung(runbits[c]);
                 if (0 != (cs & TBLMASK) || 0 == cs) { // Normal decoding, not a signal
+                    if (adaptive)
+                        cs = static_cast<uint32_t>(rs_decode(rs[c], cs & NORM_MASK, UBITS));
                     // abits is never > 8, so it's safe to call gdecode
                     auto rung = runbits[c] = (runbits[c] + cs) & NORM_MASK;
-                    gdecode(s, rung, group, acc, abits);
+                    gdecode<BS == B>(s, rung, group, acc, abits);
+                    for (size_t i = B2; i < BB; i += B2)
+                        gdecode<false>(s, rung, group + i, s.peek(), 0);
                 }
                 else { // extra encoding
-                    cs = dsw[acc & LONG_MASK]; // rung, no flag
-                    auto rung = (runbits[c] + cs) & NORM_MASK;
-                    acc >>= (cs >> 12) - 1; // No flag
-                    abits += (cs >> 12) - 1;
-                    if (rung != NORM_MASK) { // CF decoding
-                        auto cfrung(rung);
-                        T cf = pcf[c];
-                        auto read_cfr = acc & 1;
-                        abits++;
-                        acc >>= 1;
-                        if (read_cfr) { // different cf, need to read it
-                            read_cfr = acc & 1;
-                            abits++;
-                            acc >>= 1;
-                            if (read_cfr) { // has own rung
-                                cs = dsw[acc & LONG_MASK];
-                                cfrung = (rung + cs) & NORM_MASK;
-                                failed |= (cfrung == rung);
-                                acc >>= (cs >> 12) - 1;
-                                abits += (cs >> 12) - 1;
-                            }
-                            if (sizeof(T) == 8 && (cfrung + abits) > 62) { // Rare
-                                s.advance(abits);
-                                acc = s.peek();
-                                abits = 0;
-                            }
-                            auto p = qb3dsztbl(acc, cfrung - read_cfr);
-                            pcf[c] = cf = static_cast<T>(p.second + (read_cfr << cfrung));
-                            abits += p.first;
-                            acc >>= p.first;
+                    if (BS != B) { // Never used with the larger blocks
+                        failed = true;
+                        break;
+                    }
+                    size_t dist(0);
+                    failed |= gxdecode(s, runbits[c], pcf[c], group, acc, abits, bx, dist);
+                    if (dist) { // Block copy, from a decoded block in this or the previous strip
+                        auto k = seq - dist;
+                        if (med2d || !info.blockcopy || dist > seq || k / bx + 1 < seq / bx
+                            || (mask && is_masked(mask, k))) {
+                            failed = true;
+                            break;
                         }
-                        cf += 2; // Use it unbiased
-                        if (rung) {
-                            s.advance(abits);
-                            gdecode(s, rung, group, s.peek(), 0);
-                            // Multiply group by CF and get the max for the actual rung
-                            T usedbits = 0;
+                        // All bands are stored when block copy is used
+                        T* const blockp = line + x * pstride + boff[c];
+                        if (k / bx == seq / bx) { // Same strip, only the x position is needed
+                            const T* src = line + block_loc(k % bx, bx, xsize, B, 0, pstride) + boff[c];
                             for (int i = 0; i < B2; i++)
-                                usedbits |= group[i] = magsmul(group[i], cf);
-                            runbits[c] = topbit(usedbits | 1);
-                            failed |= cf > usedbits;
+                                blockp[offset[i]] = src[offset[i]];
                         }
-                        else { // Single bit for data, decode here
-                            if (abits + B2 > 64) {
-                                s.advance(abits);
-                                acc = s.peek();
-                                abits = 0;
-                            }
-                            s.advance(B2 + abits);
-                            T v = T(((cf - 1) << 1) | 1); // mags(-cf)
+                        else { // Previous strip, only the x position is needed
+                            const T* src = pstrip.data() + block_loc(k % bx, bx, xsize, B, 0, bands) + c;
                             for (int i = 0; i < B2; i++)
-                                group[i] = ((acc >> i) & 1) ? v : 0;
-                            runbits[c] = topbit(v);
+                                blockp[offset[i]] = src[poffset[i]];
                         }
-                    }
-                    else { // index decoding
-                        cs = dsw[acc & LONG_MASK]; // rung, no flag
-                        runbits[c] = rung = (runbits[c] + cs) & NORM_MASK;
-                        failed |= rung == 63; // TODO: Deal with 64bit overflow
-                        // Max valid group size is 52 bits, when every index between 0 and 7 occurs twice
-                        // We might overflow the accumulator, even for byte data
-                        // abits at this point is between 9-13, 12-16, 15-19 and 18-22 depending on data type
-                        // Anything above 12 could generate an overflow, so it's safer to read a new accumulator
-                        // A maximum of 52 bits are needed, so we can read 62 bits preshifted to the right by 2
-                        s.advance(abits + (cs >> 12) - 3); // Preshift the next accumulator
-                        acc = s.peek();
-                        abits = 2;
-                        // 16 index values in group, max group value is 7, always rung 2
-                        T maxidx(0);
-                        for (int i = 0; i < B2; i++) {
-                            uint32_t size = (0x4232 >> (acc & 0b1100)) & 0xf;
-                            // Straight drg2 decoding, no middle swap
-                            group[i] = T((0x7130612051304120ll >> (acc & 0b111100)) & 0xf);
-                            acc >>= size;
-                            abits += size;
-                            if (maxidx < group[i])
-                                maxidx = group[i];
-                        }
-                        failed |= abits > 54; // Corrupt input, max should be 52+2
-                        s.advance(abits);
-                        T idxarray[B2 / 2] = {};
-                        for (size_t i = 0; i <= maxidx; i++) {
-                            acc = s.peek();
-                            auto v = qb3dsztbl(acc, rung);
-                            s.advance(v.first);
-                            idxarray[i] = T(v.second);
-                        }
-                        // Apply idxarray to group
-                        for (int i = 0; i < B2; i++)
-                            group[i] = idxarray[group[i]];
+                        prev[c] = blockp[offset[B2 - 1]];
+                        if (adaptive)
+                            rs_update(rs[c], 0, UBITS);
+                        continue;
                     }
                 }
+                if (adaptive)
+                    rs_update(rs[c], (runbits[c] - oldrung) & NORM_MASK, UBITS);
+                if (med2d)
+                    continue;
                 // Undo delta encoding for this block
                 auto prv = prev[c];
-                T* const blockp = image + y * stride + x * bands + c;
-                for (int i = 0; i < B2; i++)
-                    blockp[offset[i]] = prv += smag(group[i]);
+                const bool stored(is_stored(info, c));
+                T* const blockp = stored ? line + x * pstride + boff[c] : sink;
+                const size_t* const off(stored ? offset : soffset);
+                for (int i = 0; i < BB; i++)
+                    blockp[off[i]] = prv += smag(group[i]);
                 prev[c] = prv;
             } // Per band per block
             if (failed)
                 break;
+            if (med2d)
+                unmed(image, x, y, stride, scan, groups.data(), info);
         } // per block
+        if (crcs && bad_strip(src, len, s.position(), y + BS >= ysize, crcs, cstart))
+            failed = true;
         if (failed)
             break;
+        if (info.blockcopy)
+            to_compact(pstrip.data(), line, info, B);
         // For performance apply band delta per block strip, in linear order
-        for (size_t j = 0; j < B; j++) {
-            for (int c = 0; c < bands; c++) if (c != cband[c]) {
-                auto dimg = image + stride * (y + j) + c;
-                auto simg = image + stride * (y + j) + cband[c];
-                for (int i = 0; i < xsize; i++, dimg += bands, simg += bands)
-                    *dimg += *simg;
-            }
-        }
+        if (!med2d)
+            unband(line, ref ? ref + y * stride : nullptr, stride, info, BS);
+        if (os)
+            os->flush(*os, line, y, BS, k0);
     } // per block strip
+    // The 2D prediction reads the previous lines in the encoded domain, so the
+    // reference frame, the floating point grid and the palette are applied at the end
+    if (med2d && !failed && (ref || (is_float(info.type) && info.fstep > 0) || info.pal))
+        for (size_t y = 0; y < ysize; y++)
+            unref(image + y * stride, ref ? ref + y * stride : nullptr, info);
     // It might not catch all errors
     return failed || s.avail() > 7; 
 }
+
+// Extra bits used by two consecutive codes above rung 1, indexed by the low two bits
+// of the first code and the four bits starting at the rung
+static const uint8_t skip2[] = { 0, 1, 0, 2, 1, 1, 1, 2, 0, 2, 0, 2, 2, 2, 2, 2, 0, 1, 0, 3, 1, 1, 1, 3,
+0, 3, 0, 3, 2, 3, 2, 3, 0, 1, 0, 2, 1, 1, 1, 2, 0, 2, 0, 2, 2, 2, 2, 2, 0, 1, 0, 4, 1, 1, 1, 4, 0, 3, 0, 4,
+2, 3, 2, 4 };
+
+// Skips a B2 sized group of QB3 values, same as gdecode without the values
+// The codes are rung bits long, one more if the low bit is set, two more if the next bit is also set
+static void gskip(iBits& s, size_t rung, uint64_t acc, size_t abits)
+{
+    if (0 == rung) { // Single bits or all zeros
+        s.advance(abits + 1 + (acc & 1) * B2);
+        return;
+    }
+    if (1 < rung && rung < 30) { // Two codes at a time
+        for (int i = 0; i < B2; i += 2) {
+            if (abits + 2 * rung + 4 > 63) {
+                s.advance(abits);
+                acc = s.peek();
+                abits = 0;
+            }
+            auto size = 2 * rung + skip2[(acc & 3) | ((acc >> rung & 0xf) << 2)];
+            abits += size;
+            acc >>= size;
+        }
+        s.advance(abits);
+        return;
+    }
+    if (rung < 62) {
+        for (int i = 0; i < B2; i++) {
+            if (abits + rung + 2 > 63) {
+                s.advance(abits);
+                acc = s.peek();
+                abits = 0;
+            }
+            auto size = rung + (acc & 1) + (acc & (acc >> 1) & 1);
+            abits += size;
+            acc >>= size;
+        }
+        s.advance(abits);
+        return;
+    }
+    // Up to 65 bits per code
+    s.advance(abits);
+    for (int i = 0; i < B2; i++) {
+        acc = s.peek();
+        s.advance(rung + (acc & 1) + (acc & (acc >> 1) & 1));
+    }
+}
+
+// Parses the groups the same way decode does, without storing the values or undoing the prediction
+// Returns true if the stream is not consistent, pos is set to the byte offset of the block which failed,
+// or to the expected end of the stream. With the strip checksums, it is set to the start of the strip which failed
+template<typename T, size_t BS = B>
+static bool walk(uint8_t* src, size_t len, const decs& info, size_t& pos)
+{
+    constexpr size_t BB(BS * BS); // Values per block
+    constexpr size_t UBITS(sizeof(T) == 1 ? 3 : sizeof(T) == 2 ? 4 : sizeof(T) == 4 ? 5 : 6);
+    constexpr auto NORM_MASK((1ull << UBITS) - 1); // UBITS set
+    constexpr auto LONG_MASK(NORM_MASK * 2 + 1); // UBITS + 1 set
+    constexpr auto dsw = sizeof(T) == 1 ? dsw3 : sizeof(T) == 2 ? dsw4 : sizeof(T) == 4 ? dsw5 : dsw6;
+    const size_t xsize(info.xsize), ysize(info.ysize), bands(info.nbands);
+    const bool ftl(info.mode == QB3M_FTL), med2d(is_med(info.mode)), adaptive(info.adaptive);
+    T group[B2] = {};
+    std::vector<T> pcf(bands);
+    std::vector<size_t> runbits(bands);
+    std::vector<rswitch> rs(adaptive ? bands : 0);
+    for (auto& a : rs)
+        rs_init(a, UBITS);
+    const size_t bx((xsize + BS - 1) / BS), by((ysize + BS - 1) / BS);
+    const uint64_t* mask(info.mask);
+    // The end of the input is parsed from a zero padded copy, reading past the end shows a truncation
+    constexpr size_t TAIL(1024);
+    std::vector<uint8_t> tail;
+    std::unique_ptr<iBits> tbits;
+    iBits bits(src, len);
+    iBits* s(&bits);
+    size_t base(0); // Bit offset of the copy
+    // Strip checksums, always checked when present
+    const uint8_t* crcs(info.crcs);
+    size_t cstart(0);
+    for (size_t seq = 0; seq < bx * by; seq++) {
+        // End of a strip, the last one is checked after the end of the stream
+        if (crcs && seq && 0 == seq % bx) {
+            pos = cstart;
+            if (bad_strip(src, len, base + s->position(), false, crcs, cstart))
+                return true;
+        }
+        if (mask && is_masked(mask, seq))
+            continue;
+        if (!tbits && s->avail() < TAIL * 8) {
+            base = s->position() / 8 * 8;
+            tail.assign(src + base / 8, src + len);
+            tail.resize(tail.size() + TAIL);
+            tbits.reset(new iBits(tail.data(), tail.size()));
+            tbits->advance(s->position() - base);
+            s = tbits.get();
+        }
+        pos = (base + s->position()) / 8;
+        if (pos >= len) { // Truncated, every group uses at least one bit
+            pos = crcs ? cstart : len;
+            return true;
+        }
+        if (crcs) // The previous strips are good, the errors are in this one
+            pos = cstart;
+        for (size_t c = 0; c < bands; c++) {
+            uint64_t acc(s->peek());
+            uint32_t cs(0), abits(1);
+            if (acc & 1) { // Rung change
+                cs = dsw[(acc >> 1) & LONG_MASK];
+                abits = cs >> 12;
+            }
+            acc >>= abits;
+            auto oldrung(runbits[c]);
+            if (ftl || 0 != (cs & TBLMASK) || 0 == cs) { // Normal decoding, not a signal
+                if (adaptive)
+                    cs = static_cast<uint32_t>(rs_decode(rs[c], cs & NORM_MASK, UBITS));
+                auto rung = runbits[c] = (runbits[c] + cs) & NORM_MASK;
+                gskip(*s, rung, acc, abits);
+                for (size_t i = B2; i < BB; i += B2)
+                    gskip(*s, rung, s->peek(), 0);
+            }
+            else { // extra encoding
+                size_t dist(0);
+                if (BS != B || gxdecode(*s, runbits[c], pcf[c], group, acc, abits, bx, dist))
+                    return true;
+                if (dist) { // Block copy, the source has to be a decoded block in this or the previous strip
+                    auto k = seq - dist;
+                    if (med2d || !info.blockcopy || dist > seq || k / bx + 1 < seq / bx
+                        || (mask && is_masked(mask, k)))
+                        return true;
+                    if (adaptive)
+                        rs_update(rs[c], 0, UBITS);
+                    continue;
+                }
+            }
+            if (adaptive)
+                rs_update(rs[c], (runbits[c] - oldrung) & NORM_MASK, UBITS);
+        }
+    }
+    const size_t end(base + s->position());
+    if (end > len * 8) { // The last block is truncated
+        pos = crcs ? cstart : len;
+        return true;
+    }
+    pos = cstart;
+    if (crcs && bad_strip(src, len, end, true, crcs, cstart))
+        return true;
+    pos = (end + 7) / 8;
+    return len * 8 - end > 7;
+}
 } // namespace
+#endif
@@ -19,20 +19,28 @@ Contributors:  Lucian Plesea
 #include "QB3encode.h"
 #include <limits>
 #include <vector>
+// For lower_bound
+#include <algorithm>
 // For memcpy
 #include <cstring>
+// For lround, llround
+#include <cmath>
 
 // constructor
 encsp qb3_create_encoder(size_t w, size_t h, size_t b, qb3_dtype dt)
 {
-    if (w == 0 || w > 0x10000ull || h == 0 || h > 0x10000ull
-        || b == 0 || b > QB3_MAXBANDS || dt > int(QB3_I64))
+    if (w == 0 || w > QB3_MAXSIZE || h == 0 || h > QB3_MAXSIZE
+        || b == 0 || b > QB3_MAXBANDS || dt > int(QB3_F64) || !size_fits(w, h, b, dt))
             return nullptr;
     auto p = new encs;
     memset(p, 0, sizeof(encs));
     p->xsize = w;
     p->ysize = h;
     p->nbands = b;
+    p->palsize = new size_t[b]();
+    p->band = new band_state[b]();
+    p->cband = new size_t[b]();
+    p->lp = new band_lp[b]();
     p->type = static_cast<qb3_dtype>(dt);
     p->quanta = 1; // No quantization
     p->away = false; // Round to zero
@@ -47,16 +55,27 @@ encsp qb3_create_encoder(size_t w, size_t h, size_t b, qb3_dtype dt)
     return p;
 }
 
-void qb3_reset_encoder(encsp p) {
+// Each image starts with a clean state, the decoder does the same
+static void reset_state(encsp p) {
     for (size_t c = 0; c < p->nbands; c++) {
         p->band[c].runbits = 0;
         p->band[c].prev = 0;
         p->band[c].cf = 0;
     }
+}
+
+void qb3_reset_encoder(encsp p) {
+    reset_state(p);
+    p->frame = 0;
     p->error = 0;
 }
 
 void qb3_destroy_encoder(encsp p) {
+    delete[] p->palsize;
+    delete[] p->band;
+    delete[] p->cband;
+    delete[] p->lp;
+    delete[] p->bsel;
     delete p;
 }
 
@@ -76,16 +95,50 @@ bool qb3_set_encoder_coreband(encsp p, size_t b, size_t *bands) {
     return true;
 }
 
+bool qb3_set_encoder_bandpredictor(encsp p, bool linear) {
+    p->linear = linear && p->nbands > 1 && !is_float(p->type);
+    return p->linear == linear;
+}
+
 void qb3_set_encoder_stride(encsp p, size_t stride) {
     p->stride = stride;
 }
 
+// The value at pixel x of line y and band c is at y * line + x * pixel + c * band
+// Band interleaved is pixel = nbands, band = 1, band sequential is pixel = 1, band = lines * line
+bool qb3_set_encoder_layout(encsp p, size_t pixel, size_t line, size_t band) {
+    if (!pixel || !line || (!band && p->nbands > 1))
+        return false;
+    p->pstride = pixel;
+    p->stride = line;
+    p->bstride = band;
+    return true;
+}
+
+// Band c of the image is channel bands[c] of the input, which has nchannels per pixel
+bool qb3_set_encoder_bands(encsp p, size_t nchannels, const size_t* bands) {
+    if (!bands) { // All channels, in order
+        delete[] p->bsel;
+        p->bsel = nullptr;
+        p->nchannels = 0;
+        return true;
+    }
+    for (size_t c = 0; c < p->nbands; c++)
+        if (bands[c] >= nchannels)
+            return false;
+    if (!p->bsel)
+        p->bsel = new size_t[p->nbands];
+    std::copy(bands, bands + p->nbands, p->bsel);
+    p->nchannels = nchannels;
+    return true;
+}
+
 // Sets quantization parameters
 // Valid values are 2 and above
 // sign = true when the input data is signed
 // away = true to round away from zero
 bool qb3_set_encoder_quanta(encsp p, uint64_t q, bool away) {
-    if (q < 1)
+    if (q < 1 || (q > 1 && is_float(p->type)))
         return false;
     p->quanta = q;
     p->away = away;
@@ -109,12 +162,120 @@ bool qb3_set_encoder_quanta(encsp p, uint64_t q, bool away) {
     return !error;
 }
 
+bool qb3_set_encoder_maxerror(encsp p, double maxerr) {
+    if (!is_float(p->type) || !(maxerr >= 0) || !std::isfinite(2 * maxerr))
+        return false;
+    p->maxerr = maxerr;
+    return true;
+}
+
+void qb3_set_encoder_palette(encsp p, bool palette) {
+    p->palette = palette;
+}
+
+void qb3_set_encoder_blockcopy(encsp p, bool blockcopy) {
+    p->blockcopy = blockcopy;
+}
+
+void qb3_set_encoder_adaptive(encsp p, bool adaptive) {
+    p->adaptive = adaptive;
+}
+
+void qb3_set_encoder_curvesearch(encsp p, bool search) {
+    p->search = search;
+}
+
+// The NoData value has to be exactly representable in the data type
+bool qb3_set_encoder_nodata(encsp p, bool nodata, double value) {
+    if (!nodata) {
+        p->nodata = false;
+        return true;
+    }
+    const size_t tsz(szof(p->type));
+    uint64_t v(0);
+    if (QB3_F32 == p->type) {
+        float f = static_cast<float>(value);
+        if (f != value && value == value) // NaN is fine
+            return false;
+        uint32_t u;
+        memcpy(&u, &f, sizeof(u));
+        v = u;
+    }
+    else if (QB3_F64 == p->type) {
+        memcpy(&v, &value, sizeof(v));
+    }
+    else {
+        // Integer, within the type range
+        const double top(std::ldexp(1.0, static_cast<int>(8 * tsz - is_signed_type(p->type))));
+        const double bottom(is_signed_type(p->type) ? -top : 0);
+        if (value != std::floor(value) || value < bottom || value >= top)
+            return false;
+        v = (value < 0) ? static_cast<uint64_t>(static_cast<int64_t>(value)) : static_cast<uint64_t>(value);
+        if (tsz < 8)
+            v &= (1ull << (8 * tsz)) - 1;
+    }
+    p->nodata = true;
+    p->ndv = v;
+    return true;
+}
+
+void qb3_set_encoder_planar(encsp p, bool planar) {
+    p->planar = planar;
+}
+
+void qb3_set_encoder_stats(encsp p, bool stats) {
+    p->stats = stats;
+}
+
+void qb3_set_encoder_summary(encsp p, bool summary) {
+    p->summary = summary;
+}
+
+void qb3_set_encoder_checksum(encsp p, bool checksum) {
+    p->checksum = checksum;
+}
+
+bool qb3_set_encoder_blocksize(encsp p, size_t size) {
+    if (size != B && size != B8)
+        return false;
+    p->bsize = size;
+    return true;
+}
+
+// The block size actually used, B8 only for the Hilbert base modes and images at least B8 x B8
+static size_t block_size(const encs& p) {
+    bool hbase = (QB3M_BASE_H == p.mode || QB3M_RLE_H == p.mode || QB3M_LZ_H == p.mode)
+        && (0 == p.order || HILBERT == p.order);
+    return (B8 == p.bsize && hbase && p.xsize >= B8 && p.ysize >= B8) ? B8 : B;
+}
+
+void qb3_set_encoder_reference(encsp p, const void* ref) {
+    p->ref = ref;
+}
+
+void qb3_set_encoder_keyframes(encsp p, size_t interval) {
+    p->keyint = interval;
+}
+
 size_t qb3_max_encoded_size(const encsp p) {
-    // Pad to 4 x 4
-    size_t n = 16 * ((p->xsize + 3) / 4) * ((p->ysize + 3) / 4) * p->nbands;
+    if (!size_fits(p->xsize, p->ysize, p->nbands, p->type))
+        return 0;
+    // Pad to the block size, the partial blocks overlap
+    const size_t bs(B8 == p->bsize ? B8 : B);
+    size_t n = bs * bs * ((p->xsize + bs - 1) / bs) * ((p->ysize + bs - 1) / bs) * p->nbands;
     // Maximum expansion is under 17/16 bits per input value
     double bits_per_value = 17.0 / 16.0 + 8 * szof(p->type);
-    return 1024 + static_cast<size_t>(bits_per_value * n / 8);
+    // The per band chunks, band mapping, linear predictor and palette
+    size_t hsize = 1024 + p->nbands * (1 + 13);
+    if (p->palette)
+        hsize += std::min(size_t(0xffff), p->nbands * (1 + PALSZ * szof(p->type)));
+    if (p->stats)
+        hsize += p->nbands * (2 * szof(p->type) + 16);
+    if (p->summary)
+        hsize += std::min(size_t(0xffff), p->nbands * ((p->ysize + bs - 1) / bs));
+    if (p->checksum)
+        hsize += std::min(size_t(0xffff), 4 * p->nbands * ((p->ysize + bs - 1) / bs));
+    return hsize + static_cast<size_t>(bits_per_value * n / 8);
 }
 
 qb3_mode qb3_set_encoder_mode(encsp p, qb3_mode mode) {
@@ -133,6 +294,154 @@ qb3_mode qb3_set_encoder_mode(encsp p, qb3_mode mode) {
     return p->mode;
 }
 
+// Candidate scanning curves for the search, as used in the SC chunk
+static const uint64_t CURVES[] = {
+    HILBERT,
+    0x04512376abfed98c, // Hilbert, transposed, from top-left to bottom-left
+    0xcd9840156237baef, // Hilbert, flipped vertically, from bottom-left to bottom-right
+    0x048cd95126aefb73, // Column snake, from top-left to top-right
+    0x0123765489abfedc, // Row snake, from top-left to bottom-left
+    ZCURVE
+};
+
+// Pick the scanning curve which results in the smallest encoding of a sample of blocks
+// The size is estimated the same way as encode_fast, using the plain band difference
+// T is unsigned, the values are used as is, before any other transformation
+template<typename T> static
+void search_curve(const T* image, encs& p) {
+    constexpr size_t UBITS = sizeof(T) == 1 ? 3 : sizeof(T) == 2 ? 4 : sizeof(T) == 4 ? 5 : 6;
+    constexpr auto csw = sizeof(T) == 1 ? QB3::csw3 : sizeof(T) == 2 ? QB3::csw4 : sizeof(T) == 4 ? QB3::csw5 : QB3::csw6;
+    constexpr size_t RUN(16); // Consecutive blocks, to include the transitions between blocks
+    const size_t bands(p.nbands), stride(line_stride(p)), pstride(pixel_stride(p));
+    // Sample about 8 runs of blocks down and 4 across
+    const size_t ystep(B * (1 + p.ysize / B / 8)), xstep(B * (1 + p.xsize / B / 4));
+    size_t best(~size_t(0));
+    for (auto curve : CURVES) {
+        size_t offset[B2] = {};
+        block_offsets<B>(offset, curve, stride, pstride);
+        size_t bits(0);
+        for (size_t y = 0; y + B <= p.ysize; y += ystep) {
+            for (size_t x0 = 0; x0 + B <= p.xsize; x0 += xstep) {
+                for (size_t c = 0; c < bands; c++) {
+                    const size_t cb(p.cband[c]), oc(band_offset(p, c)), ocb(band_offset(p, cb));
+                    T prv(0), group[B2] = {};
+                    size_t runbits(0);
+                    for (size_t x = x0; x + B <= p.xsize && x < x0 + RUN * B; x += B) {
+                        auto blk = image + y * stride + x * pstride;
+                        T bitsused(0);
+                        for (size_t i = 0; i < B2; i++) {
+                            T g = blk[offset[i] + oc];
+                            if (c != cb)
+                                g -= blk[offset[i] + ocb];
+                            prv += g -= prv;
+                            bitsused |= group[i] = mags(g);
+                        }
+                        const size_t rung(topbit(bitsused | 1));
+                        bits += csw[(rung - runbits) & ((1ull << UBITS) - 1)] >> 12;
+                        runbits = rung;
+                        if (bitsused < 2) // Flag and single bits
+                            bits += 1 + (bitsused ? B2 : 0);
+                        else if (1 == rung)
+                            for (size_t i = 0; i < B2; i++)
+                                bits += (0x3321 >> (group[i] * 4)) & 0xf;
+                        else
+                            for (size_t i = 0; i < B2; i++)
+                                bits += QB3::qb3csz(group[i], rung).first;
+                    }
+                }
+            }
+            if (bits >= best) // Can't win
+                break;
+        }
+        if (bits < best) {
+            best = bits;
+            p.order = curve;
+        }
+    }
+}
+
+// NoData block mask, one bit per block in raster order, set when all the values of the block
+// are the NoData value. Returns the number of masked blocks
+// The last block is always encoded, so the data is never empty
+template<typename T> static
+size_t nodata_mask(const T* image, const encs& p, size_t bs, std::vector<uint64_t>& mask) {
+    const size_t xsize(p.xsize), ysize(p.ysize), bands(p.nbands), line(bs * bands);
+    const size_t stride(line_stride(p)), pstride(pixel_stride(p));
+    const bool interleaved(is_interleaved(p));
+    const T ndv(static_cast<T>(p.ndv));
+    mask.assign(((xsize + bs - 1) / bs * ((ysize + bs - 1) / bs) + 63) / 64, 0);
+    size_t count(0), k(0);
+    for (size_t y = 0; y < ysize; y += bs) {
+        if (y + bs > ysize)
+            y = ysize - bs;
+        for (size_t x = 0; x < xsize; x += bs, k++) {
+            if (x + bs > xsize)
+                x = xsize - bs;
+            bool nd(true);
+            for (size_t j = 0; j < bs && nd; j++) {
+                auto v = image + (y + j) * stride + x * pstride;
+                if (interleaved) // The block line is contiguous
+                    for (size_t i = 0; i < line && nd; i++)
+                        nd = (v[i] == ndv);
+                else
+                    for (size_t c = 0; c < bands && nd; c++)
+                        for (size_t i = 0; i < bs && nd; i++)
+                            nd = (v[i * pstride + band_offset(p, c)] == ndv);
+            }
+            if (nd) {
+                mask[k >> 6] |= 1ull << (k & 63);
+                count++;
+            }
+        }
+    }
+    if (is_masked(mask.data(), k - 1)) {
+        mask[(k - 1) >> 6] ^= 1ull << ((k - 1) & 63);
+        count--;
+    }
+    return count;
+}
+
+// Packed NoData mask, 2 bits per 64 blocks, 0 for none, 3 for all, 1 followed by the 64 mask bits
+// or 2 followed by four 16 block quads, each one coded the same way, except for the 2
+// Returns the size in bits, only writes when s is not null
+static size_t pack_mask(const uint64_t* mask, size_t nwords, oBits* s) {
+    size_t bits(0);
+    for (size_t i = 0; i < nwords; i++) {
+        uint64_t w = mask[i];
+        if (0 == w || ~0ull == w) {
+            bits += 2;
+            if (s)
+                s->push(w & 3, 2);
+            continue;
+        }
+        size_t qbits(2);
+        for (size_t q = 0; q < 64; q += 16) {
+            auto v = (w >> q) & 0xffff;
+            qbits += (0 == v || 0xffff == v) ? 2 : 18;
+        }
+        if (qbits >= 66) {
+            bits += 66;
+            if (s) {
+                s->push(1u, 2);
+                s->push(w, 64);
+            }
+            continue;
+        }
+        bits += qbits;
+        if (s) {
+            s->push(2u, 2);
+            for (size_t q = 0; q < 64; q += 16) {
+                auto v = (w >> q) & 0xffff;
+                if (0 == v || 0xffff == v)
+                    s->push(v & 3, 2);
+                else
+                    s->push((v << 2) | 1, 18);
+            }
+        }
+    }
+    return bits;
+}
+
 // Round to Zero Division, no overflow
 template<typename T> static
 T rounddiv(T n, T d) {
@@ -185,6 +494,59 @@ bool quantize(T* source, encs& p) {
     return false;
 }
 
+// Least squares fit of the linear inter-band predictor, for the derived bands
+// The residual gets delta encoded, so the gain is fitted on the horizontal pixel to pixel
+// differences of the quantized values, within a sample of blocks. The offset only matters
+// for the first value, it is chosen so the mean residual is close to zero
+template<typename T> static
+void fit_bandpredictor(const T* image, encs& p) {
+    constexpr int S(14); // Fractional bits of the gain
+    const size_t bands(p.nbands), stride(line_stride(p)), pstride(pixel_stride(p));
+    // Sample about 64 x 64 blocks
+    const size_t ystep(B * (1 + p.ysize / B / 64)), xstep(B * (1 + p.xsize / B / 64));
+    // The kernels see the quantized values, so the fit has to use them too
+    const T q(static_cast<T>(p.quanta));
+    auto val = [&](T v) -> double {
+        return double((p.quanta < 2) ? v : p.away ? rounddiv_away(v, q) : rounddiv(v, q));
+    };
+    for (size_t c = 0; c < bands; c++) {
+        const size_t cb(p.cband[c]);
+        p.lp[c] = { 0, 1, 0 }; // Plain subtraction
+        if (c == cb)
+            continue;
+        // Offsets of the band and the core band within the pixel
+        const size_t oc(band_offset(p, c)), ocb(band_offset(p, cb));
+        double sxx(0), sxy(0), sx(0), sy(0), n(0);
+        for (size_t y = 0; y + B <= p.ysize; y += ystep) {
+            for (size_t x = 0; x + B <= p.xsize; x += xstep) {
+                for (size_t j = 0; j < B; j++) {
+                    auto line = image + (y + j) * stride + x * pstride;
+                    for (size_t i = 1; i < B; i++, line += pstride) {
+                        double xc(val(line[pstride + ocb])), yc(val(line[pstride + oc]));
+                        double dx = xc - val(line[ocb]);
+                        double dy = yc - val(line[oc]);
+                        sxx += dx * dx;
+                        sxy += dx * dy;
+                        sx += xc;
+                        sy += yc;
+                        n++;
+                    }
+                }
+            }
+        }
+        if (0 == n || 0 == sxx)
+            continue;
+        double a = sxy / sxx;
+        a = (a > 8) ? 8 : (a < -8) ? -8 : a;
+        auto ia = static_cast<int32_t>(std::lround(a * (1 << S)));
+        // Offset, including the rounding
+        double b = (sy - sx * ia / (1 << S)) / n * (1 << S) + (1 << (S - 1));
+        constexpr double BMAX(4.6e18); // Under 2^62
+        b = (b > BMAX) ? BMAX : (b < -BMAX) ? -BMAX : b;
+        p.lp[c] = { std::llround(b), ia, S };
+    }
+}
+
 // A chunk signature is two characters
 void static push_sig(const char* sig, oBits& s) {
     s.tobyte(); // Always at byte boundary
@@ -197,13 +559,24 @@ void static write_qb3_header(encsp p, oBits& s) {
     // QB3 signature is 4 bytes
     s.push(*reinterpret_cast<const uint32_t*>("QB3\200"), 32);
     // Write xmax, ymax, num bands in low endian
-    s.push((p->xsize - 1), 16);
-    s.push((p->ysize - 1), 16);
+    // Low 16 bits only, the rest are in the "XS" chunk
+    s.push((p->xsize - 1) & 0xffff, 16);
+    s.push((p->ysize - 1) & 0xffff, 16);
     s.push((p->nbands - 1), 8);
     s.push(static_cast<uint8_t>(p->type), 8); // all values reserved
     s.push(static_cast<uint8_t>(p->mode), 8); // all values reserved
 }
 
+// Extended size, has to be the first chunk
+void static write_size_header(encsp p, oBits& s) {
+    if (p->xsize <= 0x10000 && p->ysize <= 0x10000)
+        return;
+    push_sig("XS", s);
+    s.push(4u, 16);
+    s.push((p->xsize - 1) >> 16, 16);
+    s.push((p->ysize - 1) >> 16, 16);
+}
+
 // Are there any band mappings
 bool static is_banddiff(encsp p) {
     for (int c = 0; c < p->nbands; c++)
@@ -216,7 +589,7 @@ bool static is_banddiff(encsp p) {
 // TODO: Expose the known headers
 // 
 // They are somewhat similar to the PNG chunk names
-// Currently they are: "CB", "QV", "SC", "DT"
+// Currently they are: "CB", "LP", "QV", "SC", "DT"
 // If the first letter is lower case, it can be ignored
 //
 
@@ -232,6 +605,20 @@ void static write_cband_header(encsp p, oBits& s) {
         s.push(p->cband[i], 8); // 8 bits each
 }
 
+// Linear band predictor coefficients, if used
+void static write_bandpredictor_header(encsp p, oBits& s) {
+    if (p->mode == QB3M_STORED || !p->linear || !is_banddiff(p))
+        return;
+    push_sig("LP", s);
+    s.push(p->nbands * 13, 16); // size of payload
+    // a, s, b per band
+    for (size_t c = 0; c < p->nbands; c++) {
+        s.push(static_cast<uint32_t>(p->lp[c].a), 32);
+        s.push(p->lp[c].s, 8);
+        s.push(static_cast<uint64_t>(p->lp[c].b), 64);
+    }
+}
+
 // Header for step, if used
 void static write_quanta_header(encsp p, oBits& s) {
     if (p->quanta < 2) // Is it needed
@@ -242,16 +629,170 @@ void static write_quanta_header(encsp p, oBits& s) {
     s.push(p->quanta, qbytes * 8);
 }
 
-// Write the encoding curve, if it's not the legacy Morton
+// Floating point grid step and origin, if used
+void static write_floatgrid_header(encsp p, oBits& s) {
+    if (p->mode == QB3M_STORED || !is_float(p->type) || 0 == p->fstep)
+        return;
+    uint64_t v;
+    push_sig("QF", s);
+    s.push(24u, 16); // size of payload
+    memcpy(&v, &p->maxerr, sizeof(v));
+    s.push(v, 64);
+    memcpy(&v, &p->fstep, sizeof(v));
+    s.push(v, 64);
+    memcpy(&v, &p->foffset, sizeof(v));
+    s.push(v, 64);
+}
+
+// Palette sort key, preserves the value order of signed and floating point types
+template<typename T> static
+T palkey(T v, qb3_dtype dt) {
+    if (is_float(dt))
+        return fmap(v);
+    if (is_signed_type(dt))
+        return v ^ (T(1) << (8 * sizeof(T) - 1));
+    return v;
+}
+
+// Value bits of a palette sort key
+static uint64_t palvalue(uint64_t key, qb3_dtype dt) {
+    switch (dt) {
+    case QB3_F32: return funmap(static_cast<uint32_t>(key));
+    case QB3_F64: return funmap(key);
+    default:
+        break;
+    }
+    if (is_signed_type(dt))
+        return key ^ (1ull << (8 * szof(dt) - 1));
+    return key;
+}
+
+// Palette, per band number of entries - 1 followed by the values
+void static write_palette_header(encsp p, oBits& s) {
+    if (p->mode == QB3M_STORED || !p->pal)
+        return;
+    const size_t tsz(szof(p->type));
+    size_t len(0);
+    for (size_t c = 0; c < p->nbands; c++)
+        len += 1 + p->palsize[c] * tsz;
+    push_sig("PL", s);
+    s.push(len, 16); // size of payload
+    for (size_t c = 0; c < p->nbands; c++) {
+        s.push(p->palsize[c] - 1, 8);
+        for (size_t i = 0; i < p->palsize[c]; i++)
+            s.push(palvalue(p->pal[c * PALSZ + i], p->type), tsz * 8);
+    }
+}
+
+// Reference frame flag, no payload
+void static write_reference_header(encsp p, oBits& s) {
+    if (p->mode == QB3M_STORED || !p->ref)
+        return;
+    push_sig("RF", s);
+    s.push(0u, 16); // No payload
+}
+
+// Block copy flag, no payload, only used by the modes which try the extra encodings
+void static write_blockcopy_header(encsp p, oBits& s) {
+    if (!p->blockcopy || !is_cf(p->mode))
+        return;
+    push_sig("BC", s);
+    s.push(0u, 16); // No payload
+}
+
+// Adaptive rung switch flag, no payload, the fastest mode doesn't use it
+void static write_adaptive_header(encsp p, oBits& s) {
+    if (!p->adaptive || p->mode == QB3M_STORED || p->mode == QB3M_FTL)
+        return;
+    push_sig("AS", s);
+    s.push(0u, 16); // No payload
+}
+
+// Block size, one byte payload, only written for the larger blocks
+void static write_blocksize_header(encsp p, oBits& s) {
+    if (B == block_size(*p))
+        return;
+    push_sig("BS", s);
+    s.push(1u, 16);
+    s.push(B8, 8);
+}
+
+// NoData value, followed by the packed block mask
+void static write_nodata_header(encsp p, oBits& s) {
+    if (p->mode == QB3M_STORED || !p->mask)
+        return;
+    const size_t tsz(szof(p->type)), bs(block_size(*p));
+    const size_t nwords(((p->xsize + bs - 1) / bs * ((p->ysize + bs - 1) / bs) + 63) / 64);
+    push_sig("ND", s);
+    s.push(tsz + (pack_mask(p->mask, nwords, nullptr) + 7) / 8, 16);
+    s.push(p->ndv, tsz * 8);
+    pack_mask(p->mask, nwords, &s);
+    s.tobyte();
+}
+
+// Write the encoding curve, except for the legacy modes, which always use the Morton curve
 void static write_scanning_curve(encsp p, oBits& s) {
-    if (p->order == ZCURVE || p->mode == QB3M_STORED)
+    if (p->mode < QB3M_BASE_H || p->mode == QB3M_STORED)
         return;
     push_sig("SC", s);
     s.push(8u, 16); // Always 64 bits
     s.push(p->order ? p->order : HILBERT, 64);
 }
 
+// Band statistics, per band minimum and maximum in the value type, sum and count
+// The first letter is lower case, decoders can ignore it
+void static write_stats_header(encsp p, oBits& s) {
+    if (!p->bstats)
+        return;
+    const size_t tsz(szof(p->type));
+    push_sig("st", s);
+    s.push(p->nbands * (2 * tsz + 16), 16);
+    for (size_t c = 0; c < p->nbands; c++) {
+        s.push(p->bstats[4 * c], tsz * 8);
+        s.push(p->bstats[4 * c + 1], tsz * 8);
+        s.push(p->bstats[4 * c + 2], 64);
+        s.push(p->bstats[4 * c + 3], 64);
+    }
+}
+
+// Rung summary, one byte per block row and band, the bits of the largest residual
+// Written with zeros, then again after the data is encoded
+void static write_summary_header(encsp p, oBits& s) {
+    if (p->mode == QB3M_STORED || !p->rungs)
+        return;
+    const size_t bs(block_size(*p));
+    const size_t len(p->nbands * ((p->ysize + bs - 1) / bs));
+    push_sig("rs", s);
+    s.push(len, 16);
+    for (size_t i = 0; i < len; i++)
+        s.push(p->rungs[i], 8);
+}
+
+// Strip checksums, the CRC32C of each block row strip, by stream, 4 bytes each
+// Written with zeros, then again after the data is encoded
+void static write_checksum_header(encsp p, oBits& s) {
+    if (p->mode == QB3M_STORED || !p->crcs)
+        return;
+    const size_t bs(block_size(*p));
+    const size_t len((p->gsize ? p->ngroups : 1) * ((p->ysize + bs - 1) / bs));
+    push_sig("ck", s);
+    s.push(len * 4, 16);
+    for (size_t i = 0; i < len; i++)
+        s.push(p->crcs[i], 32);
+}
+
 // Data header has no known size
+// Planar band group stream sizes, 8 bytes each
+// Written with the sizes set to zero, then again after the groups are encoded
+void static write_groups_header(encsp p, oBits& s) {
+    if (p->mode == QB3M_STORED || !p->gsize)
+        return;
+    push_sig("BG", s);
+    s.push(p->ngroups * 8, 16);
+    for (size_t g = 0; g < p->ngroups; g++)
+        s.push(p->gsize[g], 64);
+}
+
 void static write_data_header(encsp, oBits& s) {
     push_sig("DT", s);
 }
@@ -261,9 +802,22 @@ void static write_data_header(encsp, oBits& s) {
 // which should end with the data header
 void static write_headers(encsp p, oBits& s) {
     write_qb3_header(p, s);
+    write_size_header(p, s);
     write_cband_header(p, s);
+    write_bandpredictor_header(p, s);
     write_quanta_header(p, s);
+    write_floatgrid_header(p, s);
+    write_palette_header(p, s);
+    write_reference_header(p, s);
+    write_blockcopy_header(p, s);
+    write_adaptive_header(p, s);
+    write_blocksize_header(p, s);
+    write_nodata_header(p, s);
     write_scanning_curve(p, s);
+    write_groups_header(p, s);
+    write_stats_header(p, s);
+    write_summary_header(p, s);
+    write_checksum_header(p, s);
     write_data_header(p, s);
 }
 
@@ -331,6 +885,77 @@ static size_t RLE0Size(const uint8_t* src, size_t len)
     return count + end - src;
 }
 
+// LZ second stage, LZ4 style sequences of literals followed by a match
+// A token byte holds the literal count and the match length - LZ_MINMATCH, as two nibbles,
+// a nibble of 15 is continued by bytes which are added until a byte is not 255
+// The literals follow the token, then the 16 bit match offset and the match length continuation
+// The last sequence has only literals. The stream starts with the 64 bit decoded size
+// Greedy matching, with a hash of the next four bytes pointing to the last position seen
+static size_t LZ(const uint8_t* src, size_t len, uint8_t* dst)
+{
+    constexpr size_t HBITS(14), MAXOFF(0xffff), LASTLIT(5), MFLIMIT(12);
+    uint8_t* d(dst);
+    for (size_t i = 0; i < LZ_PREFIX; i++)
+        *d++ = static_cast<uint8_t>(len >> (8 * i));
+    auto read32 = [](const uint8_t* p) { uint32_t v; memcpy(&v, p, 4); return v; };
+    auto hash = [&](const uint8_t* p) { return (read32(p) * 2654435761u) >> (32 - HBITS); };
+    // Emits a length nibble continuation
+    auto extra = [&](size_t n) {
+        for (n -= 15; n >= 255; n -= 255)
+            *d++ = 255;
+        *d++ = static_cast<uint8_t>(n);
+    };
+    std::vector<size_t> table(1ull << HBITS, 0);
+    const uint8_t* const end(src + len);
+    const uint8_t* anchor(src); // First literal
+    const uint8_t* ip(src + 1);
+    while (len > MFLIMIT && ip < end - MFLIMIT) {
+        auto h = hash(ip);
+        const uint8_t* ref = src + table[h];
+        table[h] = ip - src;
+        if (ref >= ip || size_t(ip - ref) > MAXOFF || read32(ref) != read32(ip)) {
+            ip += 1 + ((ip - anchor) >> 6); // Skip faster through incompressible data
+            continue;
+        }
+        // Extend backward, then forward, leaving the last literals
+        while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+        const uint8_t* mp(ip + LZ_MINMATCH);
+        const uint8_t* mr(ref + LZ_MINMATCH);
+        while (mp < end - LASTLIT && *mp == *mr) {
+            mp++;
+            mr++;
+        }
+        size_t lit(ip - anchor), mlen(mp - ip - LZ_MINMATCH);
+        *d++ = static_cast<uint8_t>(((lit < 15 ? lit : 15) << 4) | (mlen < 15 ? mlen : 15));
+        if (lit >= 15)
+            extra(lit);
+        memcpy(d, anchor, lit);
+        d += lit;
+        *d++ = static_cast<uint8_t>(ip - ref);
+        *d++ = static_cast<uint8_t>((ip - ref) >> 8);
+        if (mlen >= 15)
+            extra(mlen);
+        anchor = ip = mp;
+        if (ip < end - MFLIMIT) // Positions within the match are not searched, except one
+            table[hash(ip - 2)] = ip - 2 - src;
+    }
+    // Last literals
+    size_t lit(end - anchor);
+    *d++ = static_cast<uint8_t>((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15)
+        extra(lit);
+    memcpy(d, anchor, lit);
+    return d + lit - dst;
+}
+
+// Maximum size of the LZ output
+static size_t LZBound(size_t len) {
+    return LZ_PREFIX + len + len / 255 + 16;
+}
+
 static size_t raw_size(encsp const &p) {
     return p->xsize * p->ysize * p->nbands * typesizes[p->type];
 }
@@ -341,6 +966,212 @@ static bool is_fast(qb3_mode mode) {
     return (QB3M_BASE_H == mode) || (QB3M_BASE_Z == mode) || (QB3M_FTL == mode);
 }
 
+// Sets the floating point grid step and origin, the origin is the minimum value
+// The step is a bit under twice the maximum error, leaving room for the rounding of the
+// decoded values. If the maximum error is within the rounding, the encoding is lossless
+// Returns false if the values are not finite or the grid index doesn't fit
+// T is the unsigned integer of the same size as the floating point type
+template<typename T> static
+bool fit_floatgrid(const T* image, encs& p) {
+    const size_t stride(line_stride(p)), pstride(pixel_stride(p));
+    const std::vector<size_t> boff(band_offsets(p));
+    double vmin(std::numeric_limits<double>::max()), vmax(-vmin);
+    for (size_t y = 0; y < p.ysize; y++) {
+        auto line = image + y * stride;
+        for (size_t x = 0; x < p.xsize; x++, line += pstride) {
+            for (size_t c = 0; c < p.nbands; c++) {
+                double v = fvalue(line[boff[c]]);
+                if (!std::isfinite(v))
+                    return false;
+                vmin = (v < vmin) ? v : vmin;
+                vmax = (v > vmax) ? v : vmax;
+            }
+        }
+    }
+    // Upper bound of the rounding, two units in the last place at the largest magnitude
+    double ulp = std::ldexp((-vmin > vmax) ? -vmin : vmax, (sizeof(T) == 4) ? -22 : -51);
+    p.fstep = (p.maxerr > ulp) ? 2 * (p.maxerr - ulp) : 0;
+    p.foffset = vmin;
+    if (0 == p.fstep)
+        return true;
+    // The index is exact in a double, keep a margin for nudging
+    const double qmax = (sizeof(T) == 4) ? 4294967295.0 : 9007199254740992.0;
+    return (vmax - vmin) / p.fstep < qmax - 2;
+}
+
+// Replace floating point values with their grid index, in place
+// Returns false if the error bound can't be met
+// T is the unsigned integer of the same size as the floating point type
+template<typename T> static
+bool grid_float(T* source, encs& p) {
+    size_t nV = p.xsize * p.ysize * p.nbands; // Number of values
+    const double step(p.fstep), offset(p.foffset), maxerr(p.maxerr);
+    for (size_t i = 0; i < nV; i++) {
+        double v = fvalue(source[i]);
+        double q = std::nearbyint((v - offset) / step);
+        T iq = static_cast<T>(q > 0 ? q : 0);
+        // Nudge the index if the rounding of the decoded value exceeds the bound
+        double e = fvalue(fgrid(iq, step, offset)) - v;
+        if (e > maxerr && iq > 0)
+            e = fvalue(fgrid(--iq, step, offset)) - v;
+        else if (e < -maxerr)
+            e = fvalue(fgrid(++iq, step, offset)) - v;
+        if (!(std::abs(e) <= maxerr))
+            return false;
+        source[i] = iq;
+    }
+    return true;
+}
+
+// Subtract the reference frame from a compact strip of a number of lines, in place
+// The reference has the input layout, the floating point values are mapped first
+template<typename T> static
+void sub_reference(T* strip, const T* ref, const encs& p, size_t lines, bool fp) {
+    const size_t stride(line_stride(p)), pstride(pixel_stride(p));
+    const std::vector<size_t> boff(band_offsets(p));
+    const size_t n(p.xsize * p.nbands);
+    for (size_t y = 0; y < lines; y++, ref += stride) {
+        if (is_interleaved(p)) {
+            if (fp)
+                for (size_t i = 0; i < n; i++)
+                    strip[i] -= fmap(ref[i]);
+            else
+                for (size_t i = 0; i < n; i++)
+                    strip[i] -= ref[i];
+            strip += n;
+            continue;
+        }
+        for (size_t x = 0; x < p.xsize; x++)
+            for (size_t c = 0; c < p.nbands; c++) {
+                T r = ref[x * pstride + boff[c]];
+                *strip++ -= fp ? fmap(r) : r;
+            }
+    }
+}
+
+// Map floating point values to order preserving integers, in place
+// T is the unsigned integer of the same size
+template<typename T> static
+void map_float(T* source, encs& p) {
+    size_t nV = p.xsize * p.ysize * p.nbands; // Number of values
+    for (size_t i = 0; i < nV; i++)
+        source[i] = fmap(source[i]);
+}
+
+// Build the per band palette, the sorted keys of the distinct values
+// Returns false if a band has too many values or if the palette is not useful
+// T is the unsigned integer of the same size
+template<typename T> static
+bool fit_palette(const T* source, encs& p, std::vector<uint64_t>& pal) {
+    const size_t bands(p.nbands), stride(line_stride(p)), pstride(pixel_stride(p));
+    const std::vector<size_t> boff(band_offsets(p));
+    pal.assign(bands * PALSZ, 0);
+    std::vector<T> last(bands);
+    for (size_t c = 0; c < bands; c++)
+        p.palsize[c] = 0;
+    if (1 == sizeof(T)) { // Mark the values present, then collect the keys in order
+        std::vector<uint8_t> seen(bands * 256, 0);
+        for (size_t y = 0; y < p.ysize; y++) {
+            auto line = source + y * stride;
+            for (size_t x = 0; x < p.xsize; x++, line += pstride)
+                for (size_t c = 0; c < bands; c++)
+                    seen[c * 256 + line[boff[c]]] = 1;
+        }
+        for (size_t c = 0; c < bands; c++) {
+            for (size_t v = 0; v < 256; v++)
+                if (seen[c * 256 + v])
+                    pal[c * PALSZ + p.palsize[c]++] = palkey(static_cast<T>(v), p.type);
+            std::sort(pal.begin() + c * PALSZ, pal.begin() + c * PALSZ + p.palsize[c]);
+        }
+    }
+    else {
+        for (size_t y = 0; y < p.ysize; y++) {
+            auto line = source + y * stride;
+            for (size_t x = 0; x < p.xsize; x++, line += pstride) {
+                for (size_t c = 0; c < bands; c++) {
+                    uint64_t key = palkey(line[boff[c]], p.type);
+                    // Runs of the same value are common
+                    if (p.palsize[c] && key == last[c])
+                        continue;
+                    last[c] = static_cast<T>(key);
+                    auto b = pal.begin() + c * PALSZ, e = b + p.palsize[c];
+                    auto it = std::lower_bound(b, e, key);
+                    if (it != e && *it == key)
+                        continue;
+                    if (PALSZ == p.palsize[c])
+                        return false;
+                    std::copy_backward(it, e, e + 1);
+                    *it = key;
+                    p.palsize[c]++;
+                }
+            }
+        }
+    }
+    // The palette has to fit in the chunk
+    size_t len(0);
+    for (size_t c = 0; c < bands; c++)
+        len += 1 + p.palsize[c] * sizeof(T);
+    if (len > 0xffff)
+        return false;
+    // Useful if the indices are significantly smaller than the value range for at least one band
+    for (size_t c = 0; c < bands; c++)
+        if ((pal[c * PALSZ + p.palsize[c] - 1] - pal[c * PALSZ]) / 2 >= p.palsize[c])
+            return true;
+    return false;
+}
+
+// Replace the values with their palette index, in place
+template<typename T> static
+void palette_index(T* source, const encs& p) {
+    const size_t bands(p.nbands), nV(p.xsize * p.ysize * bands);
+    if (1 == sizeof(T)) { // Direct lookup
+        uint8_t idx[256];
+        for (size_t c = 0; c < bands; c++) {
+            for (size_t i = 0; i < p.palsize[c]; i++)
+                idx[palvalue(p.pal[c * PALSZ + i], p.type)] = static_cast<uint8_t>(i);
+            for (size_t i = c; i < nV; i += bands)
+                source[i] = idx[source[i]];
+        }
+        return;
+    }
+    for (size_t c = 0; c < bands; c++) {
+        auto b = p.pal + c * PALSZ, e = b + p.palsize[c];
+        uint64_t key(0), idx(0);
+        for (size_t i = c; i < nV; i += bands) {
+            uint64_t k = palkey(source[i], p.type);
+            if (k != key || 0 == idx) {
+                key = k;
+                idx = 1 + (std::lower_bound(b, e, k) - b);
+            }
+            source[i] = static_cast<T>(idx - 1);
+        }
+    }
+}
+
+// Copy an image narrower or shorter than B into dst, as an image with B lines or B columns
+// Preserve locality by copying pixels in the short dimension first
+// This is not optimal, but small images are not performance critical
+template<typename T> static
+void pad_small(const T* source, const encs& p, T* dst) {
+    // Strides in T units
+    const size_t stride(line_stride(p)), pstride(pixel_stride(p));
+    const std::vector<size_t> boff(band_offsets(p));
+    if (p.xsize < B) { // Narrow and tall
+        // Copy line by line, until we run out of lines
+        to_compact(dst, source, p, p.ysize);
+    }
+    else { // Short and wide
+        // Copy columnn by column, sort of transposing
+        for (size_t x = 0; x < p.xsize; x++) {
+            for (size_t y = 0; y < p.ysize; y++) {
+                auto src = source + y * stride + x * pstride;
+                for (size_t c = 0; c < p.nbands; c++)
+                    *dst++ = src[boff[c]];
+            }
+        }
+    }
+}
+
 // Common entry point, the header has already been written
 template<typename T> static int enc(const T *source, oBits &s, encsp p)
 {
@@ -348,49 +1179,45 @@ template<typename T> static int enc(const T *source, oBits &s, encsp p)
     // Deal with small images here by copying data to a temporary buffer
     // This is far from optimal and copies the data, but deals with small inputs
     // Always pad to B x B groups to avoid duplicating lines or columns
+    // The temporary image is used after this block, so it is declared here
+    encs smallimg;
+    std::vector<T> tempbuf, tempref; // Vectors to handle memory management
     if (p->xsize < B || p->ysize < B) {
-        encs smallimg(*p);
-        std::vector<T> tempbuf; // Vector to handle memory management
+        smallimg = *p;
         size_t ngroups = (p->xsize * p->ysize + B2 - 1) / B2;
         size_t bufsize =  p->nbands * ngroups * B2;
-        tempbuf.resize(bufsize); // This initializes the vector with zeros
-        auto dst = tempbuf.data();
-        // Stride in T units
-        size_t stride = p->stride ? p->stride : (p->xsize * p->nbands);
-        // Preserve locality by copying pixels in the short dimension first
-        // This is not optimal, but small images are not performance critical
-        if (p->xsize < B) { // Narrow and tall
-            // Copy line by line, until we run out of lines
-            size_t line = p->xsize * p->nbands;
-            for (size_t y = 0; y < p->ysize; y++) {
-                auto src = source + y * stride;
-                memcpy(dst, src, line * sizeof(T));
-                dst += line;
-            }
+        // Pad with zeros, or with a value which is on the floating point grid or in the palette
+        tempbuf.assign(bufsize, ((is_float(p->type) && p->fstep > 0) || p->pal) ? source[band_offset(*p, 0)] : T(0));
+        pad_small(source, *p, tempbuf.data());
+        // The reference frame is padded the same way, so the padding difference is zero
+        if (p->ref) {
+            tempref.resize(bufsize);
+            pad_small(static_cast<const T*>(p->ref), *p, tempref.data());
+            smallimg.ref = tempref.data();
+        }
+        // Adjust smallimg parameters
+        if (p->xsize < B) {
             smallimg.xsize = B; // Larger than original
             smallimg.ysize = ngroups * B; // Does not overflow
         }
-        else { // Short and wide
-            // Copy columnn by column, sort of transposing
-            for (size_t x = 0; x < p->xsize; x++) {
-                for (size_t y = 0; y < p->ysize; y++) {
-                    auto src = source + y * stride + x * p->nbands;
-                    memcpy(dst, src, p->nbands * sizeof(T));
-                    dst += p->nbands;
-                }
-            }
+        else {
             smallimg.xsize = ngroups * B; // Does not overflow
             smallimg.ysize = B; // Larger than original
         }
-        // Adjust smallimg parameters
-        smallimg.stride = 0; // No stride in encoding the small image
+        // No stride in encoding the small image, which is band interleaved
+        set_compact(smallimg);
         source = tempbuf.data();
         p = &smallimg;
     }
 
     int error(0);    
-    if (p->quanta < 2) {
+    const size_t bs(block_size(*p));
+    if (p->quanta < 2 && !is_float(p->type) && !p->ref && !p->pal) {
+        if (is_med(p->mode))
+            return QB3::encode_med(source, s, *p);
         if (is_fast(p->mode)) {
+            if (B8 == bs)
+                return QB3::encode_fast<T, false, B8>(source, s, *p);
             if (p->mode == QB3M_FTL)
                 return QB3::encode_fast<T, true>(source, s, *p);
             return QB3::encode_fast<T, false>(source, s, *p);
@@ -398,47 +1225,78 @@ template<typename T> static int enc(const T *source, oBits &s, encsp p)
         return QB3::encode_best(source, s, *p);
     }
 
-    // Quantized encoding
-    // Use a subencoder to encode one B lines strip at a time,
+    // Quantized, floating point, palette or reference frame encoding
+    // Use a subencoder to encode one block high strip at a time,
     // while keeping the running state from one strip to the next
     // This avoids doubling memory for the input data
+    // The 2D prediction needs the line above, so it encodes the whole image at once
     encs subimg(*p);
-    subimg.ysize = B;
+    subimg.ysize = is_med(p->mode) ? p->ysize : bs;
+    subimg.ref = nullptr; // The strip is already the difference
+    // The strip is compact and band interleaved
+    set_compact(subimg);
     auto ysz(p->ysize);
 
-    // In bytes, input line size
-    auto linesize = p->xsize * p->nbands * typesizes[p->type];
-    auto stride = linesize; // Default stride
-    // Compact the subimage if the linesize is different
-    if (p->stride != 0 && p->stride * typesizes[p->type] != stride)
-    {
-        subimg.stride = 0; // No stride in the subimage
-        stride = p->stride * typesizes[p->type];
-    }
+    // In T units, input line stride
+    const size_t stride(line_stride(*p));
     // Temporary data buffer for a single strip
-    std::vector<uint8_t> buffer(raw_size(p));
-    auto src = reinterpret_cast<const uint8_t*>(source);
+    // With block copy, the previous transformed strip is kept before it, as a copy source
+    const bool above(subimg.blockcopy && is_cf(subimg.mode) && !is_med(subimg.mode));
+    const size_t ssize(subimg.ysize * p->xsize * p->nbands * sizeof(T));
+    std::vector<uint8_t> buffer(above ? 2 * ssize : ssize);
+    uint8_t* const strip(buffer.data() + buffer.size() - ssize);
+    encs pair(subimg); // The previous and the current strip
+    pair.ysize = 2 * subimg.ysize;
+    pair.above = true;
+    auto src = source;
+    auto rsrc = static_cast<const T*>(p->ref); // Same layout as the input
 
-#define QENC(T)\
-    quantize(reinterpret_cast<T *>(buffer.data()), subimg);\
-    if (is_fast(subimg.mode)) {\
-        if (subimg.mode == QB3M_FTL)\
-            error = QB3::encode_fast<std::make_unsigned<T>::type, true>(\
-                reinterpret_cast<std::make_unsigned<T>::type *>(buffer.data()), s, subimg);\
+// Subtract the reference, then encode the transformed strip, T is unsigned
+#define SENC(T)\
+    if (rsrc)\
+        sub_reference(reinterpret_cast<T *>(strip), reinterpret_cast<const T *>(rsrc),\
+            *p, subimg.ysize, is_float(p->type));\
+    if (is_med(subimg.mode))\
+        error = QB3::encode_med(reinterpret_cast<T *>(strip), s, subimg);\
+    else if (is_fast(subimg.mode)) {\
+        if (B8 == bs)\
+            error = QB3::encode_fast<T, false, B8>(reinterpret_cast<T *>(strip), s, subimg);\
+        else if (subimg.mode == QB3M_FTL)\
+            error = QB3::encode_fast<T, true>(reinterpret_cast<T *>(strip), s, subimg);\
         else\
-            error = QB3::encode_fast<std::make_unsigned<T>::type, false>(\
-                reinterpret_cast<std::make_unsigned<T>::type *>(buffer.data()), s, subimg);\
+            error = QB3::encode_fast<T, false>(reinterpret_cast<T *>(strip), s, subimg);\
+    } else if (above && y) {\
+        pair.mseq = subimg.mseq;\
+        error = QB3::encode_best(reinterpret_cast<T *>(buffer.data()), s, pair);\
+        subimg.mseq = pair.mseq;\
     } else\
-        error = QB3::encode_best(\
-            reinterpret_cast<std::make_unsigned<T>::type *>(buffer.data()), s, subimg);
+        error = QB3::encode_best(reinterpret_cast<T *>(strip), s, subimg);
+
+#define QENC(T)\
+    if (subimg.pal)\
+        palette_index(reinterpret_cast<std::make_unsigned<T>::type *>(strip), subimg);\
+    else if (subimg.quanta > 1)\
+        quantize(reinterpret_cast<T *>(strip), subimg);\
+    SENC(std::make_unsigned<T>::type)
+
+#define FENC(T)\
+    if (subimg.pal)\
+        palette_index(reinterpret_cast<T *>(strip), subimg);\
+    else if (0 == subimg.fstep)\
+        map_float(reinterpret_cast<T *>(strip), subimg);\
+    else if (!grid_float(reinterpret_cast<T *>(strip), subimg))\
+        return QB3E_EINV;\
+    SENC(T)
 
     for (size_t y = 0; y < ysz; y += subimg.ysize) {
         // Shift the last strip up to handle the unaligned edge
-        if (y + subimg.ysize > ysz)
+        if (y + subimg.ysize > ysz) {
             src -= stride * (y + subimg.ysize - ysz);
+            if (rsrc)
+                rsrc -= stride * (y + subimg.ysize - ysz);
+        }
         // Copy the strip
-        for (size_t i = 0; i < subimg.ysize; i++)
-            memcpy(buffer.data() + i * linesize, src + i * stride, linesize);
+        to_compact(reinterpret_cast<T*>(strip), src, *p, subimg.ysize);
 
         switch (p->type) {
         case qb3_dtype::QB3_U8:  QENC(uint8_t);  break;
@@ -449,15 +1307,77 @@ template<typename T> static int enc(const T *source, oBits &s, encsp p)
         case qb3_dtype::QB3_I32: QENC(int32_t);  break;
         case qb3_dtype::QB3_U64: QENC(uint64_t); break;
         case qb3_dtype::QB3_I64: QENC(int64_t);  break;
+        case qb3_dtype::QB3_F32: FENC(uint32_t); break;
+        case qb3_dtype::QB3_F64: FENC(uint64_t); break;
         default: return QB3E_EINV;
         }
+        if (above)
+            memcpy(buffer.data(), strip, ssize);
         src += stride * subimg.ysize;
+        if (rsrc)
+            rsrc += stride * subimg.ysize;
     }
 
+#undef FENC
 #undef QENC
+#undef SENC
     return error;
 }
 
+// Encode each band group as a separate byte aligned stream, recording the stream sizes
+// The group bands are encoded in place, with the per band state of the group
+template<typename T> static int enc_planar(const T* source, oBits& s, encsp p,
+    const size_t* gband, const size_t* gstart)
+{
+    for (size_t g = 0; g < p->ngroups; g++) {
+        const size_t* gb(gband + gstart[g]);
+        const size_t n(gstart[g + 1] - gstart[g]);
+        std::vector<size_t> palsize(n), cband(n), gsel(n);
+        std::vector<band_state> band(n);
+        std::vector<band_lp> lp(n);
+        std::vector<rswitch> rs(p->rs ? n : 0);
+        std::vector<uint64_t> pal(p->pal ? n * PALSZ : 0);
+        for (size_t i = 0; i < n; i++) {
+            const size_t c(gb[i]);
+            for (size_t j = 0; j < n; j++)
+                if (gb[j] == p->cband[c])
+                    cband[i] = j;
+            palsize[i] = p->palsize[c];
+            band[i] = p->band[c];
+            lp[i] = p->lp[c];
+            if (p->rs)
+                rs[i] = p->rs[c];
+            if (p->pal)
+                std::copy(p->pal + c * PALSZ, p->pal + (c + 1) * PALSZ, pal.begin() + i * PALSZ);
+        }
+        encs sub(*p);
+        set_group(sub, *p, gb, n, gsel.data());
+        sub.mseq = 0;
+        sub.palsize = palsize.data();
+        sub.cband = cband.data();
+        sub.band = band.data();
+        sub.lp = lp.data();
+        sub.rs = p->rs ? rs.data() : nullptr;
+        sub.pal = p->pal ? pal.data() : nullptr;
+        // The group rung summary is merged into the image one
+        const size_t rows(p->rungs ? (p->ysize + block_size(*p) - 1) / block_size(*p) : 0);
+        std::vector<uint8_t> rungs(rows * n);
+        sub.rungs = p->rungs ? rungs.data() : nullptr;
+        // The group strips follow the previous group ones
+        const size_t bs(block_size(*p));
+        sub.strips = p->strips ? p->strips + g * ((p->ysize + bs - 1) / bs) : nullptr;
+        const size_t start(s.tobyte());
+        int error = enc(source, s, &sub);
+        if (error)
+            return error;
+        p->gsize[g] = s.tobyte() - start;
+        for (size_t r = 0; r < rows; r++)
+            for (size_t i = 0; i < n; i++)
+                p->rungs[r * p->nbands + gb[i]] = rungs[r * n + i];
+    }
+    return 0;
+}
+
 static size_t stored_encode(encsp p, void* source, void* destination) {
     auto d = reinterpret_cast<uint8_t*>(destination);
     oBits s(d);
@@ -466,26 +1386,87 @@ static size_t stored_encode(encsp p, void* source, void* destination) {
     if (p->error)
         return 0;
     // Copy the raw data at the current position, they are not overlapping
-    if (p->stride == 0 || p->stride == p->xsize * p->nbands) // Contiguous
+    if (line_stride(*p) == p->xsize * p->nbands && is_interleaved(*p)) // Contiguous
     {
         memcpy(d + s.tobyte(), source, raw_size(p));
         // Return the new size
         return s.tobyte() + raw_size(p);
     }
-    // Non contiguous, copy line by line
-    size_t linesize = p->xsize * p->nbands * typesizes[p->type];
+    // Non contiguous, copy line by line, as band interleaved
     d += s.tobyte();
-    auto src = reinterpret_cast<uint8_t*>(source);
-    for (size_t y = 0; y < p->ysize; y++) {
-        memcpy(d, src, linesize);
-        d += p->stride;
-        src += linesize;
+    switch (typesizes[p->type]) {
+    case 1: to_compact(d, reinterpret_cast<uint8_t*>(source), *p, p->ysize); break;
+    case 2: to_compact(reinterpret_cast<uint16_t*>(d), reinterpret_cast<uint16_t*>(source), *p, p->ysize); break;
+    case 4: to_compact(reinterpret_cast<uint32_t*>(d), reinterpret_cast<uint32_t*>(source), *p, p->ysize); break;
+    case 8: to_compact(reinterpret_cast<uint64_t*>(d), reinterpret_cast<uint64_t*>(source), *p, p->ysize); break;
     }
     return s.tobyte() + raw_size(p);
 }
 
+// Per band minimum, maximum, sum and count, skipping the NoData value and NaN
+// T is the unsigned integer type, V is the value type
+template<typename T, typename V> static
+void band_stats(const T* image, const encs& p, uint64_t* bstats) {
+    const size_t stride(line_stride(p)), pstride(pixel_stride(p));
+    const T ndv(static_cast<T>(p.ndv));
+    for (size_t c = 0; c < p.nbands; c++) {
+        V vmin(std::numeric_limits<V>::max()), vmax(std::numeric_limits<V>::lowest());
+        T umin(0), umax(0);
+        // Exact for the small integer types
+        typename std::conditional<(sizeof(V) < 4 && std::is_integral<V>::value), int64_t, double>::type sum(0);
+        size_t count(0);
+        for (size_t y = 0; y < p.ysize; y++) {
+            auto line = image + y * stride + band_offset(p, c);
+            for (size_t x = 0; x < p.xsize; x++) {
+                T u(line[x * pstride]);
+                if (p.nodata && u == ndv)
+                    continue;
+                V v;
+                memcpy(&v, &u, sizeof(V));
+                if (std::is_floating_point<V>::value && v != v)
+                    continue;
+                if (v < vmin) {
+                    vmin = v;
+                    umin = u;
+                }
+                if (v > vmax) {
+                    vmax = v;
+                    umax = u;
+                }
+                sum += v;
+                count++;
+            }
+        }
+        double dsum(static_cast<double>(sum));
+        bstats[4 * c] = umin;
+        bstats[4 * c + 1] = umax;
+        memcpy(&bstats[4 * c + 2], &dsum, sizeof(dsum));
+        bstats[4 * c + 3] = count;
+    }
+}
+
 // The encode public API, returns 0 if an error is detected
-size_t qb3_encode(encsp p, void* source, void* destination) {
+static size_t encode(encsp p, void* source, void* destination) {
+    // Band statistics, one pass over the input, the header is written before the data
+    std::vector<uint64_t> bstats(p->stats ? p->nbands * 4 : 0);
+    if (p->stats) {
+#define STATS(T, V) band_stats<T, V>(reinterpret_cast<const T*>(source), *p, bstats.data())
+        switch (p->type) {
+        case qb3_dtype::QB3_U8:  STATS(uint8_t, uint8_t);   break;
+        case qb3_dtype::QB3_I8:  STATS(uint8_t, int8_t);    break;
+        case qb3_dtype::QB3_U16: STATS(uint16_t, uint16_t); break;
+        case qb3_dtype::QB3_I16: STATS(uint16_t, int16_t);  break;
+        case qb3_dtype::QB3_U32: STATS(uint32_t, uint32_t); break;
+        case qb3_dtype::QB3_I32: STATS(uint32_t, int32_t);  break;
+        case qb3_dtype::QB3_U64: STATS(uint64_t, uint64_t); break;
+        case qb3_dtype::QB3_I64: STATS(uint64_t, int64_t);  break;
+        case qb3_dtype::QB3_F32: STATS(uint32_t, float);    break;
+        case qb3_dtype::QB3_F64: STATS(uint64_t, double);   break;
+        }
+#undef STATS
+        p->bstats = bstats.data();
+    }
+
     // Just store images smaller than B x B
     if (p->xsize * p->ysize <= B2)
         return stored_encode(p, source, destination);
@@ -493,17 +1474,141 @@ size_t qb3_encode(encsp p, void* source, void* destination) {
     // Turn off the RLE for now
     auto const mode = p->mode; // save the user chosen mode
     bool rle = (QB3M_RLE == mode || QB3M_CF_RLE == mode || QB3M_CF_RLE_H == mode || QB3M_RLE_H == mode);
-    if (rle) {
+    bool lz = (QB3M_LZ_H == mode || QB3M_CF_LZ_H == mode);
+    if (rle || lz) {
         switch (mode) {
         case QB3M_RLE: p->mode = QB3M_BASE_Z; break;
         case QB3M_CF_RLE: p->mode = QB3M_CF; break;
         case QB3M_RLE_H: p->mode = QB3M_BASE_H; break;
         case QB3M_CF_RLE_H: p->mode = QB3M_CF_H; break;
+        case QB3M_LZ_H: p->mode = QB3M_BASE_H; break;
+        case QB3M_CF_LZ_H: p->mode = QB3M_CF_H; break;
         default: // Library internal error
             p->error = QB3E_LIBERR;
             return 0;
         }
     }
+    const qb3_mode emode(p->mode); // Used for the data, without the RLE or LZ
+
+    // Fit the band predictor before writing the headers, on the quantized values
+    if (p->linear && is_banddiff(p)) {
+        switch (p->type) {
+        case qb3_dtype::QB3_U8:  fit_bandpredictor(reinterpret_cast<const uint8_t*>(source), *p);  break;
+        case qb3_dtype::QB3_I8:  fit_bandpredictor(reinterpret_cast<const int8_t*>(source), *p);   break;
+        case qb3_dtype::QB3_U16: fit_bandpredictor(reinterpret_cast<const uint16_t*>(source), *p); break;
+        case qb3_dtype::QB3_I16: fit_bandpredictor(reinterpret_cast<const int16_t*>(source), *p);  break;
+        case qb3_dtype::QB3_U32: fit_bandpredictor(reinterpret_cast<const uint32_t*>(source), *p); break;
+        case qb3_dtype::QB3_I32: fit_bandpredictor(reinterpret_cast<const int32_t*>(source), *p);  break;
+        case qb3_dtype::QB3_U64: fit_bandpredictor(reinterpret_cast<const uint64_t*>(source), *p); break;
+        case qb3_dtype::QB3_I64: fit_bandpredictor(reinterpret_cast<const int64_t*>(source), *p);  break;
+        default: // Makes clang -Wswitch happy
+            break;
+        }
+    }
+
+    // The reference frame is only used for lossless encoding
+    if (p->ref && (p->quanta > 1 || p->maxerr > 0)) {
+        p->mode = mode;
+        p->error = QB3E_EINV;
+        return 0;
+    }
+
+    // Set the floating point grid, also checks that the values fit
+    p->fstep = 0;
+    if (is_float(p->type) && p->maxerr > 0) {
+        if (!((QB3_F32 == p->type) ? fit_floatgrid(reinterpret_cast<const uint32_t*>(source), *p)
+            : fit_floatgrid(reinterpret_cast<const uint64_t*>(source), *p))) {
+            p->mode = mode;
+            p->error = QB3E_EINV;
+            return 0;
+        }
+    }
+
+    // Build the palette, only for lossless encoding without other transforms
+    std::vector<uint64_t> palette;
+    if (p->palette && p->quanta < 2 && 0 == p->fstep && !p->ref && !(p->linear && is_banddiff(p))) {
+        bool fits(false);
+        switch (szof(p->type)) {
+        case 1: fits = fit_palette(reinterpret_cast<const uint8_t*>(source), *p, palette); break;
+        case 2: fits = fit_palette(reinterpret_cast<const uint16_t*>(source), *p, palette); break;
+        case 4: fits = fit_palette(reinterpret_cast<const uint32_t*>(source), *p, palette); break;
+        case 8: fits = fit_palette(reinterpret_cast<const uint64_t*>(source), *p, palette); break;
+        }
+        if (fits)
+            p->pal = palette.data();
+    }
+
+    // Pick the scanning curve, for integer types without other transforms
+    // The legacy and MED modes and the 8x8 blocks don't use it
+    if (p->search && p->mode >= QB3M_BASE_H && p->mode < QB3M_END && !is_med(p->mode) && B == block_size(*p)
+        && !is_float(p->type) && !p->ref && !p->pal) {
+        switch (szof(p->type)) {
+        case 1: search_curve(reinterpret_cast<const uint8_t*>(source), *p); break;
+        case 2: search_curve(reinterpret_cast<const uint16_t*>(source), *p); break;
+        case 4: search_curve(reinterpret_cast<const uint32_t*>(source), *p); break;
+        case 8: search_curve(reinterpret_cast<const uint64_t*>(source), *p); break;
+        }
+    }
+
+    // NoData block mask, not for the 2D prediction, which needs all the values
+    // Only used when it is smaller than one bit per masked value, and if it fits in the chunk
+    std::vector<uint64_t> mask;
+    p->mseq = 0;
+    if (p->nodata && !is_med(p->mode)) {
+        const size_t bs(block_size(*p));
+        size_t count(0);
+        if (p->xsize >= bs && p->ysize >= bs) {
+            switch (szof(p->type)) {
+            case 1: count = nodata_mask(reinterpret_cast<const uint8_t*>(source), *p, bs, mask); break;
+            case 2: count = nodata_mask(reinterpret_cast<const uint16_t*>(source), *p, bs, mask); break;
+            case 4: count = nodata_mask(reinterpret_cast<const uint32_t*>(source), *p, bs, mask); break;
+            case 8: count = nodata_mask(reinterpret_cast<const uint64_t*>(source), *p, bs, mask); break;
+            }
+        }
+        auto bits = count ? pack_mask(mask.data(), mask.size(), nullptr) : 0;
+        if (count && bits <= count * bs * bs && (bits + 7) / 8 + szof(p->type) <= 0xffff)
+            p->mask = mask.data();
+    }
+
+    // Adaptive rung switch state, shared by the strips
+    std::vector<rswitch> rswitches(p->adaptive && QB3M_FTL != p->mode ? p->nbands : 0);
+    for (auto& a : rswitches)
+        rs_init(a, szof(p->type) == 1 ? 3 : szof(p->type) == 2 ? 4 : szof(p->type) == 4 ? 5 : 6);
+    p->rs = rswitches.empty() ? nullptr : rswitches.data();
+
+    // Planar band groups, not with RLE or LZ, which apply to the whole stream
+    std::vector<size_t> gband(p->nbands), gstart(p->nbands + 1), gsize;
+    if (p->planar && !rle && !lz) {
+        p->ngroups = band_groups(p->cband, p->nbands, gband.data(), gstart.data());
+        if (p->ngroups > 1) {
+            gsize.assign(p->ngroups, 0);
+            p->gsize = gsize.data();
+        }
+    }
+
+    // Rung summary, if it fits in the chunk, filled in while encoding
+    std::vector<uint8_t> rungs;
+    if (p->summary) {
+        const size_t bs(block_size(*p)), rows((p->ysize + bs - 1) / bs);
+        if (p->xsize >= bs && p->ysize >= bs && rows * p->nbands <= 0xffff) {
+            rungs.assign(rows * p->nbands, 0);
+            p->rungs = rungs.data();
+        }
+    }
+
+    // Strip checksums, if they fit in the chunk, the strip ends are kept while encoding
+    std::vector<size_t> strips;
+    std::vector<uint32_t> crcs;
+    if (p->checksum) {
+        const size_t bs(block_size(*p)), rows((p->ysize + bs - 1) / bs);
+        const size_t n(rows * (p->gsize ? p->ngroups : 1));
+        if (p->xsize >= bs && p->ysize >= bs && n * 4 <= 0xffff) {
+            strips.assign(n, 0);
+            crcs.assign(n, 0);
+            p->strips = strips.data();
+            p->crcs = crcs.data();
+        }
+    }
 
     uint8_t* const d = reinterpret_cast<uint8_t*>(destination);
     oBits s(d);
@@ -513,7 +1618,8 @@ size_t qb3_encode(encsp p, void* source, void* destination) {
     data_position = (s.position() + 7) / 8; // It is byte aligned already
     if (p->error) return 0;
 
-#define ENC(T) enc(reinterpret_cast<const T*>(source), s, p)
+#define ENC(T) (p->gsize ? enc_planar(reinterpret_cast<const T*>(source), s, p, gband.data(), gstart.data())\
+    : enc(reinterpret_cast<const T*>(source), s, p))
     switch (p->type) {
     case qb3_dtype::QB3_U8:
     case qb3_dtype::QB3_I8:
@@ -523,9 +1629,11 @@ size_t qb3_encode(encsp p, void* source, void* destination) {
         p->error = ENC(uint16_t); break;
     case qb3_dtype::QB3_U32:
     case qb3_dtype::QB3_I32:
+    case qb3_dtype::QB3_F32:
         p->error = ENC(uint32_t); break;
     case qb3_dtype::QB3_U64:
     case qb3_dtype::QB3_I64:
+    case qb3_dtype::QB3_F64:
         p->error = ENC(uint64_t); break;
     default:
         p->error = QB3E_EINV; // Invalid type
@@ -533,6 +1641,20 @@ size_t qb3_encode(encsp p, void* source, void* destination) {
 #undef ENC
 
     auto len = (s.position() + 7) / 8; // current output position in bytes
+    // Strip checksums, over the encoded streams, before RLE or LZ
+    // Each strip ends at the byte which holds its last bit, the last one at the end of the stream
+    if (p->crcs && !p->error) {
+        const size_t rows(strips.size() / (p->gsize ? p->ngroups : 1));
+        size_t start(data_position);
+        for (size_t g = 0, i = 0; g < (p->gsize ? p->ngroups : 1); g++) {
+            const size_t end(p->gsize ? start + p->gsize[g] : len);
+            for (size_t r = 0; r < rows; r++, i++) {
+                const size_t e((r + 1 == rows) ? end : strips[i] / 8);
+                crcs[i] = crc32c(d + start, e - start);
+                start = e;
+            }
+        }
+    }
     if (rle) {
         p->mode = mode; // restore the user selected mode that includes RLE
         if (p->error) // Bail out if there was an error
@@ -540,7 +1662,8 @@ size_t qb3_encode(encsp p, void* source, void* destination) {
 
         // Skip RLE if the compression is poor, this is a vague limit
         // RLE is only efficient if data is const, which generates a 8:1 compression ratio
-        if (len <= qb3_max_encoded_size(p) / 2) {
+        // The decoder rejects RLE data larger than the raw image, store it instead
+        if (len <= qb3_max_encoded_size(p) / 2 && len < raw_size(p)) {
             auto data_size = len - data_position; // Exclude the headers, they will be rewritten
             auto available = qb3_max_encoded_size(p) - len;
             auto rle_size = RLE0Size(d + data_position, data_size);
@@ -565,10 +1688,102 @@ size_t qb3_encode(encsp p, void* source, void* destination) {
         }
     }
 
+    if (lz) {
+        p->mode = mode; // restore the user selected mode that includes LZ
+        if (p->error)
+            return 0;
+        // The decoder rejects LZ data larger than the raw image, store it instead
+        auto data_size = len - data_position; // Exclude the headers, they will be rewritten
+        auto available = qb3_max_encoded_size(p) - len;
+        if (len < raw_size(p) && LZBound(data_size) <= available) {
+            // Encode it at the end of the data, keep it only if it is smaller
+            auto lz_size = LZ(d + data_position, data_size, d + len);
+            if (lz_size < data_size) {
+                oBits slz(d);
+                write_headers(p, slz);
+                if (p->error)
+                    return 0;
+                // The headers are the same size, the LZ data is after the end of the QB3 data
+                memcpy(d + slz.tobyte(), d + len, lz_size);
+                return slz.tobyte() + lz_size;
+            }
+        }
+    }
+
     if (p->error)
         return 0;
     // Maybe stored mode is better
-    if (raw_size(p) > len)
+    if (raw_size(p) > len) {
+        // Rewrite the headers with the group stream sizes, the rung summary and the checksums, the size doesn't change
+        if (p->gsize || p->rungs || p->crcs) {
+            p->mode = emode; // RLE or LZ were not used
+            oBits sg(d);
+            write_headers(p, sg);
+            p->mode = mode;
+        }
         return s.tobyte();
+    }
     return stored_encode(p, source, destination);
 }
+
+size_t qb3_encode(encsp p, void* source, void* destination) {
+    // Key frames don't use the reference, starting with the first one
+    // The searched scanning curve is only used for this image
+    auto const ref = p->ref;
+    auto const order = p->order;
+    if (p->keyint && 0 == p->frame % p->keyint)
+        p->ref = nullptr;
+    p->frame++;
+    reset_state(p);
+    auto len = encode(p, source, destination);
+    p->ref = ref;
+    p->order = order;
+    p->pal = nullptr; // Only valid during encode
+    p->rs = nullptr;
+    p->mask = nullptr;
+    p->gsize = nullptr;
+    p->ngroups = 0;
+    p->bstats = nullptr;
+    p->rungs = nullptr;
+    p->strips = nullptr;
+    p->crcs = nullptr;
+    return len;
+}
+
+// Same as qb3_encode up to the data, when encode_fast does the rest
+// No reference frame or key frames, no transforms, no extra chunks, no padding and 4x4 blocks
+size_t qb3_encode_direct(encsp p, void* destination) {
+    if (p->error || !is_fast(p->mode) || is_float(p->type) || p->quanta > 1 || p->ref || p->keyint
+        || p->linear || p->palette || p->search || p->nodata || p->adaptive || p->planar
+        || p->stats || p->summary || p->checksum
+        || p->xsize < B || p->ysize < B || p->xsize * p->ysize <= B2 || B != block_size(*p))
+        return 0;
+    reset_state(p);
+    p->mseq = 0;
+    oBits s(reinterpret_cast<uint8_t*>(destination));
+    write_headers(p, s);
+    return p->error ? 0 : s.tobyte();
+}
+
+// Sequence index, placed after the last frame
+// Frame offsets as 64bit values, followed by the 32bit frame count, the key frame interval
+// and the signature, all little endian
+size_t qb3_seq_index_size(size_t nframes) {
+    return nframes * 8 + 12;
+}
+
+size_t qb3_seq_write_index(void* destination, size_t nframes, const size_t* sizes, size_t interval) {
+    if (0 == nframes || nframes > 0xffffffffull || interval > 0xffffffffull)
+        return 0;
+    oBits s(reinterpret_cast<uint8_t*>(destination));
+    uint64_t offset(0);
+    for (size_t i = 0; i < nframes; i++) {
+        s.push(offset, 64);
+        offset += sizes[i];
+    }
+    s.push(nframes, 32);
+    s.push(interval, 32);
+    push_sig("QB", s);
+    push_sig("3I", s);
+    return s.tobyte();
+}
@@ -15,7 +15,15 @@ limitations under the License.
 Contributors:  Lucian Plesea
 */
 
+#if !defined(QB3ENCODE_H)
+#define QB3ENCODE_H
 #include "QB3common.h"
+#include <vector>
+
+// For the C++ API in QB3.hpp, which calls encode_fast directly
+// Starts an image and writes the headers, returns their size, the data follows
+// Returns 0 if the settings need more than encode_fast, use qb3_encode instead
+LIBQB3_EXPORT size_t qb3_encode_direct(encsp p, void* destination);
 
 namespace QB3 {
 // Encoding tables for rungs up to 8, for speedup. Rung 0 and 1 are special
@@ -88,9 +96,6 @@ static const uint16_t csw6[] = { 0x1000, 0x6001, 0x6009, 0x6011, 0x6019, 0x6021,
 0x803f, 0x802f, 0x801f, 0x800f, 0x707b, 0x706b, 0x705b, 0x704b, 0x703b, 0x702b, 0x701b, 0x700b, 0x603d, 0x6035, 0x602d, 0x6025,
 0x601d, 0x6015, 0x600d, 0x6005 };
 
-// Absolute from mag-sign
-template<typename T> static T magsabs(T v) { return (v >> 1) + (v & 1); }
-
 // integer divide count(in magsign) by cf(normal, positive)
 template<typename T> static T magsdiv(T val, T cf) {return ((magsabs(val) / cf) << 1) - (val & 1);}
 
@@ -178,7 +183,7 @@ static void groupencode(T group[B2], T bitsused, oBits& s, uint64_t acc, size_t
         s.push(acc, abits);
         acc = abits = 0;
     }
-    auto t = CRG[rung];
+    auto t = CRG[rung & 7]; // Only used for rungs below 8
     // For small tables, it's faster to encode with separate values
     if (rung == 1) { // 2 bits per value
         // Swap middle input values
@@ -362,7 +367,7 @@ static void cfgenc(const T igrp[B2], T cf, T pcf, size_t oldrung, oBits& bits) {
 
 // Check that the parameters are valid
 static int check_info(const encs& info) {
-    if (info.xsize < 4 || info.xsize > 0x10000 || info.ysize < 4 || info.ysize > 0x10000
+    if (info.xsize < 4 || info.xsize > QB3_MAXSIZE || info.ysize < 4 || info.ysize > QB3_MAXSIZE
         || info.nbands < 1 || info.nbands > QB3_MAXBANDS)
         return 1;
     // Check band mapping
@@ -372,21 +377,43 @@ static int check_info(const encs& info) {
     return 0;
 }
 
+// Keep the bits of the largest residual of a block, rungs is the current block row or nullptr
+template<typename T>
+static void keep_rung(uint8_t* rungs, size_t c, T bitsused) {
+    if (rungs && bitsused && rungs[c] <= topbit(bitsused))
+        rungs[c] = static_cast<uint8_t>(topbit(bitsused) + 1);
+}
+
 // Only basic encoding
-template<typename T, bool SKIPSTEP>
+// BS is the block size, the 8x8 blocks are encoded as four B2 groups at the same rung, without the step
+// NB is the number of bands when the layout and the band mapping are the default ones, see fixed_bands
+template<typename T, bool SKIPSTEP, size_t BS = B, size_t NB = 0>
 static int encode_fast(const T* image, oBits& s, encs &info)
 {
+    constexpr size_t BB(BS * BS); // Values per block
     static_assert(std::is_integral<T>() && std::is_unsigned<T>(), "Only unsigned integer types allowed");
     constexpr size_t UBITS = sizeof(T) == 1 ? 3 : sizeof(T) == 2 ? 4 : sizeof(T) == 4 ? 5 : 6;
     constexpr auto csw = sizeof(T) == 1 ? csw3 : sizeof(T) == 2 ? csw4 : sizeof(T) == 4 ? csw5 : csw6;
 
     if (check_info(info))
         return check_info(info);
-    const size_t xsize(info.xsize), ysize(info.ysize), bands(info.nbands), *cband(info.cband);
+    if (0 == NB) {
+        switch (fixed_bands(info)) {
+        case 1: return encode_fast<T, SKIPSTEP, BS, 1>(image, s, info);
+        case 3: return encode_fast<T, SKIPSTEP, BS, 3>(image, s, info);
+        case 4: return encode_fast<T, SKIPSTEP, BS, 4>(image, s, info);
+        }
+    }
+    const size_t xsize(info.xsize), ysize(info.ysize), bands(NB ? NB : info.nbands), *cband(info.cband);
+    // Linear inter-band prediction
+    const bool linear(info.linear);
+    const size_t sh(lpshift<T>(info.type));
+    // Adaptive rung switch, not used by the fastest mode
+    const bool adaptive(!SKIPSTEP && info.rs);
     // Running code length, start with nominal value
-    size_t runbits[QB3_MAXBANDS] = {};
+    std::vector<size_t> runbits(bands);
     // Previous value, per band
-    T prev[QB3_MAXBANDS] = {};
+    std::vector<T> prev(bands);
     // Initialize stage
     for (size_t c = 0; c < bands; c++) {
         runbits[c] = info.band[c].runbits;
@@ -397,71 +424,112 @@ static int encode_fast(const T* image, oBits& s, encs &info)
     uint64_t order(info.order);
     if (0 == order)
         order = HILBERT;
-    size_t offset[B2] = {};
-    auto stride = xsize * bands; // Line stride
-    if (info.stride)
-        stride = info.stride;
-    for (size_t i = 0; i < B2; i++) {
-        size_t n = (order >> ((B2 - 1 - i) << 2));
-        offset[i] = stride * ((n >> 2) & 0b11) + (n & 0b11) * bands;
-    }
-    T group[B2] = {};
-    for (size_t y = 0; y < ysize; y += B) {
+    size_t offset[BB] = {};
+    const size_t stride(line_stride(info)), pstride(NB ? NB : pixel_stride(info));
+    const std::vector<size_t> boff(band_offsets(info));
+    block_offsets<BS>(offset, order, stride, pstride);
+    T group[BB] = {};
+    // NoData blocks are skipped, the decoder fills them
+    const uint64_t* mask(info.mask);
+    size_t mseq(info.mseq);
+    const size_t bx((xsize + BS - 1) / BS);
+    for (size_t y = 0; y < ysize; y += BS) {
         // If the last row is partial, roll it up
-        if (y + B > ysize)
-            y = ysize - B;
-        for (size_t x = 0; x < xsize; x += B) {
+        if (y + BS > ysize)
+            y = ysize - BS;
+        const size_t row(mseq / bx);
+        // Rung summary of the block row
+        uint8_t* const rungs(info.rungs ? info.rungs + row * bands : nullptr);
+        for (size_t x = 0; x < xsize; x += BS, mseq++) {
             // If the last column is partial, move it left
-            if (x + B > xsize)
-                x = xsize - B;                
-            const size_t loc = y * stride + x * bands; // Top-left pixel address
+            if (x + BS > xsize)
+                x = xsize - BS;
+            if (mask && is_masked(mask, mseq))
+                continue;
+            const size_t loc = y * stride + x * pstride; // Top-left pixel address
             for (size_t c = 0; c < bands; c++) { // blocks are band interleaved
+                const size_t cb(NB ? dcband(NB, c) : cband[c]);
+                const size_t oc(NB ? c : boff[c]), ocb(NB ? cb : boff[cb]);
                 T bitsused(0); // Bits used within this group
                 // Collect the block for this band, convert to running delta mag-sign
                 auto prv = prev[c];
                 // Use separate loop for basebands to avoid a test inside the hot loop
-                if (c != cband[c]) {
-                    auto cb = cband[c];
-                    for (size_t i = 0; i < B2; i++) {
-                        T g = image[loc + c + offset[i]] - image[loc + cb + offset[i]];
-                        prv += g -= prv;
-                        bitsused |= group[i] = mags(g);
+                if (c != cb) {
+                    if (!linear) {
+                        for (size_t i = 0; i < BB; i++) {
+                            T g = image[loc + oc + offset[i]] - image[loc + ocb + offset[i]];
+                            prv += g -= prv;
+                            bitsused |= group[i] = mags(g);
+                        }
+                    }
+                    else { // Linear prediction from the core band
+                        auto const& lp = info.lp[c];
+                        for (size_t i = 0; i < BB; i++) {
+                            T g = image[loc + oc + offset[i]] - lpred(image[loc + ocb + offset[i]], lp, sh);
+                            prv += g -= prv;
+                            bitsused |= group[i] = mags(g);
+                        }
                     }
                 }
                 else { // baseband
-                    for (size_t i = 0; i < B2; i++) {
-                        T g = image[loc + c + offset[i]];
+                    for (size_t i = 0; i < BB; i++) {
+                        T g = image[loc + oc + offset[i]];
                         prv += g -= prv;
                         bitsused |= group[i] = mags(g);
                     }
                 }
                 prev[c] = prv;
-                uint64_t acc = csw[(topbit(bitsused | 1) - runbits[c]) & ((1ull << UBITS) - 1)];
-                groupencode<T, SKIPSTEP>(group, bitsused, s, acc & TBLMASK, static_cast<size_t>(acc >> 12));
+                auto sw = (topbit(bitsused | 1) - runbits[c]) & ((1ull << UBITS) - 1);
+                if (adaptive) {
+                    auto delta = sw;
+                    sw = rs_encode(info.rs[c], delta, UBITS);
+                    rs_update(info.rs[c], delta, UBITS);
+                }
+                uint64_t acc = csw[sw];
+                groupencode<T, SKIPSTEP || BS != B>(group, bitsused, s, acc & TBLMASK, static_cast<size_t>(acc >> 12));
+                for (size_t i = B2; i < BB; i += B2)
+                    groupencode<T, true>(group + i, bitsused, s, 0, 0);
                 runbits[c] = topbit(bitsused | 1);
+                keep_rung(rungs, c, bitsused);
             }
         }
+        if (info.strips) // End of the block row strip
+            info.strips[row] = s.position();
     }
     // Save the state, in case of multiple stripes
     for (size_t c = 0; c < bands; c++) {
         info.band[c].prev = static_cast<size_t>(prev[c]);
         info.band[c].runbits = runbits[c];
     }
+    info.mseq = mseq;
     return 0;
 }
 
 // Implementation of encode_fast for uint8_t
-template<bool SKIPSTEP>
+// NB is the number of bands when the layout and the band mapping are the default ones, see fixed_bands
+template<bool SKIPSTEP, size_t NB = 0>
 static int ef(const uint8_t* image, oBits& s, encs& info) {
     constexpr size_t UBITS(3);
 
     if (check_info(info))
         return check_info(info);
-    const size_t xsize(info.xsize), ysize(info.ysize), bands(info.nbands), * cband(info.cband);
+    if (0 == NB) {
+        switch (fixed_bands(info)) {
+        case 1: return ef<SKIPSTEP, 1>(image, s, info);
+        case 3: return ef<SKIPSTEP, 3>(image, s, info);
+        case 4: return ef<SKIPSTEP, 4>(image, s, info);
+        }
+    }
+    const size_t xsize(info.xsize), ysize(info.ysize), bands(NB ? NB : info.nbands), * cband(info.cband);
+    // Linear inter-band prediction
+    const bool linear(info.linear);
+    const size_t sh(lpshift<uint8_t>(info.type));
+    // Adaptive rung switch, not used by the fastest mode
+    const bool adaptive(!SKIPSTEP && info.rs);
     // Running code length, start with nominal value
-    size_t runbits[QB3_MAXBANDS] = {};
+    std::vector<size_t> runbits(bands);
     // Previous value, per band
-    uint8_t prev[QB3_MAXBANDS] = {};
+    std::vector<uint8_t> prev(bands);
     // Initialize stage
     for (size_t c = 0; c < bands; c++) {
         runbits[c] = info.band[c].runbits;
@@ -473,55 +541,84 @@ static int ef(const uint8_t* image, oBits& s, encs& info) {
     if (0 == order)
         order = HILBERT;
     size_t offset[B2] = {};
-    auto stride = xsize * bands; // Line stride
-    if (info.stride)
-        stride = info.stride;
+    const size_t stride(line_stride(info)), pstride(NB ? NB : pixel_stride(info));
+    const std::vector<size_t> boff(band_offsets(info));
     for (size_t i = 0; i < B2; i++) {
         size_t n = (order >> ((B2 - 1 - i) << 2));
-        offset[i] = stride * ((n >> 2) & 0b11) + (n & 0b11) * bands;
+        offset[i] = stride * ((n >> 2) & 0b11) + (n & 0b11) * pstride;
     }
     uint8_t group[B2] = {};
+    // NoData blocks are skipped, the decoder fills them
+    const uint64_t* mask(info.mask);
+    size_t mseq(info.mseq);
+    const size_t bx((xsize + B - 1) / B);
     for (size_t y = 0; y < ysize; y += B) {
         // If the last row is partial, roll it up
         if (y + B > ysize)
             y = ysize - B;
-        for (size_t x = 0; x < xsize; x += B) {
+        const size_t row(mseq / bx);
+        // Rung summary of the block row
+        uint8_t* const rungs(info.rungs ? info.rungs + row * bands : nullptr);
+        for (size_t x = 0; x < xsize; x += B, mseq++) {
             // If the last column is partial, move it left
             if (x + B > xsize)
                 x = xsize - B;
-            const size_t loc = y * stride + x * bands; // Top-left pixel address
+            if (mask && is_masked(mask, mseq))
+                continue;
+            const size_t loc = y * stride + x * pstride; // Top-left pixel address
             for (size_t c = 0; c < bands; c++) { // blocks are band interleaved
+                const size_t cb(NB ? dcband(NB, c) : cband[c]);
+                const size_t oc(NB ? c : boff[c]), ocb(NB ? cb : boff[cb]);
                 uint8_t bitsused(0); // Bits used within this group
                 // Collect the block for this band, convert to running delta mag-sign
                 auto prv = prev[c];
                 // Use separate loop for basebands to avoid a test inside the hot loop
-                if (c != cband[c]) {
-                    auto cb = cband[c];
-                    for (size_t i = 0; i < B2; i++) {
-                        uint8_t g = image[loc + c + offset[i]] - image[loc + cb + offset[i]];
-                        prv += g -= prv;
-                        bitsused |= group[i] = mags(g);
+                if (c != cb) {
+                    if (!linear) {
+                        for (size_t i = 0; i < B2; i++) {
+                            uint8_t g = image[loc + oc + offset[i]] - image[loc + ocb + offset[i]];
+                            prv += g -= prv;
+                            bitsused |= group[i] = mags(g);
+                        }
+                    }
+                    else { // Linear prediction from the core band
+                        auto const& lp = info.lp[c];
+                        for (size_t i = 0; i < B2; i++) {
+                            uint8_t g = image[loc + oc + offset[i]] - lpred(image[loc + ocb + offset[i]], lp, sh);
+                            prv += g -= prv;
+                            bitsused |= group[i] = mags(g);
+                        }
                     }
                 }
                 else { // baseband
                     for (size_t i = 0; i < B2; i++) {
-                        uint8_t g = image[loc + c + offset[i]];
+                        uint8_t g = image[loc + oc + offset[i]];
                         prv += g -= prv;
                         bitsused |= group[i] = mags(g);
                     }
                 }
                 prev[c] = prv;
-                uint64_t acc = csw3[(topbit(bitsused | 1) - runbits[c]) & ((1ull << UBITS) - 1)];
+                auto sw = (topbit(bitsused | 1) - runbits[c]) & ((1ull << UBITS) - 1);
+                if (adaptive) {
+                    auto delta = sw;
+                    sw = rs_encode(info.rs[c], delta, UBITS);
+                    rs_update(info.rs[c], delta, UBITS);
+                }
+                uint64_t acc = csw3[sw];
                 groupencode<uint8_t, SKIPSTEP>(group, bitsused, s, acc & TBLMASK, static_cast<size_t>(acc >> 12));
                 runbits[c] = topbit(bitsused | 1);
+                keep_rung(rungs, c, bitsused);
             }
         }
+        if (info.strips) // End of the block row strip
+            info.strips[row] = s.position();
     }
     // Save the state, in case of multiple stripes
     for (size_t c = 0; c < bands; c++) {
         info.band[c].prev = static_cast<size_t>(prev[c]);
         info.band[c].runbits = runbits[c];
     }
+    info.mseq = mseq;
     return 0;
 }
 
@@ -561,7 +658,7 @@ static size_t ienc(const T grp[B2], size_t rung, size_t oldrung, oBits &s) {
     for (int i = 0; i < B2; i++) {
         size_t j = 0;
         while (j < len && v[j].value != grp[i])
-            if (++j >= B2 / 2) return 800; // Large, non-repeating group
+            if (++j >= B2 / 2) return ~size_t(0); // Large, non-repeating group
         if (j == len)
             v[len++] = { 1, grp[i] };
         else
@@ -612,20 +709,115 @@ static size_t ienc(const T grp[B2], size_t rung, size_t oldrung, oBits &s) {
     return s.position();
 }
 
+// Block copy, signalled as an index encoding at rung 0, which is never used by ienc
+// Followed by a zero bit for the block above, or by a one bit and the distance in blocks,
+// as the 5 bit position of the top bit followed by the rest of the bits
+template<typename T>
+static void copyenc(size_t dist, size_t oldrung, oBits& s) {
+    constexpr uint16_t SIGNAL[] = { 0x0, 0x0, 0x0, 0x5017, 0x6037, 0x7077, 0x80f7 };
+    constexpr size_t UBITS = sizeof(T) == 1 ? 3 : sizeof(T) == 2 ? 4 : sizeof(T) == 4 ? 5 : 6;
+    constexpr auto NORM_MASK((1ull << UBITS) - 1); // UBITS set
+    constexpr auto csw = sizeof(T) == 1 ? csw3 : sizeof(T) == 2 ? csw4 : sizeof(T) == 4 ? csw5 : csw6;
+
+    uint64_t acc = SIGNAL[UBITS] & TBLMASK;
+    size_t abits = UBITS + 2; // SIGNAL >> 12
+    // Switch to max rung, the index encoding signal, then to rung 0
+    for (auto rung : { NORM_MASK, 0ull }) {
+        auto cs = csw[(rung - oldrung) & NORM_MASK];
+        if ((cs >> 12) == 1) // no-switch, use signal instead, it decodes to delta of zero
+            cs = SIGNAL[UBITS];
+        acc |= (cs & (TBLMASK - 1)) << (abits - 1);
+        abits += static_cast<size_t>((cs >> 12) - 1);
+    }
+    s.push(acc, abits);
+    if (0 == dist) { // The block above
+        s.push(0u, 1);
+        return;
+    }
+    auto nb = topbit(dist);
+    s.push(1u | (nb << 1), 6);
+    s.push(dist ^ (1ull << nb), nb);
+}
+
+// Hash of the block values, for block copy
+template<typename T>
+static size_t bhash(const T blk[B2], size_t c, size_t bits) {
+    uint64_t h = c;
+    for (size_t i = 0; i < B2; i++)
+        h = (h ^ blk[i]) * 0x9e3779b97f4a7c15ull;
+    return static_cast<size_t>(h >> (64 - bits));
+}
+
+// Encodes a group using the shortest of the normal, CF and index encodings
+// Updates the running rung and the previous cf, idxs is scratch space
+// The normal encoding uses the adaptive rung switch code when rs is not null, the caller updates it
+template<typename T>
+static void bestenc(T group[B2], T bitsused, size_t& runbits, T& pcf, oBits& s, oBits& idxs,
+    const rswitch* rs = nullptr) {
+    constexpr size_t UBITS = sizeof(T) == 1 ? 3 : sizeof(T) == 2 ? 4 : sizeof(T) == 4 ? 5 : 6;
+    constexpr auto csw = sizeof(T) == 1 ? csw3 : sizeof(T) == 2 ? csw4 : sizeof(T) == 4 ? csw5 : csw6;
+    auto oldrung = runbits;
+    auto rung = topbit(bitsused | 1);
+    runbits = rung;
+    auto sw = (rung - oldrung) & ((1ull << UBITS) - 1);
+    if (rs)
+        sw = rs_encode(*rs, sw, UBITS);
+    if (1 >= bitsused) { // only 1s and 0s, rung is -1 or 0, no cf
+        uint64_t acc = csw[sw];
+        size_t abits = acc >> 12;
+        acc &= TBLMASK;
+        acc |= static_cast<uint64_t>(bitsused) << abits++; // Add the all-zero flag
+        if (0 != bitsused)
+            for (size_t i = 0; i < B2; i++)
+                acc |= static_cast<uint64_t>(group[i]) << abits++;
+        s.push(acc, abits);
+        return;
+    }
+
+    auto cf = gcf(group);
+    auto start = s.position();
+    if (cf >= 2) 
+        cfgenc(group, cf, pcf, oldrung, s);
+    else
+    {
+        auto acc = csw[sw];
+        groupencode(group, bitsused, s, acc & TBLMASK, acc >> 12);
+    }
+    // Try index encoding
+    size_t size(s.position() - start);
+    if (rung > 3 && rung < 63 && size >= (36 + 3 * UBITS + 2 * rung)) {
+        idxs.rewind();
+        auto idx = ienc(group, rung, oldrung, idxs);
+        if (idx < size) {
+            s.rewind(start);
+            s += idxs;
+        }
+        else if (cf > 1 && pcf != cf - 2)
+            pcf = cf - 2;
+    }
+    else if (cf > 1 && pcf != cf - 2)
+        pcf = cf - 2;
+}
+
 // Returns error code or 0 if success
 // TODO: Error code mapping
 template <typename T = uint8_t>
 static int encode_best(const T *image, oBits& s, encs &info) {
     static_assert(std::is_integral<T>() && std::is_unsigned<T>(), "Only unsigned integer types");
     constexpr size_t UBITS = sizeof(T) == 1 ? 3 : sizeof(T) == 2 ? 4 : sizeof(T) == 4 ? 5 : 6;
-    constexpr auto csw = sizeof(T) == 1 ? csw3 : sizeof(T) == 2 ? csw4 : sizeof(T) == 4 ? csw5 : csw6;
+    constexpr auto NORM_MASK((1ull << UBITS) - 1); // UBITS set
     if (check_info(info))
         return check_info(info);
+    // Adaptive rung switch state, or nullptr
+    rswitch* const rs(info.rs);
     const size_t xsize(info.xsize), ysize(info.ysize), bands(info.nbands), *cband(info.cband);
+    // Linear inter-band prediction
+    const bool linear(info.linear);
+    const size_t sh(lpshift<T>(info.type));
     // Running code length, start with nominal value
-    size_t runbits[QB3_MAXBANDS] = {};
+    std::vector<size_t> runbits(bands);
     // Previous values, per band
-    T prev[QB3_MAXBANDS] = {}, pcf[QB3_MAXBANDS] = {};
+    std::vector<T> prev(bands), pcf(bands);
     uint8_t buffer[128] = {};
     oBits idxs(buffer);
     for (size_t c = 0; c < bands; c++) {
@@ -636,83 +828,141 @@ static int encode_best(const T *image, oBits& s, encs &info) {
     // Set up block offsets based on traversal order, defaults to HILBERT
     const uint64_t order(info.order ? info.order : HILBERT);
     size_t offset[B2] = {};
-    auto stride = xsize * bands; // Line stride
-    if (info.stride)
-        stride = info.stride; // Custom stride
+    const size_t stride(line_stride(info)), pstride(pixel_stride(info));
+    const std::vector<size_t> boff(band_offsets(info));
     for (size_t i = 0; i < B2; i++) {
         size_t n = (order >> ((B2 - 1 - i) << 2));
-        offset[i] = stride * ((n >> 2) & 0b11) + (n & 0b11) * bands;
+        offset[i] = stride * ((n >> 2) & 0b11) + (n & 0b11) * pstride;
     }
     T group[B2] = {}; // 2D group to encode
-    for (size_t y = 0; y < ysize; y += B) {
+    // Block copy, from the current or the previous block row, the sources are found by hash
+    // Blocks are numbered in raster order, seq is the current one
+    constexpr size_t CHBITS(12);
+    const bool copy(info.blockcopy);
+    const size_t bx((xsize + B - 1) / B);
+    std::vector<size_t> chash(copy ? (1ull << CHBITS) : 0, ~size_t(0));
+    // With info.above, the first block row is the previous strip, already encoded
+    // It is only used as a block copy source
+    const size_t y0(info.above ? B : 0);
+    size_t seq(info.above ? bx : 0);
+    // NoData blocks are skipped, the mask index continues from the previous strip
+    const uint64_t* mask(info.mask);
+    const size_t mseq(info.mseq - seq);
+    // Values of band c for the block at loc, in scan order, as seen by the decoder before the band mapping is removed
+    auto bvalues = [&](size_t loc, size_t c, T* blk) {
+        auto cb = cband[c];
+        const size_t oc(boff[c]), ocb(boff[cb]);
+        for (size_t i = 0; i < B2; i++) {
+            T v = image[loc + oc + offset[i]];
+            if (c != cb)
+                v -= linear ? lpred(image[loc + ocb + offset[i]], info.lp[c], sh) : image[loc + ocb + offset[i]];
+            blk[i] = v;
+        }
+    };
+    // Distance to a block with the same values, 0 if none is found
+    auto find_copy = [&](size_t c, const T* blk) -> size_t {
+        T cand[B2];
+        size_t first = (seq >= bx) ? (seq / bx - 1) * bx : 0; // Start of the previous block row
+        auto h = bhash(blk, c, CHBITS);
+        size_t k = chash[h];
+        chash[h] = seq;
+        if (seq >= bx && !(mask && is_masked(mask, mseq + seq - bx))) { // Check the block above first, it has the shortest code
+            bvalues(block_loc(seq - bx, bx, xsize, ysize, stride, pstride), c, cand);
+            if (0 == memcmp(cand, blk, sizeof(cand)))
+                return bx;
+        }
+        if (k == ~size_t(0) || k < first || k >= seq)
+            return 0;
+        bvalues(block_loc(k, bx, xsize, ysize, stride, pstride), c, cand);
+        return memcmp(cand, blk, sizeof(cand)) ? 0 : seq - k;
+    };
+    if (copy && info.above) // Hash the blocks of the previous strip
+        for (size_t k = 0; k < bx; k++) {
+            if (mask && is_masked(mask, mseq + k))
+                continue;
+            for (size_t c = 0; c < bands; c++) {
+                T blk[B2];
+                bvalues(block_loc(k, bx, xsize, ysize, stride, pstride), c, blk);
+                chash[bhash(blk, c, CHBITS)] = k;
+            }
+        }
+    for (size_t y = y0; y < ysize; y += B) {
         // If the last row is partial, roll it up
         if (y + B > ysize)
             y = ysize - B;
-        for (size_t x = 0; x < xsize; x += B) {
+        const size_t row((mseq + seq) / bx);
+        // Rung summary of the block row
+        uint8_t* const rungs(info.rungs ? info.rungs + row * bands : nullptr);
+        for (size_t x = 0; x < xsize; x += B, seq++) {
             // If the last column is partial, move it left
             if (x + B > xsize)
                 x = xsize - B;
-            size_t loc = y * stride + x * bands; // Top-left pixel address
+            if (mask && is_masked(mask, mseq + seq))
+                continue;
+            size_t loc = y * stride + x * pstride; // Top-left pixel address
             for (size_t c = 0; c < bands; c++) { // blocks are always band interleaved
+                const size_t oc(boff[c]), ocb(boff[cband[c]]);
                 T bitsused(0); // Bits used within this group
                 // Collect the block for this band, convert to running delta mag-sign
                 auto prv = prev[c];
                 if (c != cband[c]) {
-                    auto cb = cband[c];
-                    for (size_t i = 0; i < B2; i++) {
-                        T g = image[loc + c + offset[i]] - image[loc + cb + offset[i]];
-                        prv += g -= prv;
-                        bitsused |= group[i] = mags(g);
+                    if (!linear) {
+                        for (size_t i = 0; i < B2; i++) {
+                            T g = image[loc + oc + offset[i]] - image[loc + ocb + offset[i]];
+                            prv += g -= prv;
+                            bitsused |= group[i] = mags(g);
+                        }
+                    }
+                    else { // Linear prediction from the core band
+                        auto const& lp = info.lp[c];
+                        for (size_t i = 0; i < B2; i++) {
+                            T g = image[loc + oc + offset[i]] - lpred(image[loc + ocb + offset[i]], lp, sh);
+                            prv += g -= prv;
+                            bitsused |= group[i] = mags(g);
+                        }
                     }
                 }
                 else {
                     for (size_t i = 0; i < B2; i++) {
-                        T g = image[loc + c + offset[i]];
+                        T g = image[loc + oc + offset[i]];
                         prv += g -= prv;
                         bitsused |= group[i] = mags(g);
                     }
                 }
                 prev[c] = prv;
-                auto oldrung = runbits[c];
-                auto rung = topbit(bitsused | 1);
-                runbits[c] = rung;
-                if (1 >= bitsused) { // only 1s and 0s, rung is -1 or 0, no cf
-                    uint64_t acc = csw[(rung - oldrung) & ((1ull << UBITS) - 1)];
-                    size_t abits = acc >> 12;
-                    acc &= TBLMASK;
-                    acc |= static_cast<uint64_t>(bitsused) << abits++; // Add the all-zero flag
-                    if (0 != bitsused)
-                        for (size_t i = 0; i < B2; i++)
-                            acc |= static_cast<uint64_t>(group[i]) << abits++;
-                    s.push(acc, abits);
-                    continue;
-                }
-
-                auto cf = gcf(group);
-                auto start = s.position();
-                if (cf >= 2) 
-                    cfgenc(group, cf, pcf[c], oldrung, s);
-                else
-                {
-                    auto acc = csw[(topbit(bitsused | 1) - oldrung) & ((1ull << UBITS) - 1)];
-                    groupencode(group, bitsused, s, acc & TBLMASK, acc >> 12);
-                }
-                // Try index encoding
-                size_t size(s.position() - start);
-                if (rung > 3 && rung < 63 && size >= (36 + 3 * UBITS + 2 * rung)) {
-                    idxs.rewind();
-                    auto idx = ienc(group, rung, oldrung, idxs);
-                    if (idx < size) {
-                        s.rewind(start);
-                        s += idxs;
+                keep_rung(rungs, c, bitsused);
+                // Local copies of the band state, bestenc updates them
+                const auto rung(runbits[c]);
+                const auto cf(pcf[c]);
+                auto rb(rung);
+                auto pc(cf);
+                if (!copy) {
+                    bestenc(group, bitsused, rb, pc, s, idxs, rs ? rs + c : nullptr);
+                } else {
+                    T blk[B2];
+                    bvalues(loc, c, blk);
+                    auto dist = find_copy(c, blk);
+                    auto start = s.position();
+                    bestenc(group, bitsused, rb, pc, s, idxs, rs ? rs + c : nullptr);
+                    if (dist) { // Use the copy if it is shorter, the decoder state is not changed
+                        idxs.rewind();
+                        copyenc<T>((dist == bx) ? 0 : dist, rung, idxs);
+                        if (idxs.position() < s.position() - start) {
+                            s.rewind(start);
+                            s += idxs;
+                            rb = rung;
+                            pc = cf;
+                        }
                     }
-                    else if (cf > 1 && pcf[c] != cf - 2)
-                        pcf[c] = cf - 2;
                 }
-                else if (cf > 1 && pcf[c] != cf - 2)
-                    pcf[c] = cf - 2;
+                runbits[c] = rb;
+                pcf[c] = pc;
+                if (rs)
+                    rs_update(rs[c], (rb - rung) & NORM_MASK, UBITS);
             }
         }
+        if (info.strips) // End of the block row strip
+            info.strips[row] = s.position();
     }
     // Save the state
     for (size_t c = 0; c < bands; c++) {
@@ -720,6 +970,94 @@ static int encode_best(const T *image, oBits& s, encs &info) {
         info.band[c].runbits = runbits[c];
         info.band[c].cf = static_cast<size_t>(pcf[c]);
     }
+    info.mseq = mseq + seq;
+    return 0;
+}
+// 2D MED prediction, fast or best group encoding
+// The residuals are computed in raster order within the block and encoded in the scan order
+template <typename T>
+static int encode_med(const T* image, oBits& s, encs& info) {
+    static_assert(std::is_integral<T>() && std::is_unsigned<T>(), "Only unsigned integer types");
+    constexpr size_t UBITS = sizeof(T) == 1 ? 3 : sizeof(T) == 2 ? 4 : sizeof(T) == 4 ? 5 : 6;
+    constexpr auto csw = sizeof(T) == 1 ? csw3 : sizeof(T) == 2 ? csw4 : sizeof(T) == 4 ? csw5 : csw6;
+    if (check_info(info))
+        return check_info(info);
+    const size_t xsize(info.xsize), ysize(info.ysize), bands(info.nbands);
+    const bool best(QB3M_MED_BEST == info.mode);
+    // Adaptive rung switch state, or nullptr
+    rswitch* const rs(info.rs);
+    std::vector<size_t> runbits(bands);
+    std::vector<T> pcf(bands);
+    uint8_t buffer[128] = {};
+    oBits idxs(buffer);
+    for (size_t c = 0; c < bands; c++) {
+        runbits[c] = info.band[c].runbits;
+        pcf[c] = static_cast<T>(info.band[c].cf);
+    }
+    // Raster position within the block, in scan order
+    const uint64_t order(info.order ? info.order : HILBERT);
+    size_t scan[B2] = {};
+    for (size_t i = 0; i < B2; i++)
+        scan[i] = (order >> ((B2 - 1 - i) << 2)) & 0xf;
+    const size_t stride(line_stride(info)), pstride(pixel_stride(info));
+    T group[B2] = {}, rsd[B2] = {};
+    T w[B + 1][B + 1] = {}; // Prediction window, the top row and left column are the neighbours
+    for (size_t y = 0, row = 0; y < ysize; y += B, row++) {
+        // If the last row is partial, roll it up
+        if (y + B > ysize)
+            y = ysize - B;
+        // Rung summary of the block row, the whole image is encoded at once
+        uint8_t* const rungs(info.rungs ? info.rungs + row * bands : nullptr);
+        for (size_t x = 0; x < xsize; x += B) {
+            // If the last column is partial, move it left
+            if (x + B > xsize)
+                x = xsize - B;
+            for (size_t c = 0; c < bands; c++) {
+                const medmap<T> m(info, c);
+                for (size_t j = (y ? 0 : 1); j <= B; j++)
+                    for (size_t i = (x ? 0 : 1); i <= B; i++)
+                        w[j][i] = m.to(image + (y + j - 1) * stride + (x + i - 1) * pstride);
+                if (0 == y)
+                    w[0][1] = 0; // Top-left corner, predict from zero
+                for (size_t j = 1; j <= B; j++) {
+                    auto r = rsd + (j - 1) * B;
+                    if (0 == x) // No left neighbour, use the top one
+                        w[j][0] = w[j - 1][1];
+                    if (1 == j && 0 == y) // No top neighbour, use the left one
+                        for (size_t i = 1; i <= B; i++)
+                            r[i - 1] = w[j][i] - w[j][i - 1];
+                    else
+                        for (size_t i = 1; i <= B; i++)
+                            r[i - 1] = w[j][i] - med(w[j][i - 1], w[j - 1][i], w[j - 1][i - 1]);
+                }
+                T bitsused(0);
+                for (size_t i = 0; i < B2; i++)
+                    bitsused |= group[i] = mags(rsd[scan[i]]);
+                keep_rung(rungs, c, bitsused);
+                auto rung(runbits[c]);
+                if (best)
+                    bestenc(group, bitsused, runbits[c], pcf[c], s, idxs, rs ? rs + c : nullptr);
+                else {
+                    auto sw = (topbit(bitsused | 1) - rung) & ((1ull << UBITS) - 1);
+                    if (rs)
+                        sw = rs_encode(rs[c], sw, UBITS);
+                    uint64_t acc = csw[sw];
+                    groupencode<T, false>(group, bitsused, s, acc & TBLMASK, static_cast<size_t>(acc >> 12));
+                    runbits[c] = topbit(bitsused | 1);
+                }
+                if (rs)
+                    rs_update(rs[c], (runbits[c] - rung) & ((1ull << UBITS) - 1), UBITS);
+            }
+        }
+        if (info.strips) // End of the block row strip
+            info.strips[row] = s.position();
+    }
+    // Save the state
+    for (size_t c = 0; c < bands; c++) {
+        info.band[c].runbits = runbits[c];
+        info.band[c].cf = static_cast<size_t>(pcf[c]);
+    }
     return 0;
 }
 } // namespace
+#endif
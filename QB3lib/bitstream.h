@@ -15,6 +15,8 @@ limitations under the License.
 Contributors:  Lucian Plesea
 */
 
+#if !defined(BITSTREAM_H)
+#define BITSTREAM_H
 #include <cinttypes>
 #include <cassert>
 #include <type_traits>
@@ -124,3 +126,4 @@ private:
     uint8_t *v;
     size_t bitp; // write position
 };
+#endif
@@ -38,14 +38,28 @@ struct options {
     options() :
         quanta(0),
         time(0),
+        ndv(0),
         best(false),
         trim(false),
         rle(false), // non-default RLE (off for best, on for fast)
         legacy(false), // legacy mode
         verbose(false),
         ftl(false),
+        linear(false),
+        med(false),
+        palette(false),
+        blockcopy(false),
+        lz(false),
+        adaptive(false),
+        big(false),
+        search(false),
+        nodata(false),
+        planar(false),
+        checksum(false),
         is_folder(false), // Input name is a folder
-        decode(false)
+        decode(false),
+        eight(false),
+        check(false)
     {};
 
     uint64_t quanta;
@@ -54,15 +68,29 @@ struct options {
     string error;
     string mapping; // band mapping, if provided
     double time;
+    double ndv; // NoData value
     bool best;
     bool trim; // Trim input to a multiple of 4x4 blocks
     bool rle; // Skip RLE
     bool legacy; // Legacy mode
     bool verbose;
     bool ftl; // Fastest compression
+    bool linear; // Linear band predictor
+    bool med; // 2D MED predictor
+    bool palette; // Per band palette
+    bool blockcopy; // Repeated block copy
+    bool lz; // LZ second stage instead of RLE
+    bool adaptive; // Adaptive rung switch codes
+    bool big; // 8x8 blocks
+    bool search; // Scanning curve search
+    bool nodata; // Skip the NoData blocks
+    bool planar; // Separate band group streams
+    bool checksum; // Strip checksums
     bool is_folder; // Input name is a folder
     bool away; // quantize away from zero
     bool decode;
+    bool eight; // 8 bit output when decoding 16 bit
+    bool check; // Validate the QB3 input, no output
 };
 
 int Usage(const options &opt) {
@@ -71,17 +99,30 @@ int Usage(const options &opt) {
         "Options:\n"
         "\t-v : verbose\n"
         "\t-d : decode from QB3\n"
+        "\t-e : with -d, 16 bit input is written as 8 bit PNG\n"
+        "\t-k : check the QB3 input without decoding it, no output\n"
         "\n"
         "Compression only options:\n"
         "\t-b : best compression\n"
         "\t-f : fastest compression\n"
+        "\t-g : 2D gradient (MED) predictor, with -b for best\n"
         "\t-l : legacy mode (deprecated)\n"
         "\t-q <n> : quanta\n"
         "\t-r : reverse RLE behavior, off for best, on for fast\n"
         "\t     RLE is only used if applicable\n"
+        "\t-z : LZ second stage, replaces RLE\n"
         "\t-t : trim input to multiple of 4x4 pixels\n"
         "\t-m <b,b,b> : core band mapping\n"
-        "\t-m x : exhaustive band mapping search\n\n"
+        "\t-m x : exhaustive band mapping search\n"
+        "\t-p : linear band predictor\n"
+        "\t-c : palette, for images with few distinct values\n"
+        "\t-s : block copy, for screen content, with -b\n"
+        "\t-a : adaptive rung switch codes\n"
+        "\t-8 : 8x8 blocks, for smooth high bit depth data\n"
+        "\t-o : search for the best scanning curve\n"
+        "\t-n <val> : NoData value, the blocks which only contain it are skipped\n"
+        "\t-i : independent band group streams\n"
+        "\t-x : strip checksums, checked when decoding\n\n"
         "\tIf input is a folder, all .png or .qb3 files will be processed\n"
         ;
     return 1;
@@ -118,6 +159,13 @@ bool parse_args(int argc, char** argv, options& opt) {
             case 'd':
                 opt.decode = true;
                 break;
+            case 'e':
+                opt.eight = true;
+                break;
+            case 'k':
+                opt.check = true;
+                opt.decode = true;
+                break;
             case 'f':
                 opt.ftl = true;
                 break;
@@ -153,6 +201,44 @@ bool parse_args(int argc, char** argv, options& opt) {
             case 'r':
                 opt.rle = true;
                 break;
+            case 'p':
+                opt.linear = true;
+                break;
+            case 'g':
+                opt.med = true;
+                break;
+            case 'c':
+                opt.palette = true;
+                break;
+            case 's':
+                opt.blockcopy = true;
+                break;
+            case 'z':
+                opt.lz = true;
+                break;
+            case 'a':
+                opt.adaptive = true;
+                break;
+            case '8':
+                opt.big = true;
+                break;
+            case 'o':
+                opt.search = true;
+                break;
+            case 'i':
+                opt.planar = true;
+                break;
+            case 'x':
+                opt.checksum = true;
+                break;
+            case 'n':
+                if (i + 1 >= argc) {
+                    opt.error = "NoData value missing";
+                    return false;
+                }
+                opt.nodata = true;
+                opt.ndv = strtod(argv[++i], nullptr);
+                break;
             default:
                 opt.error = "Uknown option provided";
                 return false;
@@ -204,6 +290,22 @@ bool parse_args(int argc, char** argv, options& opt) {
         opt.legacy = false;
     }
 
+    // MED has no legacy, RLE or LZ variants
+    if (opt.med) {
+        opt.ftl = false;
+        opt.rle = false;
+        opt.legacy = false;
+        opt.lz = false;
+    }
+
+    // LZ replaces RLE, there are no legacy or fast LZ variants
+    if (opt.lz) {
+        if (opt.ftl || opt.legacy)
+            opt.lz = false;
+        else
+            opt.rle = false;
+    }
+
     // If output file name is not provided, extract from input file name
     if (!opt.is_folder && opt.out_fname.empty()) {
         string fname(opt.in_fname);
@@ -247,6 +349,10 @@ const char *mode_string(qb3_mode m) {
     case QB3M_RLE: return "Legacy Base + RLE";
     case QB3M_CF_RLE: return "Legacy CF + RLE";
     case QB3M_FTL: return "Fast";
+    case QB3M_MED: return "MED";
+    case QB3M_MED_BEST: return "MED Best";
+    case QB3M_LZ_H: return "Base + LZ";
+    case QB3M_CF_LZ_H: return "Best + LZ";
     case QB3M_STORED: return "Stored";
     default:
         return "Unknown mode";
@@ -293,6 +399,13 @@ int decode_main(options& opts) {
             cout << "QB3 mode :" << mode_string(qb3_get_mode(qdec)) << endl;
             if (qb3_get_quanta(qdec) > 1)
                 cout << " Quanta " << qb3_get_quanta(qdec) << endl;
+            double ndv(0);
+            if (qb3_get_nodata(qdec, &ndv))
+                cout << " NoData " << ndv << endl;
+            if (qb3_get_planar(qdec))
+                cout << " Band group streams " << qb3_get_planar(qdec) << endl;
+            if (qb3_get_checksum(qdec))
+                cout << " Strip checksums" << endl;
             size_t bandmap[QB3_MAXBANDS] = {};
             if (bands > 1 && qb3_get_coreband(qdec, bandmap)) { // Why would it fail?
                 ostringstream bmap;
@@ -302,7 +415,27 @@ int decode_main(options& opts) {
                 cout << "Band mapping " << bmap.str() << endl;
             }
         }
+        if (opts.check) {
+            size_t offset(0);
+            auto t1 = high_resolution_clock::now();
+            bool valid = qb3_validate(qdec, &offset);
+            time_span = duration_cast<duration<double>>(high_resolution_clock::now() - t1).count();
+            if (!valid) {
+                opts.error = "Error in qb3 file data at byte " + to_string(offset);
+                throw 2;
+            }
+            if (opts.verbose)
+                cout << "Valid, check time: " << time_span << "s\n";
+            qb3_destroy_decoder(qdec);
+            return 0;
+        }
+        qb3_set_decoder_verify(qdec, true);
         raw.resize(qb3_decoded_size(qdec));
+        // Keep the high byte, rounded, while decoding
+        if (opts.eight && qb3_get_type(qdec) == QB3_U16) {
+            qb3_set_decoder_output(qdec, QB3_U8, 1.0 / 256, 0, 0);
+            raw.resize(raw.size() / 2);
+        }
         auto t1 = high_resolution_clock::now();
         auto rbytes = qb3_read_data(qdec, raw.data());
         if (rbytes != raw.size()) {
@@ -319,7 +452,7 @@ int decode_main(options& opts) {
     }
 
     // Query metadata before getting rid of the decoder
-    auto dt = qb3_get_type(qdec);
+    auto dt = (raw.size() < qb3_decoded_size(qdec)) ? QB3_U8 : qb3_get_type(qdec);
     qb3_destroy_decoder(qdec);
     if (opts.verbose) {
         cout << "Decode time: " << time_span << "s, rate: "
@@ -404,6 +537,8 @@ int encode(Raster &raster, std::vector<std::uint8_t> &image, std::vector<std::ui
 
     auto qenc = qb3_create_encoder(raster.size.x, raster.size.y, bands, dt);
     qb3_set_encoder_stride(qenc, stride);
+    if (opts.big)
+        qb3_set_encoder_blocksize(qenc, 8);
 
     dest.resize(qb3_max_encoded_size(qenc));
     size_t outsize(0);
@@ -432,6 +567,30 @@ int encode(Raster &raster, std::vector<std::uint8_t> &image, std::vector<std::ui
             cerr << "Invalid band mapping, adjusted\n";
     }
 
+    if (opts.linear && !qb3_set_encoder_bandpredictor(qenc, true))
+        cerr << "Linear band predictor needs multiple bands, ignored\n";
+
+    if (opts.palette)
+        qb3_set_encoder_palette(qenc, true);
+
+    if (opts.blockcopy)
+        qb3_set_encoder_blockcopy(qenc, true);
+
+    if (opts.adaptive)
+        qb3_set_encoder_adaptive(qenc, true);
+
+    if (opts.search)
+        qb3_set_encoder_curvesearch(qenc, true);
+
+    if (opts.nodata && !qb3_set_encoder_nodata(qenc, true, opts.ndv))
+        cerr << "Invalid NoData value for the data type, ignored\n";
+
+    if (opts.planar)
+        qb3_set_encoder_planar(qenc, true);
+
+    if (opts.checksum)
+        qb3_set_encoder_checksum(qenc, true);
+
     try {
         high_resolution_clock::time_point t1, t2;
 
@@ -458,8 +617,12 @@ int encode(Raster &raster, std::vector<std::uint8_t> &image, std::vector<std::ui
             }
         }
 
+        if (opts.lz)
+            mode = opts.best ? QB3M_CF_LZ_H : QB3M_LZ_H;
         if (opts.ftl)
             mode = QB3M_FTL;
+        if (opts.med)
+            mode = opts.best ? QB3M_MED_BEST : QB3M_MED;
 
         if (mode != qb3_set_encoder_mode(qenc, mode)) {
             cerr << "Invalid mode\n";
@@ -24,10 +24,12 @@ Contributors:  Lucian Plesea
 #include <cassert>
 #include <type_traits>
 #include <iomanip>
+#include <functional>
+#include <random>
 
 // From https://github.com/lucianpls/libicd
 #include <icd_codecs.h>
-#include "QB3lib/QB3.h"
+#include "QB3lib/QB3.hpp"
 
 #if defined(_WIN32) || defined(_WIN64)
 #include <windows.h>
@@ -61,7 +63,7 @@ vector<outT> toplus(vector<inT>& v, outT m) {
 template<typename T>
 void check(vector<uint8_t> &image, const Raster &raster,
     uint64_t m, int main_band = 0,
-    bool fast = 0, uint64_t q = 1, bool away = false, bool ftl = false)
+    bool fast = 0, uint64_t q = 1, bool away = false, bool ftl = false, bool med = false)
 {
     size_t xsize = raster.size.x;
     size_t ysize = raster.size.y;
@@ -73,7 +75,10 @@ void check(vector<uint8_t> &image, const Raster &raster,
 
     auto img = to(image, static_cast<T>(m));
     qb3_dtype tp = qb3_dtype::QB3_U8;
-    if (is_signed<T>()) {
+    if (is_floating_point<T>()) {
+        tp = sizeof(T) == 8 ? qb3_dtype::QB3_F64 : qb3_dtype::QB3_F32;
+    }
+    else if (is_signed<T>()) {
         tp = sizeof(T) == 8 ? qb3_dtype::QB3_I64 : sizeof(T) == 4 ? qb3_dtype::QB3_I32 :
             sizeof(T) == 2 ? qb3_dtype::QB3_I16 : qb3_dtype::QB3_I8;
     }
@@ -99,7 +104,10 @@ void check(vector<uint8_t> &image, const Raster &raster,
     // This is sufficient to trigger the quanta encoding
     if (q > 1)
         qb3_set_encoder_quanta(qenc, q, away);
-    qb3_set_encoder_mode(qenc, ftl? qb3_mode::QB3M_FTL : fast ? qb3_mode::QB3M_BASE : qb3_mode::QB3M_BEST);
+    if (med)
+        qb3_set_encoder_mode(qenc, fast ? qb3_mode::QB3M_MED : qb3_mode::QB3M_MED_BEST);
+    else
+        qb3_set_encoder_mode(qenc, ftl? qb3_mode::QB3M_FTL : fast ? qb3_mode::QB3M_BASE : qb3_mode::QB3M_BEST);
 
     t1 = high_resolution_clock::now();
     auto outsize = qb3_encode(qenc, static_cast<void *>(img.data()), outvec.data());
@@ -388,8 +396,391 @@ void check_stride_decode(vector<uint8_t>& image, const Raster& raster,
     }
 }
 
+// Encoded stream, decoded image and timings of a round trip
+template<typename O>
+struct trip {
+    vector<uint8_t> stream;
+    vector<O> image;
+    double etime = 0, dtime = 0; // seconds
+    bool ok = false; // Encoded and decoded without error
+};
+
+// Encode an image then decode it, setenc and setdec set the options under test
+// The decoded image has osize values of type O, the size and type of the input by default
+template<typename T, typename O = T>
+trip<O> roundtrip(const vector<T>& img, size_t xsize, size_t ysize, size_t bands,
+    function<void(encsp)> setenc = nullptr, function<bool(decsp)> setdec = nullptr, size_t osize = 0)
+{
+    trip<O> r;
+    auto qenc = qb3_create_encoder(xsize, ysize, bands, qb3::dtype<T>::value);
+    if (!qenc)
+        return r;
+    if (setenc)
+        setenc(qenc);
+    r.stream.resize(qb3_max_encoded_size(qenc));
+    auto t1 = high_resolution_clock::now();
+    r.stream.resize(qb3_encode(qenc, const_cast<T*>(img.data()), r.stream.data()));
+    r.etime = duration_cast<duration<double>>(high_resolution_clock::now() - t1).count();
+    qb3_destroy_encoder(qenc);
+    if (r.stream.empty())
+        return r;
+
+    r.image.assign(osize ? osize : img.size(), O(0));
+    size_t image_size[3] = {};
+    auto qdec = qb3_read_start(r.stream.data(), r.stream.size(), image_size);
+    if (!qdec)
+        return r;
+    t1 = high_resolution_clock::now();
+    r.ok = qb3_read_info(qdec) && (!setdec || setdec(qdec))
+        && r.image.size() * sizeof(O) == qb3_read_data(qdec, r.image.data());
+    r.dtime = duration_cast<duration<double>>(high_resolution_clock::now() - t1).count();
+    qb3_destroy_decoder(qdec);
+    return r;
+}
+
+// Size, percent of the raw size and times, raw is the input size in bytes
+template<typename O>
+void report(const trip<O>& r, size_t raw) {
+    cout << r.stream.size() << '\t' << r.stream.size() * 100.0 / raw << '\t' << r.etime << '\t' << r.dtime;
+}
+
+// Decoder with the headers read, for the getters
+struct reader {
+    decsp p;
+    size_t size[3];
+    reader(vector<uint8_t>& stream) : size() {
+        p = qb3_read_start(stream.data(), stream.size(), size);
+        if (p && !qb3_read_info(p)) {
+            qb3_destroy_decoder(p);
+            p = nullptr;
+        }
+    }
+    ~reader() {
+        if (p)
+            qb3_destroy_decoder(p);
+    }
+};
+
+// Compare the palette with the best, RLE and LZ modes, on a synthetic map
+// The input is posterized to a few scattered class values, like a classification raster
+template<typename T>
+void check_palette(vector<uint8_t>& image, const Raster& raster, qb3_mode mode) {
+    static const T classes[] = { 3, 17, 40, 90, 130, 170, 220, 250 };
+    size_t xsize = raster.size.x;
+    size_t ysize = raster.size.y;
+    size_t bands = raster.size.c;
+    vector<T> img(image.size());
+    for (size_t i = 0; i < image.size(); i++)
+        img[i] = classes[image[i] / 32];
+
+    for (int palette = 0; palette < 2; palette++) {
+        auto r = roundtrip(img, xsize, ysize, bands, [&](encsp e) {
+            qb3_set_encoder_mode(e, mode);
+            qb3_set_encoder_palette(e, palette != 0);
+            });
+        report(r, img.size() * sizeof(T));
+        cout << '\t' << sizeof(T) << '\t' << int(mode) << (palette ? " Palette" : "") << endl;
+        // The palette holds the classes used by each band
+        reader rd(r.stream);
+        for (size_t c = 0; r.ok && c < bands; c++) {
+            vector<uint64_t> values(256);
+            size_t n = qb3_get_palette(rd.p, c, values.data());
+            r.ok = palette ? (n > 0 && n <= 8) : (0 == n);
+            for (size_t i = 0; i < n && r.ok; i++)
+                r.ok = std::count(classes, classes + 8, T(values[i])) == 1;
+        }
+        if (!r.ok || r.image != img)
+            cout << "Palette roundtrip failed" << endl;
+    }
+}
+
+// Compare the best mode with and without block copy, on an image made of repeated tiles
+// Block copy makes it smaller
+void check_blockcopy(vector<uint8_t>& image, const Raster& raster) {
+    size_t xsize = raster.size.x;
+    size_t ysize = raster.size.y;
+    size_t bands = raster.size.c;
+    // Tile the top left corner, with an odd size so the copies are not block aligned
+    const size_t tile = 42;
+    vector<uint8_t> img(image.size());
+    for (size_t y = 0; y < ysize; y++)
+        for (size_t x = 0; x < xsize; x++)
+            for (size_t c = 0; c < bands; c++)
+                img[(y * xsize + x) * bands + c] = image[((y % tile) * xsize + x % tile) * bands + c];
+
+    size_t sizes[2] = {};
+    for (int blockcopy = 0; blockcopy < 2; blockcopy++) {
+        auto r = roundtrip(img, xsize, ysize, bands, [&](encsp e) {
+            qb3_set_encoder_mode(e, qb3_mode::QB3M_BEST);
+            qb3_set_encoder_blockcopy(e, blockcopy != 0);
+            });
+        report(r, img.size());
+        cout << (blockcopy ? " Block copy" : "") << endl;
+        sizes[blockcopy] = r.stream.size();
+        if (!r.ok || r.image != img)
+            cout << "Block copy roundtrip failed" << endl;
+    }
+    if (sizes[1] >= sizes[0])
+        cout << "Block copy is not smaller" << endl;
+}
+
+// Compare the 4x4 and 8x8 block sizes, on the image scaled to 16 bits and smoothed horizontally
+// The image is cropped to a width which is not a multiple of 8, other block sizes are rejected
+void check_blocksize(vector<uint8_t>& image, const Raster& raster) {
+    size_t xsize = raster.size.x;
+    size_t ysize = raster.size.y;
+    size_t bands = raster.size.c;
+    size_t width = xsize - (xsize % 8 ? 0 : 3);
+    vector<uint16_t> img(width * ysize * bands);
+    for (size_t y = 0; y < ysize; y++)
+        for (size_t i = 0; i < width * bands; i++) {
+            auto v = image.data() + y * xsize * bands + i;
+            img[y * width * bands + i] = static_cast<uint16_t>(v[0] * 64 + ((i >= bands) ? v[-bands] * 64 : 0));
+        }
+
+    for (size_t bsize : {4, 8}) {
+        bool accepted(true);
+        auto r = roundtrip(img, width, ysize, bands, [&](encsp e) {
+            qb3_set_encoder_mode(e, qb3_mode::QB3M_BASE);
+            accepted = qb3_set_encoder_blocksize(e, bsize) && !qb3_set_encoder_blocksize(e, 6);
+            });
+        report(r, img.size() * 2);
+        cout << '\t' << bsize << "x" << bsize << endl;
+        if (!accepted || !r.ok || r.image != img)
+            cout << "Block size roundtrip failed" << endl;
+    }
+}
+
+// Compare the fast mode with and without the NoData mask, with the lower left half of the image set to 7
+// The masked blocks are skipped, the decoder fills them with the NoData value
+void check_nodata(vector<uint8_t>& image, const Raster& raster) {
+    size_t xsize = raster.size.x;
+    size_t ysize = raster.size.y;
+    size_t bands = raster.size.c;
+    vector<uint8_t> img(image);
+    for (size_t y = 0; y < ysize; y++)
+        for (size_t x = 0; x < xsize * y / ysize; x++)
+            for (size_t c = 0; c < bands; c++)
+                img[(y * xsize + x) * bands + c] = 7;
+
+    size_t sizes[2] = {};
+    for (int nodata = 0; nodata < 2; nodata++) {
+        // Decode to a buffer which doesn't hold the NoData value
+        auto r = roundtrip(img, xsize, ysize, bands,
+            [&](encsp e) { qb3_set_encoder_nodata(e, nodata != 0, 7); },
+            [&](decsp d) {
+                double ndv(0);
+                return nodata == qb3_get_nodata(d, &ndv) && (!nodata || ndv == 7);
+            });
+        report(r, img.size());
+        cout << (nodata ? " NoData" : "") << endl;
+        sizes[nodata] = r.stream.size();
+        if (!r.ok || r.image != img)
+            cout << "NoData roundtrip failed" << endl;
+    }
+    if (sizes[1] >= sizes[0])
+        cout << "NoData mask is not smaller" << endl;
+}
+
+// Compare the fast mode with and without the planar band groups, each band is a group
+// The last band is then decoded alone
+void check_planar(vector<uint8_t>& image, const Raster& raster) {
+    size_t xsize = raster.size.x;
+    size_t ysize = raster.size.y;
+    size_t bands = raster.size.c;
+    vector<size_t> cband(bands);
+    for (size_t c = 0; c < bands; c++)
+        cband[c] = c;
+
+    for (int planar = 0; planar < 2; planar++) {
+        auto setenc = [&](encsp e) {
+            qb3_set_encoder_coreband(e, bands, cband.data());
+            qb3_set_encoder_planar(e, planar != 0);
+            };
+        auto r = roundtrip(image, xsize, ysize, bands, setenc, [&](decsp d) {
+            return qb3_get_planar(d) == (planar && bands > 1 ? bands : 0);
+            });
+        report(r, image.size());
+        cout << (planar ? " Planar" : "") << endl;
+        size_t last[1] = { bands - 1 };
+        auto rb = roundtrip<uint8_t>(image, xsize, ysize, bands, setenc,
+            [&](decsp d) { return qb3_set_decoder_bands(d, 1, last); }, xsize * ysize);
+        for (size_t i = 0; rb.ok && i < rb.image.size(); i++)
+            rb.ok = rb.image[i] == image[i * bands + last[0]];
+        if (!r.ok || r.image != image || !rb.ok)
+            cout << "Planar roundtrip failed" << endl;
+    }
+}
+
+// Validate the encoded image without decoding it, then a truncated copy, which has to fail
+void check_validate(vector<uint8_t>& image, const Raster& raster, qb3_mode mode) {
+    size_t xsize = raster.size.x;
+    size_t ysize = raster.size.y;
+    size_t bands = raster.size.c;
+    size_t offset = 0;
+    double vtime = 0;
+    auto r = roundtrip(image, xsize, ysize, bands, [&](encsp e) { qb3_set_encoder_mode(e, mode); });
+    {
+        reader rd(r.stream);
+        auto t1 = high_resolution_clock::now();
+        if (!rd.p || !qb3_validate(rd.p, &offset) || offset != r.stream.size())
+            cout << "Validation failed" << endl;
+        vtime = duration_cast<duration<double>>(high_resolution_clock::now() - t1).count();
+    }
+    cout << r.stream.size() << '\t' << r.stream.size() * 100.0 / image.size() << "\t\t" << vtime << endl;
+    r.stream.pop_back();
+    reader rd(r.stream);
+    if (!rd.p || qb3_validate(rd.p, &offset))
+        cout << "Truncated input not detected" << endl;
+}
+
+// Encode with strip checksums, decode with verification, then change one data byte
+void check_checksum(vector<uint8_t>& image, const Raster& raster, qb3_mode mode) {
+    size_t xsize = raster.size.x;
+    size_t ysize = raster.size.y;
+    size_t bands = raster.size.c;
+    auto verify = [](decsp d) {
+        qb3_set_decoder_verify(d, true);
+        return qb3_get_checksum(d);
+        };
+    auto r = roundtrip(image, xsize, ysize, bands, [&](encsp e) {
+        qb3_set_encoder_mode(e, mode);
+        qb3_set_encoder_checksum(e, true);
+        }, verify);
+    report(r, image.size());
+    cout << endl;
+    if (!r.ok || r.image != image)
+        cout << "Verified decode failed" << endl;
+
+    r.stream[r.stream.size() - r.stream.size() / 3] ^= 1;
+    reader rd(r.stream);
+    vector<uint8_t> img(image.size());
+    if (!rd.p || !verify(rd.p) || qb3_read_data(rd.p, img.data()) == img.size())
+        cout << "Changed data not detected" << endl;
+}
+
+// Encode and decode an RGB image with the C++ API, the encoded output is the same
+void check_hpp(vector<uint8_t>& image, const Raster& raster) {
+    size_t xsize = raster.size.x;
+    size_t ysize = raster.size.y;
+    if (raster.size.c != 3)
+        return;
+    auto r = roundtrip(image, xsize, ysize, 3);
+
+    auto t1 = high_resolution_clock::now();
+    auto encoded = qb3::encode<uint8_t, 3>(image.data(), xsize, ysize);
+    vector<uint8_t> img(image.size());
+    bool ok = qb3::decode<uint8_t, 3>(encoded.data(), encoded.size(), img.data(), xsize, ysize);
+    auto time_span = duration_cast<duration<double>>(high_resolution_clock::now() - t1).count();
+    cout << encoded.size() << '\t' << encoded.size() * 100.0 / image.size() << "\t\t" << time_span << endl;
+    if (!ok || encoded != r.stream || img != image)
+        cout << "C++ API failed" << endl;
+}
+
+// Encode and decode a band sequential copy of the image, the encoded output is the same
+void check_layout(vector<uint8_t>& image, const Raster& raster) {
+    size_t xsize = raster.size.x;
+    size_t ysize = raster.size.y;
+    size_t bands = raster.size.c;
+    size_t plane = xsize * ysize;
+    vector<uint8_t> bsq(image.size());
+    for (size_t i = 0; i < plane; i++)
+        for (size_t c = 0; c < bands; c++)
+            bsq[c * plane + i] = image[i * bands + c];
+
+    auto r = roundtrip(image, xsize, ysize, bands);
+    auto rb = roundtrip(bsq, xsize, ysize, bands,
+        [&](encsp e) { qb3_set_encoder_layout(e, 1, xsize, plane); },
+        [&](decsp d) { return qb3_set_decoder_layout(d, 1, xsize, plane); });
+    report(rb, image.size());
+    cout << endl;
+    if (r.stream != rb.stream)
+        cout << "Band sequential encoding differs" << endl;
+    if (!rb.ok || rb.image != bsq)
+        cout << "Band sequential roundtrip failed" << endl;
+}
+
+// Encode the first band, then decode it alone from the full stream
+void check_bands(vector<uint8_t>& image, const Raster& raster) {
+    size_t xsize = raster.size.x;
+    size_t ysize = raster.size.y;
+    size_t bands = raster.size.c;
+    size_t plane = xsize * ysize;
+    size_t first[1] = { 0 };
+    vector<uint8_t> band(plane);
+    for (size_t i = 0; i < plane; i++)
+        band[i] = image[i * bands];
+
+    // Only the first band is encoded, from the full image
+    auto qenc = qb3_create_encoder(xsize, ysize, 1, qb3_dtype::QB3_U8);
+    qb3_set_encoder_bands(qenc, bands, first);
+    vector<uint8_t> outvec(qb3_max_encoded_size(qenc));
+    outvec.resize(qb3_encode(qenc, image.data(), outvec.data()));
+    qb3_destroy_encoder(qenc);
+    auto r1 = roundtrip(band, xsize, ysize, 1);
+    if (outvec != r1.stream)
+        cout << "Band selection encoding differs" << endl;
+
+    auto r = roundtrip<uint8_t>(image, xsize, ysize, bands, nullptr,
+        [&](decsp d) { return qb3_set_decoder_bands(d, 1, first); }, plane);
+    report(r, plane);
+    cout << endl;
+    if (!r.ok || r.image != band)
+        cout << "Band selection failed" << endl;
+}
+
+// Decode 16 bit data as 8 bit, with an extra constant channel, like alpha
+void check_output(vector<uint16_t>& image, const Raster& raster) {
+    size_t xsize = raster.size.x;
+    size_t ysize = raster.size.y;
+    size_t bands = raster.size.c;
+    vector<size_t> channels(bands + 1, QB3_FILL);
+    for (size_t c = 0; c < bands; c++)
+        channels[c] = c;
+    auto r = roundtrip<uint16_t, uint8_t>(image, xsize, ysize, bands, nullptr, [&](decsp d) {
+        return qb3_set_decoder_bands(d, bands + 1, channels.data())
+            && qb3_set_decoder_output(d, qb3_dtype::QB3_U8, 1.0 / 256, 0, 255);
+        }, xsize * ysize * (bands + 1));
+    report(r, image.size() * 2);
+    cout << endl;
+    for (size_t i = 0; r.ok && i < xsize * ysize; i++) {
+        r.ok = r.image[i * (bands + 1) + bands] == 255;
+        for (size_t c = 0; c < bands; c++)
+            r.ok &= r.image[i * (bands + 1) + c] == std::min(255, (image[i * bands + c] + 128) >> 8);
+    }
+    if (!r.ok)
+        cout << "Output conversion failed" << endl;
+}
+
+// Decode with the per band statistics and histogram, compare with the decoded values
+void check_stats(vector<uint16_t>& image, const Raster& raster) {
+    size_t xsize = raster.size.x;
+    size_t ysize = raster.size.y;
+    size_t bands = raster.size.c;
+    vector<double> stats(bands * 4);
+    vector<uint64_t> hist(bands * 0x10000);
+    auto r = roundtrip(image, xsize, ysize, bands, nullptr,
+        [&](decsp d) { return qb3_set_decoder_stats(d, stats.data(), hist.data()); });
+    report(r, image.size() * 2);
+    cout << endl;
+    for (size_t c = 0; r.ok && c < bands; c++) {
+        uint16_t vmin = 0xffff, vmax = 0;
+        double sum = 0;
+        for (size_t i = c; i < image.size(); i += bands) {
+            vmin = std::min(vmin, image[i]);
+            vmax = std::max(vmax, image[i]);
+            sum += image[i];
+        }
+        r.ok = r.image == image && stats[c * 4] == vmin && stats[c * 4 + 1] == vmax
+            && stats[c * 4 + 2] == sum && stats[c * 4 + 3] == xsize * ysize
+            && hist[c * 0x10000 + vmin] != 0 && hist[c * 0x10000 + vmax] != 0;
+    }
+    if (!r.ok)
+        cout << "Statistics failed" << endl;
+}
+
 template<typename T>
-void check(vector<uint16_t>& image, const Raster& raster, uint64_t m, int main_band = 0, bool fast = 0) {
+void check(vector<uint16_t>& image, const Raster& raster, uint64_t m, int main_band = 0, bool fast = 0, bool med = false) {
     size_t xsize = raster.size.x;
     size_t ysize = raster.size.y;
     size_t bands = raster.size.c;
@@ -397,12 +788,16 @@ void check(vector<uint16_t>& image, const Raster& raster, uint64_t m, int main_b
     double time_span;
 
     auto img = to(image, static_cast<T>(m));
-    auto tp = sizeof(T) == 8 ? qb3_dtype::QB3_I64 : sizeof(T) == 4 ? qb3_dtype::QB3_I32 :
+    auto tp = is_floating_point<T>() ? (sizeof(T) == 8 ? qb3_dtype::QB3_F64 : qb3_dtype::QB3_F32) :
+        sizeof(T) == 8 ? qb3_dtype::QB3_I64 : sizeof(T) == 4 ? qb3_dtype::QB3_I32 :
         sizeof(T) == 2 ? qb3_dtype::QB3_I16 : qb3_dtype::QB3_I8;
     auto qenc = qb3_create_encoder(xsize, ysize, bands, tp);
     vector<uint8_t> outvec(qb3_max_encoded_size(qenc));
 
-    qb3_set_encoder_mode(qenc, fast ? qb3_mode::QB3M_BASE : qb3_mode::QB3M_BEST);
+    if (med)
+        qb3_set_encoder_mode(qenc, fast ? qb3_mode::QB3M_MED : qb3_mode::QB3M_MED_BEST);
+    else
+        qb3_set_encoder_mode(qenc, fast ? qb3_mode::QB3M_BASE : qb3_mode::QB3M_BEST);
 
     t1 = high_resolution_clock::now();
     auto outsize = qb3_encode(qenc, img.data(), outvec.data());
@@ -415,7 +810,7 @@ void check(vector<uint16_t>& image, const Raster& raster, uint64_t m, int main_b
 
     size_t image_size[3] = {}; // Space for output values
     auto failed = false;
-    auto expected_size = xsize * ysize * bands * 2; // 16bit data
+    auto expected_size = xsize * ysize * bands * sizeof(T);
     size_t actual_size(0);
     t1 = high_resolution_clock::now();
     auto qdec = qb3_read_start(outvec.data(), outsize, image_size);
@@ -455,6 +850,718 @@ void check(vector<uint16_t>& image, const Raster& raster, uint64_t m, int main_b
     }
 }
 
+// Regression tests on synthetic images, run with -t
+static int failures = 0;
+
+static void expect(bool ok, const char* what) {
+    if (ok)
+        return;
+    cout << "FAILED: " << what << endl;
+    failures++;
+}
+
+// Smooth image with some noise, values from 0 to about vmax
+template<typename T>
+vector<T> synthetic(size_t xsize, size_t ysize, size_t bands, double vmax, unsigned seed = 1) {
+    mt19937 gen(seed);
+    vector<T> img(xsize * ysize * bands);
+    for (size_t y = 0; y < ysize; y++)
+        for (size_t x = 0; x < xsize; x++)
+            for (size_t c = 0; c < bands; c++) {
+                double v = 0.5 + 0.3 * sin(x * 0.05 + c) * cos(y * 0.03) + 0.1 * sin((x + y) * 0.2);
+                img[(y * xsize + x) * bands + c] = static_cast<T>(vmax * (0.9 * v + 0.05 * (gen() % 1024) / 1024));
+            }
+    return img;
+}
+
+// Offset of a header chunk, 0 if it is not found before the "DT" chunk, where the data starts
+static size_t find_chunk(const vector<uint8_t>& stream, const char* sig) {
+    for (size_t i = 11; i + 4 <= stream.size(); i += 4 + stream[i + 2] + 256 * stream[i + 3]) {
+        if (sig[0] == stream[i] && sig[1] == stream[i + 1])
+            return i;
+        if ('D' == stream[i] && 'T' == stream[i + 1])
+            break;
+    }
+    return 0;
+}
+
+// The NoData blocks are filled with the NoData value, and can't be block copy sources
+static void test_nodata() {
+    const uint8_t ndv = 7;
+    auto img = synthetic<uint8_t>(517, 389, 3, 255);
+    for (size_t y = 100; y < 300; y++)
+        std::fill(img.begin() + (y * 517 + 20) * 3, img.begin() + (y * 517 + 400) * 3, ndv);
+    for (size_t bsize : {4, 8}) {
+        auto r = roundtrip(img, 517, 389, 3, [&](encsp e) {
+            qb3_set_encoder_nodata(e, true, ndv);
+            qb3_set_encoder_blocksize(e, bsize);
+            });
+        auto rn = roundtrip(img, 517, 389, 3, [&](encsp e) { qb3_set_encoder_blocksize(e, bsize); });
+        expect(r.ok && r.image == img, "NoData blocks are filled");
+        expect(r.stream.size() < rn.stream.size(), "NoData blocks are skipped");
+    }
+    // Filled on the strip path too, with the output conversion
+    auto r = roundtrip<uint8_t, uint16_t>(img, 517, 389, 3, [&](encsp e) { qb3_set_encoder_nodata(e, true, ndv); },
+        [](decsp d) { return qb3_set_decoder_output(d, qb3_dtype::QB3_U16, 2, 0, 0); });
+    bool ok(r.ok);
+    for (size_t i = 0; ok && i < img.size(); i++)
+        ok = r.image[i] == img[i] * 2;
+    expect(ok, "NoData blocks are filled when converting the output");
+
+    // One row of 16 blocks, blocks 1 and 5 are NoData, block 3 is a copy of block 2
+    // The same image with blocks 2 and 5 as NoData has the same data size
+    // With that mask, block 3 is a copy of a NoData block, which is not valid
+    const size_t xsize(64), ysize(4);
+    auto base = synthetic<uint8_t>(xsize, ysize, 1, 255, 3);
+    auto block = [&](vector<uint8_t>& v, size_t to, size_t from) {
+        for (size_t y = 0; y < ysize; y++)
+            for (size_t x = 0; x < 4; x++)
+                v[y * xsize + to * 4 + x] = (from < 16) ? base[y * xsize + from * 4 + x] : ndv;
+        };
+    vector<uint8_t> a(base), b(base);
+    block(a, 1, 16);
+    block(a, 3, 2);
+    block(a, 5, 16);
+    block(b, 1, 2);
+    block(b, 2, 16);
+    block(b, 3, 2);
+    block(b, 5, 16);
+    auto setenc = [&](encsp e) {
+        qb3_set_encoder_mode(e, qb3_mode::QB3M_BEST);
+        qb3_set_encoder_blockcopy(e, true);
+        qb3_set_encoder_nodata(e, true, ndv);
+        };
+    auto ra = roundtrip(a, xsize, ysize, 1, setenc);
+    auto rb = roundtrip(b, xsize, ysize, 1, setenc);
+    expect(ra.ok && ra.image == a && rb.ok && rb.image == b, "NoData with block copy");
+    size_t dt(find_chunk(ra.stream, "DT"));
+    expect(dt && dt == find_chunk(rb.stream, "DT"), "NoData mask size");
+    auto crafted(ra.stream);
+    std::copy(rb.stream.begin(), rb.stream.begin() + dt, crafted.begin());
+    vector<uint8_t> out(a.size());
+    size_t offset(0);
+    reader rd(crafted);
+    expect(rd.p && 0 == qb3_read_data(rd.p, out.data()), "Block copy from a NoData block is rejected");
+    reader rv(crafted);
+    expect(rv.p && !qb3_validate(rv.p, &offset), "Block copy from a NoData block is not valid");
+}
+
+// The linear band predictor fit, lossless and with quantization
+static void test_linear() {
+    const size_t xsize(517), ysize(389), bands(3);
+    auto img = synthetic<uint16_t>(xsize, ysize, bands, 15000);
+    for (size_t i = 0; i < img.size(); i += bands) {
+        img[i + 1] = static_cast<uint16_t>(3 * img[i] + 1000 + img[i + 1] % 8);
+        img[i + 2] = static_cast<uint16_t>(img[i] / 2 + img[i + 2] % 4);
+    }
+    int64_t coefs[3 * bands] = {};
+    size_t cband[bands] = {}; // Band 0 is the core band
+    for (uint64_t q : {1, 4}) {
+        auto setq = [&](encsp e) {
+            qb3_set_encoder_quanta(e, q, false);
+            qb3_set_encoder_coreband(e, bands, cband);
+            };
+        auto rl = roundtrip(img, xsize, ysize, bands, [&](encsp e) {
+            setq(e);
+            qb3_set_encoder_bandpredictor(e, true);
+            });
+        auto r = roundtrip(img, xsize, ysize, bands, setq);
+        bool ok(rl.ok);
+        for (size_t i = 0; ok && i < img.size(); i++)
+            ok = std::abs(int(rl.image[i]) - int(img[i])) <= int(q / 2);
+        expect(ok, "Linear band predictor round trip");
+        expect(r.ok && rl.stream.size() < r.stream.size(), "Linear band predictor is smaller");
+        // The fit is done on the quantized values, the offset scales with the quanta
+        reader rd(rl.stream);
+        ok = rd.p && qb3_get_bandpredictor(rd.p, coefs);
+        expect(ok && std::abs(coefs[3] - (3 << coefs[5])) < (1 << coefs[5]) / 32, "Linear band predictor gain");
+        expect(ok && std::abs((coefs[4] >> coefs[5]) - 1000 / int64_t(q)) < 8, "Linear band predictor offset");
+    }
+
+    // Shifts over 62 are not valid
+    auto rl = roundtrip(img, xsize, ysize, bands, [&](encsp e) {
+        qb3_set_encoder_coreband(e, bands, cband);
+        qb3_set_encoder_bandpredictor(e, true);
+        });
+    auto crafted(rl.stream);
+    size_t lp(find_chunk(crafted, "LP"));
+    expect(lp && crafted[lp + 8] == coefs[2], "Linear band predictor chunk");
+    crafted[lp + 8] = 63;
+    reader rd(crafted);
+    expect(!rd.p, "Linear band predictor shift is checked");
+}
+
+// Floating point round trips, lossless and error bounded
+template<typename T>
+static void test_float() {
+    const size_t xsize(517), ysize(389), bands(2);
+    auto img = synthetic<T>(xsize, ysize, bands, 1);
+    for (size_t i = 0; i < img.size(); i++)
+        img[i] = img[i] * 400 - 100 + T(i % 7) / 3;
+    auto r = roundtrip(img, xsize, ysize, bands);
+    expect(r.ok && r.image == img, "Lossless float round trip");
+    for (double maxerr : {0.001, 0.1, 2.5}) {
+        auto rq = roundtrip(img, xsize, ysize, bands, [&](encsp e) { qb3_set_encoder_maxerror(e, maxerr); });
+        bool ok(rq.ok);
+        for (size_t i = 0; ok && i < img.size(); i++)
+            ok = std::abs(double(rq.image[i]) - double(img[i])) <= maxerr;
+        expect(ok, "Float decoded values are within maxerror");
+        expect(rq.ok && rq.stream.size() < r.stream.size(), "Float maxerror is smaller");
+        reader rd(rq.stream);
+        expect(rd.p && qb3_get_maxerror(rd.p) == maxerr, "Float maxerror is stored");
+    }
+}
+
+// Encodes with an existing encoder, returns the stream
+template<typename T>
+static vector<uint8_t> encode_with(encsp e, const vector<T>& img) {
+    vector<uint8_t> stream(qb3_max_encoded_size(e));
+    stream.resize(qb3_encode(e, const_cast<T*>(img.data()), stream.data()));
+    return stream;
+}
+
+// Encoder reuse, stored strided input and reference frame sequences
+static void test_sequence() {
+    const size_t xsize(517), ysize(389), bands(3), nframes(5), interval(3);
+    vector<vector<uint16_t>> frames;
+    for (size_t f = 0; f < nframes; f++) {
+        frames.push_back(synthetic<uint16_t>(xsize, ysize, bands, 40000));
+        // A moving feature
+        for (size_t y = 50; y < 150; y++)
+            std::fill_n(frames[f].begin() + (y * xsize + 40 * f) * bands, 90 * bands, uint16_t(1000 * f));
+    }
+
+    // A reused encoder produces the same stream as a new one
+    auto e = qb3_create_encoder(xsize, ysize, bands, qb3_dtype::QB3_U16);
+    encode_with(e, frames[0]);
+    auto second = encode_with(e, frames[1]);
+    qb3_destroy_encoder(e);
+    auto r = roundtrip(frames[1], xsize, ysize, bands);
+    expect(!second.empty() && second == r.stream, "Encoder reuse");
+
+    // Stored encoding of an image with a line stride
+    const size_t stride(xsize * bands + 7);
+    vector<uint16_t> padded(stride * ysize, 0xdead);
+    for (size_t y = 0; y < ysize; y++)
+        std::copy_n(frames[0].begin() + y * xsize * bands, xsize * bands, padded.begin() + y * stride);
+    e = qb3_create_encoder(xsize, ysize, bands, qb3_dtype::QB3_U16);
+    qb3_set_encoder_mode(e, qb3_mode::QB3M_STORED);
+    qb3_set_encoder_stride(e, stride);
+    auto stored = encode_with(e, padded);
+    qb3_destroy_encoder(e);
+    vector<uint16_t> out(frames[0].size());
+    reader rs(stored);
+    expect(rs.p && qb3_read_data(rs.p, out.data()) && out == frames[0], "Stored encoding with a stride");
+
+    // Each frame is encoded from the previous one, except the key frames
+    e = qb3_create_encoder(xsize, ysize, bands, qb3_dtype::QB3_U16);
+    qb3_set_encoder_keyframes(e, interval);
+    vector<uint8_t> seq;
+    vector<size_t> sizes;
+    for (size_t f = 0; f < nframes; f++) {
+        qb3_set_encoder_reference(e, f ? frames[f - 1].data() : nullptr);
+        auto frame = encode_with(e, frames[f]);
+        if (f % interval)
+            expect(frame.size() < roundtrip(frames[f], xsize, ysize, bands).stream.size(), "Reference frame is smaller");
+        sizes.push_back(frame.size());
+        seq.insert(seq.end(), frame.begin(), frame.end());
+    }
+    qb3_destroy_encoder(e);
+    size_t isize(qb3_seq_index_size(nframes));
+    seq.resize(seq.size() + isize);
+    expect(isize == qb3_seq_write_index(seq.data() + seq.size() - isize, nframes, sizes.data(), interval),
+        "Sequence index is written");
+
+    vector<size_t> offsets(nframes + 1);
+    size_t ival(0);
+    expect(nframes == qb3_seq_read_index(seq.data(), seq.size(), offsets.data(), &ival) && interval == ival,
+        "Sequence index is read");
+    vector<uint16_t> prev, cur(frames[0].size());
+    bool ok(true);
+    for (size_t f = 0; ok && f < nframes; f++) {
+        size_t size[3];
+        auto d = qb3_read_start(seq.data() + offsets[f], offsets[f + 1] - offsets[f], size);
+        ok = d && qb3_read_info(d) && qb3_get_reference(d) == (0 != f % interval);
+        if (ok) {
+            qb3_set_decoder_reference(d, prev.data());
+            ok = qb3_read_data(d, cur.data()) && cur == frames[f];
+        }
+        if (d)
+            qb3_destroy_decoder(d);
+        prev = cur;
+    }
+    expect(ok, "Reference frame sequence round trip");
+}
+
+// Block copies from the block above and from the same row, on every decode path
+static void test_blockcopy() {
+    // A 4 line pattern, shifted left by one block on each block row
+    // Most blocks are copies of a block in the previous block row, other than the one above
+    const size_t xsize(517), ysize(389), bands(3), period(44);
+    auto base = synthetic<uint8_t>(period, 4, bands, 255);
+    vector<uint8_t> img(xsize * ysize * bands);
+    for (size_t y = 0; y < ysize; y++)
+        for (size_t x = 0; x < xsize; x++)
+            for (size_t c = 0; c < bands; c++)
+                img[(y * xsize + x) * bands + c] = base[((y % 4) * period + (x + y / 4 * 4) % period) * bands + c];
+    auto setenc = [](encsp e) {
+        qb3_set_encoder_mode(e, qb3_mode::QB3M_BEST);
+        qb3_set_encoder_blockcopy(e, true);
+        };
+    auto r = roundtrip(img, xsize, ysize, bands, setenc);
+    auto rn = roundtrip(img, xsize, ysize, bands, [](encsp e) { qb3_set_encoder_mode(e, qb3_mode::QB3M_BEST); });
+    expect(r.ok && r.image == img, "Block copy round trip");
+    expect(r.stream.size() < rn.stream.size() / 2, "Block copy is smaller");
+    // Quantized, encoded one strip at a time, the previous strip is still a copy source
+    auto rq = roundtrip(img, xsize, ysize, bands, [&](encsp e) {
+        setenc(e);
+        qb3_set_encoder_quanta(e, 2, false);
+        });
+    bool ok(rq.ok);
+    for (size_t i = 0; ok && i < img.size(); i++)
+        ok = std::abs(int(rq.image[i]) - int(img[i])) <= 1;
+    expect(ok, "Quantized block copy round trip");
+    expect(rq.stream.size() < r.stream.size(), "Quantized block copy uses the previous strip");
+
+    // Decoded one strip at a time, with the statistics or with the output conversion
+    vector<double> stats(4 * bands);
+    auto rs = roundtrip(img, xsize, ysize, bands, setenc,
+        [&](decsp d) { return qb3_set_decoder_stats(d, stats.data(), nullptr); });
+    expect(rs.ok && rs.image == img && stats[3] == xsize * ysize, "Block copy by strips");
+    auto rc = roundtrip<uint8_t, uint16_t>(img, xsize, ysize, bands, setenc,
+        [](decsp d) { return qb3_set_decoder_output(d, qb3_dtype::QB3_U16, 1, 0, 0); });
+    expect(rc.ok && equal(img.begin(), img.end(), rc.image.begin()), "Block copy with the output conversion");
+    // Band subset, all the bands are decoded
+    size_t sel[] = { 2 };
+    auto rb = roundtrip<uint8_t>(img, xsize, ysize, bands, setenc,
+        [&](decsp d) { return qb3_set_decoder_bands(d, 1, sel); }, xsize * ysize);
+    ok = rb.ok;
+    for (size_t i = 0; ok && i < xsize * ysize; i++)
+        ok = rb.image[i] == img[i * bands + 2];
+    expect(ok, "Block copy with a band subset");
+    size_t offset(0);
+    reader rd(r.stream);
+    expect(rd.p && qb3_validate(rd.p, &offset) && offset == r.stream.size(), "Block copy validation");
+}
+
+// Adaptive rung switch codes, on sparse content with many rung changes
+static void test_adaptive() {
+    const size_t xsize(517), ysize(389), bands(2);
+    mt19937 gen(5);
+    for (int u16 = 0; u16 < 2; u16++) {
+        vector<uint16_t> img(xsize * ysize * bands);
+        for (auto& v : img)
+            v = (gen() % 16) ? 0 : static_cast<uint16_t>(gen() % (u16 ? 4000 : 256));
+        for (auto mode : { qb3_mode::QB3M_BASE_Z, qb3_mode::QB3M_BASE_H, qb3_mode::QB3M_CF, qb3_mode::QB3M_BEST }) {
+            for (int copy = 0; copy < 2; copy++) {
+                auto setenc = [&](encsp e) {
+                    qb3_set_encoder_mode(e, mode);
+                    qb3_set_encoder_blockcopy(e, copy != 0);
+                    };
+                size_t sizes[2] = {};
+                for (int adaptive = 0; adaptive < 2; adaptive++) {
+                    trip<uint16_t> r;
+                    if (u16)
+                        r = roundtrip(img, xsize, ysize, bands, [&](encsp e) {
+                            setenc(e);
+                            qb3_set_encoder_adaptive(e, adaptive != 0);
+                            });
+                    else {
+                        vector<uint8_t> img8(img.begin(), img.end());
+                        auto r8 = roundtrip(img8, xsize, ysize, bands, [&](encsp e) {
+                            setenc(e);
+                            qb3_set_encoder_adaptive(e, adaptive != 0);
+                            });
+                        r.ok = r8.ok;
+                        r.stream = r8.stream;
+                        r.image.assign(r8.image.begin(), r8.image.end());
+                    }
+                    expect(r.ok && r.image == img, "Adaptive rung switch round trip");
+                    expect((0 != find_chunk(r.stream, "AS")) == (adaptive != 0), "Adaptive rung switch chunk");
+                    size_t offset(0);
+                    reader rd(r.stream);
+                    expect(rd.p && qb3_validate(rd.p, &offset) && offset == r.stream.size(), "Adaptive rung switch validation");
+                    sizes[adaptive] = r.stream.size();
+                }
+                expect(sizes[1] < sizes[0], "Adaptive rung switch is smaller");
+            }
+        }
+    }
+}
+
+// The smallest stream is the header, the "DT" signature and one byte of data
+static void test_tiny() {
+    vector<uint8_t> img(1, 42);
+    auto r = roundtrip(img, 1, 1, 1);
+    expect(r.ok && r.image == img && r.stream.size() == 14, "Single value image round trip");
+    size_t size[3];
+    auto d = qb3_read_start(r.stream.data(), 13, size);
+    expect(!d, "Streams under 14 bytes are rejected");
+    if (d)
+        qb3_destroy_decoder(d);
+}
+
+// The "SC" chunk is written for all the non-legacy modes, never for the legacy ones
+static void test_curve() {
+    const uint64_t HILBERT(0x01548cd9aefb7623), ZCURVE(0x0145236789cdabef); // From QB3common.h
+    const size_t xsize(517), ysize(389), bands(1);
+    auto img = synthetic<uint8_t>(xsize, ysize, bands, 255);
+    // The curve of the stream, 0 if the round trip fails
+    auto curve = [&](function<void(encsp)> setenc, bool sc) -> uint64_t {
+        auto r = roundtrip(img, xsize, ysize, bands, setenc);
+        reader rd(r.stream);
+        if (!r.ok || r.image != img || !rd.p || sc != (0 != find_chunk(r.stream, "SC")))
+            return 0;
+        return qb3_get_order(rd.p);
+    };
+    expect(HILBERT == curve([](encsp e) { qb3_set_encoder_mode(e, qb3_mode::QB3M_BASE_H); }, true),
+        "Hilbert curve chunk");
+    expect(ZCURVE == curve([](encsp e) { qb3_set_encoder_mode(e, qb3_mode::QB3M_BASE_Z); }, false),
+        "Legacy mode has no curve chunk");
+    // Switching from a legacy mode keeps the Morton curve, which has to be stored
+    expect(ZCURVE == curve([](encsp e) {
+        qb3_set_encoder_mode(e, qb3_mode::QB3M_BASE_Z);
+        qb3_set_encoder_mode(e, qb3_mode::QB3M_BEST);
+        }, true), "Morton curve in a Hilbert mode");
+    // Vertical stripes, the search picks a curve which scans by column
+    for (size_t i = 0; i < img.size(); i++)
+        img[i] = static_cast<uint8_t>((i % xsize) * 37 + (i / xsize) % 3);
+    auto found = curve([](encsp e) { qb3_set_encoder_curvesearch(e, true); }, true);
+    expect(0 != found && HILBERT != found, "Scanning curve search");
+}
+
+// More than 64 bands, interleaved and as planar band groups
+static void test_manybands() {
+    const size_t xsize(61), ysize(37);
+    for (size_t bands : {65, 200, 256}) {
+        auto img = synthetic<uint16_t>(xsize, ysize, bands, 4000, unsigned(bands));
+        // Every fourth band is a core band
+        vector<size_t> cband(bands);
+        for (size_t c = 0; c < bands; c++)
+            cband[c] = c / 4 * 4;
+        for (auto mode : { qb3_mode::QB3M_DEFAULT, qb3_mode::QB3M_CF_H }) {
+            for (int planar = 0; planar < 2; planar++) {
+                auto r = roundtrip(img, xsize, ysize, bands, [&](encsp e) {
+                    qb3_set_encoder_mode(e, mode);
+                    qb3_set_encoder_coreband(e, bands, cband.data());
+                    qb3_set_encoder_planar(e, planar != 0);
+                    });
+                expect(r.ok && r.image == img, "Many bands round trip");
+                reader rd(r.stream);
+                vector<size_t> cb(bands);
+                expect(rd.p && rd.size[2] == bands && qb3_get_coreband(rd.p, cb.data()) && cb == cband,
+                    "Many bands band mapping");
+                expect(rd.p && qb3_get_planar(rd.p) == (planar ? (bands + 3) / 4 : 0), "Many bands groups");
+            }
+        }
+    }
+}
+
+// Sizes over 16 bits, and sizes which don't fit in memory
+static void test_largesize() {
+    for (size_t xsize : {4, 70001}) {
+        const size_t ysize(70005 - xsize);
+        auto img = synthetic<uint8_t>(xsize, ysize, 1, 255);
+        auto r = roundtrip(img, xsize, ysize, 1);
+        reader rd(r.stream);
+        expect(r.ok && r.image == img && rd.p && rd.size[0] == xsize && rd.size[1] == ysize,
+            "Large size round trip");
+    }
+    expect(nullptr == qb3_create_encoder(QB3_MAXSIZE, QB3_MAXSIZE, 1, qb3_dtype::QB3_U8),
+        "The image size has to fit in memory");
+
+    // 4294901761 x 2097184 x 256 x 8 bytes, the decoded size wraps around to 65536
+    vector<uint8_t> crafted = { 'Q', 'B', '3', 0x80, 0, 0, 0x1f, 0, 0xff, qb3_dtype::QB3_U64, qb3_mode::QB3M_BASE_H,
+        'X', 'S', 4, 0, 0xff, 0xff, 0x20, 0, 'D', 'T' };
+    crafted.resize(41);
+    size_t size[3];
+    auto d = qb3_read_start(crafted.data(), crafted.size(), size);
+    expect(!d, "The decoded size has to fit in memory");
+    if (d)
+        qb3_destroy_decoder(d);
+}
+
+// Planar band groups, encoded and decoded in place with the image layout
+static void test_planar() {
+    const size_t xsize(517), ysize(389), bands(4);
+    auto img = synthetic<uint16_t>(xsize, ysize, bands, 30000);
+    size_t cband[bands] = { 0, 0, 2, 2 };
+    auto planar = [&](encsp e) {
+        qb3_set_encoder_coreband(e, bands, cband);
+        qb3_set_encoder_planar(e, true);
+        };
+    auto r = roundtrip(img, xsize, ysize, bands, planar);
+    expect(r.ok && r.image == img, "Planar round trip");
+
+    // Band sequential input and output
+    vector<uint16_t> bsq(img.size());
+    const size_t npix(xsize * ysize);
+    for (size_t i = 0; i < npix; i++)
+        for (size_t c = 0; c < bands; c++)
+            bsq[c * npix + i] = img[i * bands + c];
+    auto rs = roundtrip(bsq, xsize, ysize, bands, [&](encsp e) {
+        planar(e);
+        qb3_set_encoder_layout(e, 1, xsize, npix);
+        }, [&](decsp d) { return qb3_set_decoder_layout(d, 1, xsize, npix); });
+    expect(rs.ok && rs.image == bsq && rs.stream == r.stream, "Planar band sequential");
+
+    // Three of five input channels, decoded to RGBA with the middle band skipped
+    vector<uint16_t> five(npix * 5);
+    for (size_t i = 0; i < npix; i++)
+        for (size_t c = 0; c < bands; c++)
+            five[i * 5 + c + (c > 1)] = img[i * bands + c];
+    size_t ebands[bands] = { 0, 1, 3, 4 };
+    size_t dbands[] = { 3, 2, 1, QB3_FILL };
+    auto rc = roundtrip<uint16_t>(five, xsize, ysize, bands, [&](encsp e) {
+        planar(e);
+        qb3_set_encoder_bands(e, 5, ebands);
+        }, [&](decsp d) { return qb3_set_decoder_bands(d, 4, dbands); }, npix * 4);
+    bool ok(rc.ok && rc.stream == r.stream);
+    for (size_t i = 0; ok && i < npix; i++)
+        for (size_t c = 0; ok && c < 3; c++)
+            ok = rc.image[i * 4 + c] == img[i * bands + dbands[c]];
+    expect(ok, "Planar band selection");
+
+    // Quantized, encoded by strips, and with a reference frame
+    auto rq = roundtrip(img, xsize, ysize, bands, [&](encsp e) {
+        planar(e);
+        qb3_set_encoder_quanta(e, 3, false);
+        });
+    ok = rq.ok;
+    for (size_t i = 0; ok && i < img.size(); i++)
+        ok = std::abs(int(rq.image[i]) - int(img[i])) <= 1;
+    expect(ok, "Planar quantized round trip");
+    auto prev = synthetic<uint16_t>(xsize, ysize, bands, 30000, 2);
+    auto rr = roundtrip(img, xsize, ysize, bands, [&](encsp e) {
+        planar(e);
+        qb3_set_encoder_reference(e, prev.data());
+        }, [&](decsp d) {
+            qb3_set_decoder_reference(d, prev.data());
+            return qb3_get_reference(d);
+        });
+    expect(rr.ok && rr.image == img, "Planar reference frame round trip");
+
+    // The stream sizes have to be there
+    auto crafted(r.stream);
+    size_t bg(find_chunk(crafted, "BG"));
+    expect(0 != bg, "Planar groups chunk");
+    crafted.resize(bg + 4 + 8);
+    reader rd(crafted);
+    expect(!rd.p, "Truncated planar groups chunk");
+}
+
+// Small images are padded with the first stored value, which is in the palette or on the float grid
+static void test_smallpad() {
+    const size_t xsize(3), ysize(9), npix(xsize * ysize);
+    vector<uint16_t> img(npix * 3);
+    vector<float> fimg(npix * 3);
+    for (size_t i = 0; i < npix; i++) {
+        img[i * 3] = 60000; // Not encoded
+        img[i * 3 + 2] = uint16_t(i % 3);
+        fimg[i * 3] = 1e30f; // Not encoded, far from the grid
+        fimg[i * 3 + 2] = 1.5f * (i % 4);
+    }
+    size_t sel[] = { 2 };
+    auto r = roundtrip<uint16_t>(img, xsize, ysize, 1, [&](encsp e) {
+        qb3_set_encoder_bands(e, 3, sel);
+        qb3_set_encoder_palette(e, true);
+        }, nullptr, npix);
+    bool ok(r.ok);
+    for (size_t i = 0; ok && i < npix; i++)
+        ok = r.image[i] == img[i * 3 + 2];
+    expect(ok, "Small image palette padding");
+    auto rf = roundtrip<float>(fimg, xsize, ysize, 1, [&](encsp e) {
+        qb3_set_encoder_bands(e, 3, sel);
+        qb3_set_encoder_maxerror(e, 0.1);
+        }, nullptr, npix);
+    ok = rf.ok;
+    for (size_t i = 0; ok && i < npix; i++)
+        ok = std::abs(rf.image[i] - fimg[i * 3 + 2]) <= 0.1;
+    expect(ok, "Small image float padding");
+}
+
+// Input statistics in the "st" chunk, and the optional chunks which are not known are skipped
+static void test_stats() {
+    const size_t xsize(517), ysize(389), bands(3);
+    auto img = synthetic<uint16_t>(xsize, ysize, bands, 4000);
+    auto r = roundtrip(img, xsize, ysize, bands, [](encsp e) { qb3_set_encoder_stats(e, true); });
+    expect(r.ok && r.image == img, "Statistics round trip");
+    vector<double> stats(4 * bands);
+    bool ok(false);
+    {
+        reader rd(r.stream);
+        ok = rd.p && qb3_get_stats(rd.p, stats.data());
+    }
+    for (size_t c = 0; ok && c < bands; c++) {
+        double vmin(65535), vmax(0), sum(0);
+        for (size_t i = c; i < img.size(); i += bands) {
+            vmin = std::min(vmin, double(img[i]));
+            vmax = std::max(vmax, double(img[i]));
+            sum += img[i];
+        }
+        ok = stats[4 * c] == vmin && stats[4 * c + 1] == vmax && stats[4 * c + 2] == sum
+            && stats[4 * c + 3] == xsize * ysize;
+    }
+    expect(ok, "Statistics chunk values");
+    auto rn = roundtrip(img, xsize, ysize, bands);
+    {
+        reader rd(rn.stream);
+        expect(rd.p && !qb3_get_stats(rd.p, stats.data()), "No statistics chunk");
+    }
+
+    // Truncated chunk
+    auto crafted(r.stream);
+    size_t st(find_chunk(crafted, "st"));
+    expect(0 != st, "Statistics chunk");
+    crafted.resize(st + 4 + 8);
+    {
+        reader rd(crafted);
+        expect(!rd.p, "Truncated statistics chunk");
+    }
+
+    // Unknown lower case chunks are skipped, including the empty ones
+    for (size_t len : {0, 5}) {
+        crafted = rn.stream;
+        vector<uint8_t> chunk = { 'z', 'z', uint8_t(len), 0 };
+        chunk.resize(4 + len, 0x55);
+        crafted.insert(crafted.begin() + find_chunk(crafted, "DT"), chunk.begin(), chunk.end());
+        vector<uint16_t> out(img.size());
+        reader rd(crafted);
+        expect(rd.p && qb3_read_data(rd.p, out.data()) && out == img, "Unknown chunk is skipped");
+    }
+    // Upper case ones are errors
+    crafted = rn.stream;
+    vector<uint8_t> chunk = { 'Z', 'Z', 0, 0 };
+    crafted.insert(crafted.begin() + find_chunk(crafted, "DT"), chunk.begin(), chunk.end());
+    reader rd(crafted);
+    expect(!rd.p, "Unknown required chunk");
+}
+
+// Rung summary in the "rs" chunk, and the headers rewritten when RLE or LZ are not used
+static void test_summary() {
+    const size_t xsize(256), ysize(130), bands(2), rows((ysize + 3) / 4);
+    // Constant top half, smooth with noise at the bottom
+    auto img = synthetic<uint8_t>(xsize, ysize, bands, 255);
+    std::fill(img.begin(), img.begin() + xsize * bands * ysize / 2, uint8_t(100));
+    auto summary = [](encsp e) { qb3_set_encoder_summary(e, true); };
+    auto r = roundtrip(img, xsize, ysize, bands, summary);
+    expect(r.ok && r.image == img, "Rung summary round trip");
+    vector<uint8_t> rungs(rows * bands);
+    bool ok(false);
+    {
+        reader rd(r.stream);
+        ok = rd.p && rows == qb3_get_rungs(rd.p, rungs.data());
+    }
+    // The block rows which overlap the bottom half are not constant, the first one starts from zero
+    for (size_t i = bands; ok && i < rungs.size(); i++)
+        ok = (i / bands < ysize / 8) == (0 == rungs[i]);
+    expect(ok, "Rung summary values");
+    auto rn = roundtrip(img, xsize, ysize, bands);
+    {
+        reader rd(rn.stream);
+        expect(rd.p && 0 == qb3_get_rungs(rd.p, nullptr), "No rung summary chunk");
+    }
+
+    // The summary and the checksums are the same with RLE or LZ, used for the constant half or not for the noisy image
+    auto noisy = synthetic<uint8_t>(xsize, ysize, bands, 255);
+    for (auto mode : { QB3M_RLE_H, QB3M_CF_RLE_H, QB3M_LZ_H, QB3M_CF_LZ_H }) {
+        const qb3_mode base(QB3M_RLE_H == mode || QB3M_LZ_H == mode ? QB3M_BASE_H : QB3M_CF_H);
+        for (auto source : { &img, &noisy }) {
+            auto rb = roundtrip(*source, xsize, ysize, bands, [&](encsp e) {
+                qb3_set_encoder_mode(e, base);
+                summary(e);
+                });
+            auto rm = roundtrip(*source, xsize, ysize, bands, [&](encsp e) {
+                qb3_set_encoder_mode(e, mode);
+                summary(e);
+                qb3_set_encoder_checksum(e, true);
+                }, [](decsp d) {
+                    qb3_set_decoder_verify(d, true);
+                    return true;
+                });
+            vector<uint8_t> rb_rungs(rungs.size()), rm_rungs(rungs.size());
+            reader db(rb.stream), dm(rm.stream);
+            ok = rm.ok && rm.image == *source && db.p && dm.p
+                && rows == qb3_get_rungs(db.p, rb_rungs.data()) && rows == qb3_get_rungs(dm.p, rm_rungs.data())
+                && rb_rungs == rm_rungs && qb3_get_checksum(dm.p)
+                && qb3_get_mode(dm.p) == (source == &img ? mode : base);
+            expect(ok, "Rung summary with RLE or LZ");
+        }
+    }
+}
+
+// The C++ API calls the kernels for the plain images, the stream is the same as from the C API
+template<typename T, size_t BANDS>
+static void test_hpp(size_t xsize, size_t ysize, qb3_mode mode, double vmax, bool direct) {
+    auto img = synthetic<T>(xsize, ysize, BANDS, vmax, unsigned(BANDS));
+    auto r = roundtrip(img, xsize, ysize, BANDS, [&](encsp e) { qb3_set_encoder_mode(e, mode); });
+    auto encoded = qb3::encode<T, BANDS>(img.data(), xsize, ysize, mode);
+    expect(r.ok && encoded == r.stream, "C++ API stream");
+    vector<T> out(img.size());
+    expect(qb3::decode<T, BANDS>(encoded.data(), encoded.size(), out.data(), xsize, ysize) && out == img,
+        "C++ API round trip");
+    qb3::decoder<T, BANDS> dec(encoded.data(), encoded.size());
+    expect(dec && direct == qb3_read_direct(dec.get()), "C++ API decoding kernel");
+}
+
+static void test_hpp() {
+    for (auto mode : { qb3_mode::QB3M_DEFAULT, qb3_mode::QB3M_BASE_H, qb3_mode::QB3M_BASE_Z }) {
+        test_hpp<uint8_t, 1>(517, 389, mode, 255, true);
+        test_hpp<uint8_t, 3>(517, 389, mode, 255, true);
+        test_hpp<uint8_t, 4>(61, 37, mode, 255, true);
+        test_hpp<uint8_t, 5>(61, 37, mode, 255, true);
+        test_hpp<uint16_t, 3>(61, 37, mode, 40000, true);
+        test_hpp<int16_t, 2>(61, 37, mode, 4000, true);
+        test_hpp<int32_t, 3>(61, 37, mode, 1e6, true);
+        test_hpp<uint64_t, 1>(61, 37, mode, 1e12, true);
+    }
+    // Encoded by the C API, the small ones are padded or stored
+    test_hpp<uint8_t, 3>(517, 389, qb3_mode::QB3M_BEST, 255, true);
+    test_hpp<uint16_t, 4>(61, 37, qb3_mode::QB3M_CF_H, 40000, true);
+    test_hpp<uint8_t, 3>(3, 11, qb3_mode::QB3M_DEFAULT, 255, false);
+    test_hpp<uint8_t, 3>(4, 4, qb3_mode::QB3M_DEFAULT, 255, false);
+    test_hpp<float, 1>(61, 37, qb3_mode::QB3M_DEFAULT, 1, true);
+
+    // A band mapping set through get(), the kernel is not the RGB one
+    const size_t xsize(61), ysize(37);
+    auto img = synthetic<uint8_t>(xsize, ysize, 3, 255);
+    size_t cband[3] = { 0, 0, 0 };
+    auto r = roundtrip(img, xsize, ysize, 3, [&](encsp e) { qb3_set_encoder_coreband(e, 3, cband); });
+    qb3::encoder<uint8_t, 3> enc(xsize, ysize);
+    expect(enc && qb3_set_encoder_coreband(enc.get(), 3, cband), "C++ API band mapping");
+    vector<uint8_t> encoded(enc.max_size());
+    encoded.resize(enc.encode(img.data(), encoded.data()));
+    expect(r.ok && encoded == r.stream, "C++ API stream with a band mapping");
+    // Noise doesn't compress, it is stored
+    mt19937 gen(7);
+    for (auto& v : img)
+        v = static_cast<uint8_t>(gen());
+    r = roundtrip(img, xsize, ysize, 3);
+    encoded = qb3::encode<uint8_t, 3>(img.data(), xsize, ysize);
+    expect(r.ok && encoded == r.stream && encoded.size() > img.size(), "C++ API stored image");
+}
+
+static int self_test() {
+    test_nodata();
+    test_linear();
+    test_float<float>();
+    test_float<double>();
+    test_sequence();
+    test_blockcopy();
+    test_adaptive();
+    test_tiny();
+    test_curve();
+    test_manybands();
+    test_largesize();
+    test_planar();
+    test_smallpad();
+    test_stats();
+    test_summary();
+    test_hpp();
+    cout << (failures ? "Failed " : "Passed ") << failures << endl;
+    return failures;
+}
+
 int test(string fname) {
     FILE* f = fopen(fname.c_str(), "rb");
     if (!f) {
@@ -515,6 +1622,10 @@ int main(int argc, char **argv)
     }
 #endif
 
+    // Regression tests only, the input image is not needed
+    if (argc > 1 && string(argv[1]) == "-t")
+        return self_test() ? 1 : 0;
+
     if (test_QB3) {
         if (argc < 2) {
             string fname;
@@ -721,6 +1832,49 @@ int main(int argc, char **argv)
             cout << endl;
             check<uint8_t>(image, raster, 1, 1, true, 1, 0, true);
             cout << endl;
+
+            cout << "\nPalette, synthetic map\n";
+            for (auto mode : { qb3_mode::QB3M_BEST, qb3_mode::QB3M_RLE_H, qb3_mode::QB3M_CF_LZ_H, qb3_mode::QB3M_FTL })
+                check_palette<uint8_t>(image, raster, mode);
+            check_palette<uint16_t>(image, raster, qb3_mode::QB3M_BEST);
+
+            cout << "\nBlock copy, tiled image\n";
+            check_blockcopy(image, raster);
+
+            cout << "\nBlock size, 16 bit\n";
+            check_blocksize(image, raster);
+
+            cout << "\nNoData, half empty image\n";
+            check_nodata(image, raster);
+
+            cout << "\nPlanar band groups\n";
+            check_planar(image, raster);
+
+            cout << "\nValidation\n";
+            check_validate(image, raster, qb3_mode::QB3M_DEFAULT);
+            check_validate(image, raster, qb3_mode::QB3M_BEST);
+
+            cout << "\nStrip checksums\n";
+            check_checksum(image, raster, qb3_mode::QB3M_DEFAULT);
+
+            cout << "\nC++ API\n";
+            check_hpp(image, raster);
+
+            cout << "\nBand sequential layout\n";
+            check_layout(image, raster);
+
+            cout << "\nFirst band\n";
+            check_bands(image, raster);
+
+            cout << "\n2D MED prediction\n";
+            check<uint16_t>(image, raster, 1, 1, true, 1, 0, false, true);
+            cout << endl;
+            check<uint16_t>(image, raster, 1, 1, false, 1, 0, false, true);
+            cout << endl;
+            check<uint8_t>(image, raster, 1, 1, true, 1, 0, false, true);
+            cout << endl;
+            check<uint8_t>(image, raster, 1, 1, false, 1, 0, false, true);
+            cout << endl;
         }
         else if (raster.dt == ICDT_Int16 || raster.dt == ICDT_UInt16) {
             std::vector<uint16_t> image(params.get_buffer_size() / 2);
@@ -739,6 +1893,29 @@ int main(int argc, char **argv)
             cout << endl;
             check<uint16_t>(image, raster, 1, 1, true);
             cout << endl;
+            check<uint16_t>(image, raster, 1, 1, true, true);
+            cout << endl;
+            check<uint16_t>(image, raster, 1, 1, false, true);
+            cout << endl;
+
+            cout << "\n8 bit output with alpha\n";
+            check_output(image, raster);
+
+            cout << "\nStatistics\n";
+            check_stats(image, raster);
+
+            // Elevation data is often stored as floating point
+            cout << "\nFloating point\n";
+            check<float>(image, raster, 1, 1, true);
+            cout << endl;
+            check<float>(image, raster, 1, 1);
+            cout << endl;
+            check<float>(image, raster, 1, 1, true, true);
+            cout << endl;
+            check<double>(image, raster, 1, 1, true);
+            cout << endl;
+            check<double>(image, raster, 1, 1, false, true);
+            cout << endl;
         }
         else {
             cerr << "Unsupported data type\n";
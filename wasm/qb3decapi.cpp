@@ -29,6 +29,8 @@ static const char *type(qb3_dtype type) {
         case QB3_I32: return "int32";
         case QB3_U64: return "uint64";
         case QB3_I64: return "int64";
+        case QB3_F32: return "float32";
+        case QB3_F64: return "float64";
         default: return "unknown";
     }
 }
@@ -52,6 +54,18 @@ static const char *mode(qb3_mode mode) {
         case QB3M_FTL: return "ftl";
 #endif
 
+#if defined(QB3_HAS_MED)
+        // 2D prediction modes
+        case QB3M_MED: return "med";
+        case QB3M_MED_BEST: return "med_best";
+#endif
+
+#if defined(QB3_HAS_LZ)
+        // LZ second stage modes
+        case QB3M_LZ_H: return "base_lz";
+        case QB3M_CF_LZ_H: return "best_lz";
+#endif
+
         case QB3M_STORED: return "stored";
         default: return "invalid";
     }
@@ -80,6 +94,12 @@ char *GetInfo(void *data, size_t sz) {
     j["mode"] = mode(qb3_get_mode(p));
     if (qb3_get_quanta(p) > 1)
         j["quanta"] = qb3_get_quanta(p);
+    if (qb3_get_maxerror(p) > 0)
+        j["maxerror"] = qb3_get_maxerror(p);
+    if (qb3_get_reference(p))
+        j["reference"] = true;
+    if (qb3_get_palette(p, 0, nullptr))
+        j["palette"] = true;
 
     size_t cband[QB3_MAXBANDS] = {0};
     if (qb3_get_coreband(p, cband)) {